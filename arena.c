@@ -0,0 +1,157 @@
+/**
+ * \file
+ * \brief Implementation of the shared payload arena
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <numa.h>
+
+#include "arena.h"
+#include "consensus.h"
+
+struct arena_chunk {
+    // replicas that did not yet execute the command in the chunk
+    uint32_t refs;
+    uint32_t gen;
+    // avoid false sharing
+    uint8_t padding[56];
+};
+
+/*
+ * A region belongs to a single client which is the only writer,
+ * the chunks are used round robin
+ */
+struct arena_region {
+    uint8_t* mem;
+    struct arena_chunk* chunks;
+    uint32_t next;
+};
+
+// every group has its own regions, one per client
+static uint32_t num_refs[CONS_MAX_GROUPS];
+static struct arena_region* regions[CONS_MAX_GROUPS*MAX_NUM_CLIENTS];
+
+// generation of every chunk the calling replica released last, a
+// duplicate of a command that was already executed releases nothing
+static __thread uint32_t* released[CONS_MAX_GROUPS*MAX_NUM_CLIENTS];
+
+static double get_time_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+void arena_init(uint8_t group, uint32_t refs)
+{
+    num_refs[group] = refs;
+}
+
+static struct arena_region* region_init(uint32_t region)
+{
+    struct arena_region* r = (struct arena_region*)
+                             calloc(1, sizeof(struct arena_region));
+    // local to the client that writes the commands
+    r->mem = (uint8_t*) numa_alloc_local(ARENA_CHUNK_SIZE*ARENA_NUM_CHUNKS);
+    r->chunks = (struct arena_chunk*) numa_alloc_local(sizeof(struct arena_chunk)*
+                                                       ARENA_NUM_CHUNKS);
+    if ((r->mem == NULL) || (r->chunks == NULL)) {
+        printf("Arena: failed to allocate region %d \n", region);
+        return NULL;
+    }
+    memset(r->chunks, 0, sizeof(struct arena_chunk)*ARENA_NUM_CHUNKS);
+
+    __atomic_store_n(&regions[region], r, __ATOMIC_RELEASE);
+    return r;
+}
+
+void* arena_alloc(uint32_t region, uint32_t len, struct arena_handle* handle)
+{
+    if ((len > ARENA_CHUNK_SIZE) ||
+        (region >= CONS_MAX_GROUPS*MAX_NUM_CLIENTS)) {
+        return NULL;
+    }
+
+    struct arena_region* r = regions[region];
+    if (r == NULL) {
+        r = region_init(region);
+        if (r == NULL) {
+            return NULL;
+        }
+    }
+
+    uint32_t i = r->next;
+    struct arena_chunk* c = &r->chunks[i];
+    // wait until every replica executed the previous command
+    if (__atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 0) {
+        double start = get_time_ms();
+        while (__atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) > 0) {
+            if ((get_time_ms() - start) > ARENA_ALLOC_TIMEOUT) {
+                printf("Arena: chunk %d of region %d still used by %d "
+                       "replicas \n", i, region,
+                       __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE));
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+
+    uint32_t gen = __atomic_load_n(&c->gen, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&c->gen, gen, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->refs, num_refs[region / MAX_NUM_CLIENTS],
+                     __ATOMIC_RELEASE);
+    r->next = (i+1) % ARENA_NUM_CHUNKS;
+
+    handle->region = region;
+    handle->offset = i*ARENA_CHUNK_SIZE;
+    handle->len = len;
+    handle->gen = gen;
+    return r->mem + handle->offset;
+}
+
+void* arena_get(struct arena_handle* handle)
+{
+    struct arena_region* r = __atomic_load_n(&regions[handle->region],
+                                             __ATOMIC_ACQUIRE);
+    struct arena_chunk* c = &r->chunks[handle->offset/ARENA_CHUNK_SIZE];
+    if (__atomic_load_n(&c->gen, __ATOMIC_ACQUIRE) != handle->gen) {
+        return NULL;
+    }
+    return r->mem + handle->offset;
+}
+
+void arena_release(struct arena_handle* handle)
+{
+    struct arena_region* r = __atomic_load_n(&regions[handle->region],
+                                             __ATOMIC_ACQUIRE);
+    uint32_t i = handle->offset/ARENA_CHUNK_SIZE;
+    struct arena_chunk* c = &r->chunks[i];
+    if (released[handle->region] == NULL) {
+        released[handle->region] = (uint32_t*) calloc(ARENA_NUM_CHUNKS,
+                                                      sizeof(uint32_t));
+    }
+
+    // nothing to release if this replica released the generation before
+    // or the chunk was reused, which needs the reference of this replica
+    uint32_t* gen = &released[handle->region][i];
+    if ((*gen == handle->gen) ||
+        (__atomic_load_n(&c->gen, __ATOMIC_ACQUIRE) != handle->gen)) {
+        return;
+    }
+    *gen = handle->gen;
+    __atomic_sub_fetch(&c->refs, 1, __ATOMIC_RELEASE);
+}
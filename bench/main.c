@@ -31,6 +31,13 @@
 #include <smlt_topology.h>
 #include "internal_com_layer.h"
 #include "consensus.h"
+#include "command.h"
+#include "arena.h"
+#include "one_replica.h"
+#include "shm_queue.h"
+#ifdef KVS
+#include "kvs.h"
+#endif
 
 //#define DEBUG
 static char default_path[] = "config.txt";
@@ -43,6 +50,74 @@ static void exec_fn(void* arg)
     return;   
 }
 
+// reads the lines with the cores of the nodes of a group
+static void read_node_cores(FILE* f, int num_replicas, int node_size,
+                            uint8_t* cores, uint8_t* cores2)
+{
+    int tmp;
+    for (int i = 0 ; i < num_replicas; i++){
+        for (int j = 0; j < node_size; j++) {
+            if  (j == 0) {
+                fscanf(f, "%d", &tmp);
+                cores[i] = (uint8_t) tmp;
+            } else if (j == node_size-1) {
+                fscanf(f, "%d \n", &tmp);
+                cores2[node_size*i+(j-1)] = (uint8_t) tmp;
+            } else {
+                fscanf(f, "%d ", &tmp);
+                cores2[node_size*i+(j-1)] = (uint8_t) tmp;
+            }
+        }
+    }
+}
+
+static void print_node_cores(int num_replicas, int node_size,
+                             uint8_t* cores, uint8_t* cores2)
+{
+    printf("Tier1 Cores \n");
+    for (int i = 0; i < num_replicas; i++)  {
+        printf("%d ", cores[i]);
+    }
+    printf("\n");
+    if (node_size > 1) {
+        printf("Tier2 Cores \n");
+        for (int i = 0; i < (num_replicas*node_size); i++)  {
+            if (((i % node_size) == 0) && (i != 0)) {
+                printf("\n");
+            } else if ((i % node_size) == (node_size-1)) {
+                continue;
+            }
+            printf("%d ", cores2[i]);
+        }
+        printf("\n");
+    }
+}
+
+// prevent from exit
+static void wait_for_exit(void)
+{
+    int runs = 0;
+    while(true){
+#ifdef BARRELFISH
+        thread_yield();
+#else
+        pthread_yield();
+#endif
+        sleep(21);
+        runs++;
+        if (runs > 5){
+            printf("Exit \n");
+            break;
+        }
+       
+    }
+
+#ifdef BARRELFISH
+        while(1)
+            ;
+#endif
+}
+
 int main(int argc, char ** argv)
 {
 #ifdef BARRELFISH
@@ -54,6 +129,86 @@ int main(int argc, char ** argv)
     int algo_below;
     char* config_path;
     int topo = 0;
+    int window = 1;
+    int cmd_size = CONS_DEFAULT_CMD_SIZE;
+    int batch_size = -1;
+    int batch_delay = -1;
+    long shm_size = SHM_SIZE;
+    int idle_policy = CONS_IDLE_POLICY;
+    long idle_spin = CONS_IDLE_SPIN_ROUNDS;
+    long idle_pause = CONS_IDLE_PAUSE_ROUNDS;
+    int num_groups = 1;
+
+    // options, the remaining arguments are positional
+    int num_args = 1;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--window") == 0) && (i+1 < argc)) {
+            window = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--cmd-size") == 0) && (i+1 < argc)) {
+            cmd_size = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--batch") == 0) && (i+1 < argc)) {
+            batch_size = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--batch-delay") == 0) && (i+1 < argc)) {
+            batch_delay = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--shm-size") == 0) && (i+1 < argc)) {
+            shm_size = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--idle") == 0) && (i+1 < argc)) {
+            i++;
+            if (strcmp(argv[i], "spin") == 0) {
+                idle_policy = CONS_IDLE_SPIN;
+            } else if (strcmp(argv[i], "pause") == 0) {
+                idle_policy = CONS_IDLE_PAUSE;
+            } else if (strcmp(argv[i], "park") == 0) {
+                idle_policy = CONS_IDLE_PARK;
+            } else {
+                printf("Idle policy has to be spin, pause or park \n");
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "--idle-spin") == 0) && (i+1 < argc)) {
+            idle_spin = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--idle-pause") == 0) && (i+1 < argc)) {
+            idle_pause = atol(argv[++i]);
+        } else if ((strcmp(argv[i], "--groups") == 0) && (i+1 < argc)) {
+            num_groups = atol(argv[++i]);
+#ifdef KVS
+        } else if (strcmp(argv[i], "--stale-reads") == 0) {
+            kvs_set_read_mode(KVS_READ_STALE);
+        } else if ((strcmp(argv[i], "--kvs-keys") == 0) && (i+1 < argc)) {
+            kvs_set_bench_keys(atol(argv[++i]));
+        } else if (strcmp(argv[i], "--kvs-snapshot") == 0) {
+            kvs_set_bench_snapshot(true);
+        } else if ((strcmp(argv[i], "--kvs-value") == 0) && (i+1 < argc)) {
+            kvs_set_bench_value(atol(argv[++i]));
+#endif
+        } else {
+            argv[num_args++] = argv[i];
+        }
+    }
+    argc = num_args;
+
+    if ((cmd_size <= 0) || (cmd_size > ARENA_CHUNK_SIZE)) {
+        printf("Command size has to be between 1 and %d bytes \n",
+               ARENA_CHUNK_SIZE);
+        return 1;
+    }
+
+    if ((num_groups < 1) || (num_groups > CONS_MAX_GROUPS)) {
+        printf("Number of groups has to be between 1 and %d \n",
+               CONS_MAX_GROUPS);
+        return 1;
+    }
+
+    if (shm_size < 4096) {
+        printf("Shared memory size has to be at least 4096 bytes \n");
+        return 1;
+    }
+    set_shm_size(shm_size);
+    consensus_set_idle_policy(idle_policy, idle_spin, idle_pause);
+
+    if ((batch_size >= 0) || (batch_delay >= 0)) {
+        set_batching_onepaxos(batch_size >= 0 ? batch_size : ONE_BATCH_SIZE,
+                              batch_delay >= 0 ? batch_delay : ONE_BATCH_DELAY);
+    }
 
     if (argc >= 3) {
        algo = atol(argv[1]);
@@ -76,6 +231,31 @@ int main(int argc, char ** argv)
 
     printf("Using config path: %s\n", config_path);
 
+    // the placement is discovered, the tier arguments only select whether
+    // failures are tolerated and whether every core is a replica
+    if (strcmp(config_path, "auto") == 0) {
+        if (num_groups > 1) {
+            printf("Several groups need a config file \n");
+            return 1;
+        }
+        if (consensus_init_auto(exec_fn,
+                                (algo == ALG_1PAXOS) || (algo == ALG_RAFT),
+                                algo_below != ALG_NONE) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        const cons_plan_t* plan = consensus_get_plan();
+
+        consensus_bench_clients_init(plan->total_cores,
+                                     (uint8_t*) plan->client_cores,
+                                     plan->num_clients, plan->num_replicas,
+                                     plan->cores[plan->num_replicas-1], 0,
+                                     plan->algo, plan->alg_below, topo,
+                                     window, cmd_size);
+        wait_for_exit();
+        consensus_print_executed();
+        return 0;
+    }
+
     FILE* f;
     f = fopen(config_path, "rw");
     
@@ -113,6 +293,9 @@ int main(int argc, char ** argv)
         case ALG_RAFT:
             printf("Protocol tier1 RAFT \n");
             break;
+        case ALG_SHM:
+            printf("Protocol tier1 SHM \n");
+            break;
         default:
             printf("Unkown Protocol tier1 \n");
             break;
@@ -129,6 +312,12 @@ int main(int argc, char ** argv)
         case ALG_BROAD:
             printf("Protocol tier2 BROAD \n");
             break;
+        case ALG_CHAIN:
+            printf("Protocol tier2 CHAIN \n");
+            break;
+        case ALG_RAFT:
+            printf("Protocol tier2 RAFT \n");
+            break;
         case ALG_SHM:
             printf("Protocol tier2 SHM \n");
             break;
@@ -141,54 +330,24 @@ int main(int argc, char ** argv)
 
     }   
 
+    printf("%d consensus groups \n", num_groups);
     printf("%d top level replicas \n", num_replicas);
     printf("%d node size \n", node_size);
     printf("%d clients \n", num_clients);
+    printf("%d outstanding requests per client \n", window);
+    printf("%d bytes per command \n", cmd_size);
+    printf("%ld bytes shared memory per node \n", shm_size);
     printf("############################################### \n");
-    uint8_t cores[num_replicas];
-    uint8_t cores2[num_replicas*node_size];
+    // every group has the same shape, the first one is listed before
+    // the clients and the others after them
+    uint8_t cores[num_groups][num_replicas];
+    uint8_t cores2[num_groups][num_replicas*node_size];
     memset(cores2, 0, sizeof(cores2));
     memset(cores, 0, sizeof(cores));
 
     int tmp;
-    for (int i = 0 ; i < num_replicas; i++){
-        for (int j = 0; j < node_size; j++) {
-            if  (j == 0) {
-                fscanf(f, "%d", &tmp);
-                cores[i] = (uint8_t) tmp;
-            } else if (j == node_size-1) {
-                fscanf(f, "%d \n", &tmp);
-                cores2[node_size*i+(j-1)] = (uint8_t) tmp;
-            } else {
-                fscanf(f, "%d ", &tmp);
-                cores2[node_size*i+(j-1)] = (uint8_t) tmp;
-            }
-        }
-    }
-
+    read_node_cores(f, num_replicas, node_size, cores[0], cores2[0]);
 
-    printf("############################################### \n");
-    printf("Tier1 Cores \n");
-    for (int i = 0; i < num_replicas; i++)  {
-        printf("%d ", cores[i]);
-    }
-    printf("\n");
-    if (node_size > 1) {
-        printf("Tier2 Cores \n");
-        for (int i = 0; i < (num_replicas*node_size); i++)  {
-            if (((i % node_size) == 0) && (i != 0)) {
-                printf("\n");
-            } else if ((i % node_size) == (node_size-1)) {
-                continue;
-            }
-            printf("%d ", cores2[i]);
-        }
-        printf("\n");
-    }
-    printf("############################################### \n");
-
-    printf("############################################### \n");
-    
     uint8_t client_cores[num_clients];
     memset(client_cores, 0, sizeof(client_cores));
     for (int i = 0; i < num_clients; i++) {
@@ -196,6 +355,17 @@ int main(int argc, char ** argv)
         client_cores[i] = (uint8_t) tmp;
     }   
 
+    for (int g = 1; g < num_groups; g++) {
+        read_node_cores(f, num_replicas, node_size, cores[g], cores2[g]);
+    }
+
+    for (int g = 0; g < num_groups; g++) {
+        printf("############################################### \n");
+        printf("Group %d \n", g);
+        print_node_cores(num_replicas, node_size, cores[g], cores2[g]);
+    }
+    printf("############################################### \n");
+
     printf("Client on cores: \n");
     for (int i = 0; i < num_clients; i++) {
         printf("%d ", client_cores[i]);
@@ -209,16 +379,26 @@ int main(int argc, char ** argv)
     }
 #endif
 
-    consensus_init(num_cores,
-                   algo,
-                   cores,
-                   num_replicas,
-                   num_clients,
-                   algo_below,
-                   node_size,
-                   cores2,
-                   client_cores,
-                   exec_fn);
+    if (consensus_init(num_cores,
+                       algo,
+                       cores[0],
+                       num_replicas,
+                       num_clients,
+                       algo_below,
+                       node_size,
+                       cores2[0],
+                       client_cores,
+                       exec_fn) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int g = 1; g < num_groups; g++) {
+        if (consensus_init_group(num_cores, algo, cores[g], num_replicas,
+                                 num_clients, algo_below, node_size,
+                                 cores2[g], client_cores, exec_fn) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
 /*
 #ifdef SMLT
@@ -227,38 +407,20 @@ int main(int argc, char ** argv)
     }
 #endif
 */
-    sleep(5);
 #ifdef DEBUG
     consensus_bench_clients_init(num_cores, client_cores, num_clients, 
-                                 num_replicas, cores[num_replicas-1], 1, 
-                                 algo, algo_below, topo, cores);
+                                 num_replicas, cores[0][num_replicas-1], 1, 
+                                 algo, algo_below, topo, window,
+                                 cmd_size);
 #else
     consensus_bench_clients_init(num_cores, client_cores, num_clients, 
-                                 num_replicas, cores[num_replicas-1], 0, 
-                                 algo, algo_below, topo, cores);
-#endif
-
-    // prevent from exit
-    int runs = 0;
-    while(true){
-#ifdef BARRELFISH
-        thread_yield();
-#else
-        pthread_yield();
+                                 num_replicas, cores[0][num_replicas-1], 0, 
+                                 algo, algo_below, topo, window,
+                                 cmd_size);
 #endif
-        sleep(21);
-        runs++;
-        if (runs > 5){
-            printf("Exit \n");
-            break;
-        }
-       
-    }
 
-#ifdef BARRELFISH
-        while(1)
-            ;
-#endif
+    wait_for_exit();
+    consensus_print_executed();
     return 0;
 }
 
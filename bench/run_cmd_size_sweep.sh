@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Runs a protocol with increasing command sizes to see the cost per byte
+# usage: ./run_cmd_size_sweep.sh <tier1> <tier2> <config> [executable]
+
+function error() {
+	echo $1
+	exit 1
+}
+
+[[ $# -ge 3 ]] || error "usage: $0 <tier1> <tier2> <config> [executable]"
+
+ALGO=$1
+ALGO_BELOW=$2
+CONFIG=$3
+BENCH=${4:-./start_bench}
+
+declare -a sizes=(8 24 64 128 256 512 1024 2048 4096)
+
+export LD_LIBRARY_PATH=.:$LD_LIBRARY_PATH
+
+for s in "${sizes[@]}"
+do
+    $BENCH --cmd-size $s $ALGO $ALGO_BELOW "$CONFIG" \
+        || error "Failed to execute $BENCH --cmd-size $s $ALGO $ALGO_BELOW"
+done
+
+exit 0
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Runs a protocol with 1 up to max_groups consensus groups to see how the
+# aggregate throughput scales, the config has to list max_groups groups
+# usage: ./run_groups.sh <tier1> <tier2> <config> <max_groups> [executable]
+
+function error() {
+	echo $1
+	exit 1
+}
+
+[[ $# -ge 4 ]] || error "usage: $0 <tier1> <tier2> <config> <max_groups> [executable]"
+
+ALGO=$1
+ALGO_BELOW=$2
+CONFIG=$3
+MAX_GROUPS=$4
+BENCH=${5:-./start_bench}
+
+export LD_LIBRARY_PATH=.:$LD_LIBRARY_PATH
+
+for g in $(seq 1 $MAX_GROUPS)
+do
+    echo "########## groups $g ##########"
+    $BENCH --groups $g $ALGO $ALGO_BELOW "$CONFIG" \
+        || error "Failed to execute $BENCH --groups $g $ALGO $ALGO_BELOW"
+done
+
+exit 0
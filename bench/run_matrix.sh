@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Runs every valid combination of a tier1 and a tier2 protocol
+# usage: ./run_matrix.sh <config> [executable]
+#
+# The config needs node_size > 1 for the combinations with a tier2
+# protocol, 1Paxos, TPC, Chain and Raft below need node_size >= 3.
+#
+# SHM over SHM is run once more and has to end with the same number of
+# executed commands on every replica of both tiers.
+
+function error() {
+	echo $1
+	exit 1
+}
+
+[[ $# -ge 1 ]] || error "usage: $0 <config> [executable]"
+
+CONFIG=$1
+BENCH=${2:-./start_bench}
+
+# 1Paxos TPC BROAD CHAIN RAFT SHM
+declare -a tier1=(0 1 2 3 4 5)
+# 1Paxos TPC BROAD CHAIN RAFT SHM NONE
+declare -a tier2=(0 1 2 3 4 5 6)
+
+export LD_LIBRARY_PATH=.:$LD_LIBRARY_PATH
+
+for a in "${tier1[@]}"
+do
+    for b in "${tier2[@]}"
+    do
+        echo "########## tier1 $a tier2 $b ##########"
+        $BENCH $a $b "$CONFIG" \
+            || error "Failed to execute $BENCH $a $b $CONFIG"
+    done
+done
+
+# every replica prints "Executed: group G level L core C commands N"
+function check_executed() {
+    awk '/^Executed:/ {
+             if (!($3 in count)) { count[$3] = $9 }
+             if (($9 != count[$3]) || ($9 == 0)) { bad = 1 }
+             if ($5 == "core") { core = 1 }
+         }
+         END { exit (bad || !core) }' "$1"
+}
+
+set -o pipefail
+LOG=$(mktemp)
+echo "########## tier1 SHM tier2 SHM, executed commands ##########"
+$BENCH 5 5 "$CONFIG" | tee "$LOG" \
+    || error "Failed to execute $BENCH 5 5 $CONFIG"
+check_executed "$LOG" \
+    || error "SHM over SHM: replicas executed different numbers of commands"
+rm -f "$LOG"
+
+exit 0
@@ -27,6 +27,7 @@
 #include "broadcast_replica.h"
 #include "internal_com_layer.h"
 #include "client.h"
+#include "doorbell.h"
 
 
 #define BROAD_COMMIT 4
@@ -61,9 +62,9 @@ typedef struct replica_t{
 } replica_t;
 
 static __thread replica_t replica;
-extern struct smlt_context* ctx;
+extern __thread struct smlt_context* ctx;
 
-static void update_value(void* cmd);
+static void update_value(uintptr_t* msg);
 static void handle_request(struct smlt_msg* msg);
 
 static void handle_setup(struct smlt_msg* msg);
@@ -163,7 +164,7 @@ static void message_handler_broadcast(struct smlt_msg* msg)
 void message_handler_loop_broadcast(void)
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(CONS_MSG_SIZE);
     COND_PANIC(message!=NULL, "Failed to allocate Smelt message");
     if (replica.id == 0) {
         int j = 0;
@@ -175,7 +176,9 @@ void message_handler_loop_broadcast(void)
                     panic("Error when calling smlt_recv for replica j");
                 }
                 message_handler_broadcast(message);
-            }    
+            } else {
+                com_layer_core_poll();
+            }
             j++;
 
             j = j % (replica.num_clients);
@@ -184,6 +187,11 @@ void message_handler_loop_broadcast(void)
     } else {
        
         while (true) {
+            // a partial batch for the core level is sent after its delay
+            if (!smlt_broadcast_can_recv(ctx)) {
+                com_layer_core_poll();
+                continue;
+            }
             err = smlt_broadcast(ctx, message);
             if (smlt_err_is_fail(err)){
                 panic("Error when calling smlt_recv");
@@ -196,22 +204,29 @@ void message_handler_loop_broadcast(void)
 void message_handler_loop_broadcast(void) 
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(CONS_MSG_SIZE);
     COND_PANIC(message!=NULL, "Failed to allocate Smelt message");
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
     if (replica.id == 0) {
-        int j = 0;
+        // the leader only receives from the clients
+        doorbell_loop_t loop;
+        doorbell_loop_init(&loop, replica.current_core, NULL, 0,
+                           replica.clients, replica.num_clients);
     
         while (true) {
-            if (smlt_can_recv(replica.clients[j])) {
-                err = smlt_recv(replica.clients[j], message);   
+            int core = doorbell_next(&loop, true);
+            if (core >= 0) {
+                err = smlt_recv(core, message);   
                 if (smlt_err_is_fail(err)) {
                     panic("Error when calling smlt_recv for replica j");
                 }
                 message_handler_broadcast(message);
-            }    
-            j++;
-
-            j = j % replica.num_clients;
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle(&loop, &idle);
+            }
         }
 
     } else {
@@ -224,7 +239,11 @@ void message_handler_loop_broadcast(void)
                 }
 
                 message_handler_broadcast(message);
-            }    
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(replica.replicas[0], &idle);
+            }
         }
     }
 
@@ -245,7 +264,7 @@ static void handle_setup(struct smlt_msg* msg)
         }
     }
 
-    err = smlt_send(core, msg);
+    err = doorbell_send(core, msg);
     if (smlt_err_is_fail(err)) {
         //  TODO
     }
@@ -272,7 +291,7 @@ static void handle_request(struct smlt_msg* msg)
         }
 #else
         for (int i = 1; i < replica.num_replicas; i++) {
-            err = smlt_send(replica.replicas[i], msg);
+            err = doorbell_send(replica.replicas[i], msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -287,14 +306,14 @@ static void handle_request(struct smlt_msg* msg)
                 com_layer_core_send_request(msg);
             }
    
-            update_value(&msg->data[4]);
-            err = smlt_send(replica.clients[get_client_id(msg->data)], msg);
+            update_value(msg->data);
+            err = doorbell_send(replica.clients[get_client_id(msg->data)], msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
         } else {
-            update_value(&msg->data[4]);
-            err = smlt_send(replica.started_from, msg);
+            update_value(msg->data);
+            err = doorbell_send(replica.started_from, msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -314,7 +333,7 @@ static void handle_commit(struct smlt_msg* msg)
         if (replica.alg_below != ALG_NONE) {
             com_layer_core_send_request(msg);
         }
-        update_value(&msg->data[4]);
+        update_value(msg->data);
     } else {
         printf("Replica %d: leader should not receive commit\n", replica.id);
         return;
@@ -370,7 +389,7 @@ void init_replica_broadcast(uint8_t id,
                             replica.current_core,
                             replica.cores, 
                             replica.node_size, 
-                            24,
+                            consensus_get_cmd_size(),
                             replica.exec_fn);
     }
 
@@ -385,9 +404,9 @@ void init_replica_broadcast(uint8_t id,
 
 }
 
-static void update_value(void* cmd)
+static void update_value(uintptr_t* msg)
 {
-    replica.exec_fn(cmd);
+    consensus_exec_cmd(replica.exec_fn, &msg[CONS_HDR_WORDS], get_cmd_len(msg));
     return;
 }
 
@@ -26,6 +26,7 @@
 #include "chain_replica.h"
 #include "internal_com_layer.h"
 #include "client.h"
+#include "doorbell.h"
 
 
 #define CHAIN_COMMIT 4
@@ -65,7 +66,7 @@ typedef struct replica_t{
 
 static __thread replica_t replica;
 
-static void update_value(void* cmd);
+static void update_value(uintptr_t* msg);
 static void handle_request(struct smlt_msg* msg);
 
 static void handle_setup(struct smlt_msg* msg);
@@ -165,21 +166,28 @@ static void message_handler_chain(struct smlt_msg* msg)
 void message_handler_loop_chain(void) 
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(CONS_MSG_SIZE);
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
     if (replica.id == 0) {
-        int j = 0;
-    
+        // the head only receives from the clients
+        doorbell_loop_t loop;
+        doorbell_loop_init(&loop, replica.current_core, NULL, 0,
+                           replica.clients, replica.num_clients);
+
         while (true) {
-            if (smlt_can_recv(replica.clients[j])) {
-                err = smlt_recv(replica.clients[j], message);
+            int core = doorbell_next(&loop, true);
+            if (core >= 0) {
+                err = smlt_recv(core, message);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
                 message_handler_chain(message);
-            }    
-            j++;
-
-            j = j % replica.num_clients;
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle(&loop, &idle);
+            }
         }
 
     } else {
@@ -191,7 +199,11 @@ void message_handler_loop_chain(void)
                     // TODO
                 }
                 message_handler_chain(message);
-            }    
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(replica.replicas[replica.rep_left], &idle);
+            }
         }
     }
 
@@ -211,7 +223,7 @@ static void handle_setup(struct smlt_msg* msg)
         }
     }
 
-    err = smlt_send(core, msg);
+    err = doorbell_send(core, msg);
     if (smlt_err_is_fail(err)) {
         // TODO
     }
@@ -230,7 +242,7 @@ static void handle_request(struct smlt_msg* msg)
     if (replica.id == 0) {
         set_tag(msg->data, CHAIN_COMMIT);
         // send to next
-        err = smlt_send(replica.replicas[1], msg);
+        err = doorbell_send(replica.replicas[1], msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
@@ -242,10 +254,10 @@ static void handle_request(struct smlt_msg* msg)
                 com_layer_core_send_request(msg);
             }
    
-            update_value(&msg->data[4]);
+            update_value(msg->data);
         } else {
-            update_value(&msg->data[4]);
-            smlt_send(replica.started_from, msg);
+            update_value(msg->data);
+            doorbell_send(replica.started_from, msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -260,13 +272,14 @@ static void handle_commit(struct smlt_msg* msg)
     errval_t err;
     if (replica.id != 0) {
         if (!replica.is_tail) {
-            err = smlt_send(replica.replicas[replica.rep_right], msg);
+            err = doorbell_send(replica.replicas[replica.rep_right], msg);
             if (smlt_err_is_fail(err)){
                 // TODO
             }
-        } else {
+        } else if (replica.level == NODE_LEVEL) {
+            // on the core level the leader already acked the request
             set_tag(msg->data, RESP_TAG);
-            err = smlt_send(replica.clients[get_client_id(msg->data)], msg);
+            err = doorbell_send(replica.clients[get_client_id(msg->data)], msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -275,7 +288,7 @@ static void handle_commit(struct smlt_msg* msg)
         if (replica.alg_below != ALG_NONE) {
             com_layer_core_send_request(msg);
         }
-        update_value(&msg->data[4]);
+        update_value(msg->data);
     } else {
         printf("Replica %d: leader should not receive commit\n", replica.id);
         return;
@@ -331,7 +344,7 @@ void init_replica_chain(uint8_t id,
                             replica.current_core,
                             replica.cores, 
                             replica.node_size, 
-                            24,
+                            consensus_get_cmd_size(),
                             replica.exec_fn);
     }
 
@@ -351,9 +364,9 @@ void init_replica_chain(uint8_t id,
     }
 }
 
-static void update_value(void* cmd)
+static void update_value(uintptr_t* msg)
 {
-    replica.exec_fn(cmd);
+    consensus_exec_cmd(replica.exec_fn, &msg[CONS_HDR_WORDS], get_cmd_len(msg));
     return;
 }
 
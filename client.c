@@ -25,7 +25,9 @@
 #include <sys/stat.h>
 
 #include "client.h"
+#include "doorbell.h"
 #include "consensus.h"
+#include "arena.h"
 #include "crc.h"
 #include "incremental_stats.h"
 
@@ -38,15 +40,35 @@ typedef struct client_t{
     uint8_t algo_below;
     uint8_t current_core;
     uint8_t last_replica;
-    uint8_t recv_from;
     bool replied;
     bool setup_done;
 
     uint32_t last_rid;
     uintptr_t* last_payload;
     struct smlt_msg* msg_buf;
-
-    uint8_t current_leader;
+    struct smlt_msg* recv_buf;
+
+    // pipelined requests, slot is request id % MAX_WINDOW
+    uint16_t window;
+    uint16_t outstanding;
+    // size of the commands the benchmark sends
+    uint16_t cmd_size;
+    bool in_flight[MAX_WINDOW];
+    // replies a blocking send received for submits, oldest first, they
+    // are returned by the next poll
+    uint32_t completed[MAX_WINDOW];
+    uint16_t num_completed;
+
+    // command in the arena that is not yet submitted
+    struct arena_handle handle;
+
+    // connection to every group, the id is the one the group assigned
+    uint8_t num_groups;
+    int ids[CONS_MAX_GROUPS];
+    uint8_t leaders[CONS_MAX_GROUPS];
+    uint8_t recv_from[CONS_MAX_GROUPS];
+    // group of the command in the arena
+    uint8_t cmd_group;
     bool first;
     bool exit;
     uint8_t topo;
@@ -89,34 +111,256 @@ static void* measure_thread(void* args)
     return 0;
 }
 
-int consensus_send_request(uintptr_t* payload)
+void consensus_set_window(uint16_t window)
+{
+    if (window == 0) {
+        window = 1;
+    }
+    client->window = MIN(window, MAX_WINDOW);
+}
+
+uint16_t consensus_outstanding(void)
+{
+    return client->outstanding;
+}
+
+static bool window_full(void)
+{
+    // the kept replies count as well, they always fit into completed
+    return (client->outstanding >= client->window) ||
+           ((client->outstanding + client->num_completed) >= MAX_WINDOW) ||
+           client->in_flight[client->request_count % MAX_WINDOW];
+}
+
+/*
+ * Sends a command that is carried in the message to a group, len is the
+ * length field of the header. The request ids are unique over all groups.
+ */
+static int64_t submit_msg(uint8_t group, void* payload, uint16_t len)
 {
     errval_t err;
+    uint32_t rid = client->request_count;
+    if (window_full()) {
+        return -1;
+    }
+
     client->last_payload = payload;
-    client->last_rid = client->request_count;
-        
-    set_tag(&client->msg_buf->data[0], REQ_TAG);
-    set_client_id(&client->msg_buf->data[0], client->id);
-    set_request_id(&client->msg_buf->data[0], client->request_count);
-    client->msg_buf->data[4] = payload[0];
-    client->msg_buf->data[5] = payload[1];
-    client->msg_buf->data[6] = payload[2];
-    client->msg_buf->data[3] = client->recv_from;
-
-    err = smlt_send(client->current_leader, client->msg_buf);
-    if (smlt_err_is_fail(err)) {
-        // TODO
-    }   
+    client->last_rid = rid;
 
-    err = smlt_recv(client->recv_from, client->msg_buf);
+    set_tag(&client->msg_buf->data[0], REQ_TAG);
+    set_client_id(&client->msg_buf->data[0], client->ids[group]);
+    set_request_id(&client->msg_buf->data[0], rid);
+    set_cmd_len(&client->msg_buf->data[0], len);
+    memcpy(&client->msg_buf->data[CONS_HDR_WORDS], payload, CONS_CMD_BYTES(len));
+    client->msg_buf->data[3] = client->recv_from[group];
+    // only send the words the command occupies
+    client->msg_buf->words = get_msg_words(&client->msg_buf->data[0]);
+
+    err = doorbell_send(client->leaders[group], client->msg_buf);
     if (smlt_err_is_fail(err)) {
-        // TODO
+        return -1;
     }
+
+    client->in_flight[rid % MAX_WINDOW] = true;
+    client->outstanding++;
     client->request_count++;
+    return rid;
+}
+
+// the chunk is released by the replicas of the group it is sent to
+static void* cmd_alloc(uint8_t group, uint16_t len)
+{
+    client->cmd_group = group;
+    return arena_alloc(ARENA_REGION(group, client->ids[group]), len,
+                       &client->handle);
+}
+
+void* consensus_cmd_alloc(uint16_t len)
+{
+    return cmd_alloc(0, len);
+}
 
+void* consensus_cmd_alloc_key(uint64_t key, uint16_t len)
+{
+    return cmd_alloc(consensus_group_of(key), len);
+}
+
+int64_t consensus_submit_cmd(void)
+{
+    return submit_msg(client->cmd_group, &client->handle,
+                      CONS_CMD_HANDLE | sizeof(struct arena_handle));
+}
+
+static int64_t submit_group(uint8_t group, uintptr_t* payload, uint16_t len)
+{
+    if (len <= consensus_get_cmd_size()) {
+        return submit_msg(group, payload, len);
+    }
+
+    // larger commands are written to the arena, only the handle is sent
+    if ((len > ARENA_CHUNK_SIZE) || window_full()) {
+        return -1;
+    }
+
+    void* cmd = cmd_alloc(group, len);
+    if (cmd == NULL) {
+        return -1;
+    }
+    memcpy(cmd, payload, len);
+    return consensus_submit_cmd();
+}
+
+int64_t consensus_submit_len(uintptr_t* payload, uint16_t len)
+{
+    return submit_group(0, payload, len);
+}
+
+int64_t consensus_submit_key(uint64_t key, uintptr_t* payload, uint16_t len)
+{
+    return submit_group(consensus_group_of(key), payload, len);
+}
+
+int64_t consensus_submit(uintptr_t* payload)
+{
+    return consensus_submit_len(payload, CONS_DEFAULT_CMD_SIZE);
+}
+
+// receives the replies that arrived so far
+static int recv_completions(uint32_t* rids, int max)
+{
+    errval_t err;
+    int num = 0;
+    for (int g = 0; g < client->num_groups; g++) {
+        while ((num < max) && (client->outstanding > 0) &&
+               smlt_can_recv(client->recv_from[g])) {
+            err = smlt_recv(client->recv_from[g], client->recv_buf);
+            if (smlt_err_is_fail(err)) {
+                break;
+            }
+
+            uint32_t rid = get_request_id(&client->recv_buf->data[0]);
+            // reply to a request we do not wait for (anymore)
+            if (!client->in_flight[rid % MAX_WINDOW]) {
+                continue;
+            }
+
+            client->in_flight[rid % MAX_WINDOW] = false;
+            client->outstanding--;
+            rids[num] = rid;
+            num++;
+        }
+    }
+    return num;
+}
+
+int consensus_poll_completions(uint32_t* rids, int max)
+{
+    uint32_t done[MAX_WINDOW];
+    int num = 0;
+
+    // replies a blocking send received first
+    if (client->num_completed > 0) {
+        num = MIN(max, client->num_completed);
+        if (rids != NULL) {
+            memcpy(rids, client->completed, num*sizeof(uint32_t));
+        }
+        client->num_completed -= num;
+        memmove(client->completed, &client->completed[num],
+                client->num_completed*sizeof(uint32_t));
+    }
+
+    int recvd = recv_completions(done, MIN(max - num, MAX_WINDOW));
+    if (rids != NULL) {
+        memcpy(&rids[num], done, recvd*sizeof(uint32_t));
+    }
+    return num + recvd;
+}
+
+// receives replies and keeps them for the next poll, returns true if the
+// reply to rid was one of them
+static bool keep_completions(int64_t rid)
+{
+    uint32_t done[MAX_WINDOW];
+    bool found = false;
+
+    int num = recv_completions(done, MAX_WINDOW);
+    for (int i = 0; i < num; i++) {
+        if (done[i] == (uint32_t) rid) {
+            found = true;
+        } else {
+            client->completed[client->num_completed++] = done[i];
+        }
+    }
+    return found;
+}
+
+// a blocking send waits for a free slot, the replies of submits that
+// arrive meanwhile are kept. Returns false if no slot gets free because
+// the replies were not polled
+static bool wait_for_slot(void)
+{
+    if (client->outstanding == 0) {
+        printf("Client %d: no free slot, blocking send failed (%d replies "
+               "not polled) \n", client->id, client->num_completed);
+        return false;
+    }
+    keep_completions(-1);
+    return true;
+}
+
+static void wait_for_request(int64_t rid)
+{
+    while (!keep_completions(rid)) {
+    }
+}
+
+static int send_request_group(uint8_t group, uintptr_t* payload, uint16_t len)
+{
+    int64_t rid;
+
+    if (len > ARENA_CHUNK_SIZE) {
+        return -1;
+    }
+
+    while ((rid = submit_group(group, payload, len)) < 0) {
+        if (!wait_for_slot()) {
+            return -1;
+        }
+    }
+
+    wait_for_request(rid);
     return 0;
 }
 
+int consensus_send_request_len(uintptr_t* payload, uint16_t len)
+{
+    return send_request_group(0, payload, len);
+}
+
+int consensus_send_request_key(uint64_t key, uintptr_t* payload, uint16_t len)
+{
+    return send_request_group(consensus_group_of(key), payload, len);
+}
+
+int consensus_send_cmd(void)
+{
+    int64_t rid;
+
+    while ((rid = consensus_submit_cmd()) < 0) {
+        if (!wait_for_slot()) {
+            return -1;
+        }
+    }
+
+    wait_for_request(rid);
+    return 0;
+}
+
+int consensus_send_request(uintptr_t* payload)
+{
+    return consensus_send_request_len(payload, CONS_DEFAULT_CMD_SIZE);
+}
+
 int init_consensus_client(void)
 {
     errval_t err;
@@ -128,9 +372,15 @@ int init_consensus_client(void)
     client->exit = false;
     client->current_run = 0;
     client->id = -1;
-    client->msg_buf = smlt_message_alloc(56);
+    client->msg_buf = smlt_message_alloc(CONS_MSG_SIZE);
+    client->recv_buf = smlt_message_alloc(CONS_MSG_SIZE);
     // set client information that is needed
     client->request_count = 0;
+    client->outstanding = 0;
+    client->num_completed = 0;
+    if (client->window == 0) {
+        client->window = 1;
+    }
     client->id = -1;
     init_stats(&client->rt[0]);
 
@@ -140,17 +390,23 @@ int init_consensus_client(void)
 
     set_tag(&client->msg_buf->data[0], SETUP_TAG);
     set_client_id(&client->msg_buf->data[0], client->current_core);
+    set_cmd_len(&client->msg_buf->data[0], sizeof(uintptr_t));
+    client->msg_buf->words = get_msg_words(&client->msg_buf->data[0]);
+
+    // every group assigns its own id
+    for (int g = 0; g < client->num_groups; g++) {
+        err = doorbell_send(client->leaders[g], client->msg_buf);
+        if (smlt_err_is_fail(err)) {
+            // TODO
+        }
 
-    err = smlt_send(client->current_leader, client->msg_buf);
-    if (smlt_err_is_fail(err)) {
-        // TODO
-    }
-
-    err = smlt_recv(client->current_leader, client->msg_buf);
-    if (smlt_err_is_fail(err)) {
-        // TODO
+        err = smlt_recv(client->leaders[g], client->recv_buf);
+        if (smlt_err_is_fail(err)) {
+            // TODO
+        }
+        client->ids[g] = client->recv_buf->data[4];
     }
-    client->id = client->msg_buf->data[4];
+    client->id = client->ids[0];
 
     client->setup_done = true;
 
@@ -171,8 +427,9 @@ int init_consensus_client_bench(int current_core,
                                 int num_replicas,
                                 int num_clients,
                                 int topo,
-                                int last_replica,
-                                int leader)
+                                int num_groups,
+                                uint8_t* recv_from,
+                                uint8_t* leaders)
 {
     client = (client_t* )calloc(1, sizeof(client_t));
     client->current_core = current_core;
@@ -181,39 +438,65 @@ int init_consensus_client_bench(int current_core,
     client->num_replicas = num_replicas;
     client->num_clients = num_clients;
     client->topo = topo;
-    client->recv_from = last_replica;
-    client->current_leader = leader;
+    client->num_groups = MIN(MAX(num_groups, 1), CONS_MAX_GROUPS);
+    for (int g = 0; g < client->num_groups; g++) {
+        client->recv_from[g] = recv_from[g];
+        client->leaders[g] = leaders[g];
+    }
 
     return init_consensus_client();
 }
 
 /*
  * Helper functions
+ *
+ * Layout of the header word data[0]
+ * bytes 0-3 request id
+ * bytes 4-5 length of the command
+ * byte  6   client id
+ * byte  7   tag
  */
 
 uint16_t get_tag(uintptr_t* msg)
 {
-    uint16_t* result = (uint16_t*) msg;
-    return result[3];
+    uint8_t* result = (uint8_t*) msg;
+    return result[7];
 }
 
 void set_tag(uintptr_t* msg, uint16_t tag)
 {
-    uint16_t* result = (uint16_t*) msg;
-    result[3] = tag;
+    uint8_t* result = (uint8_t*) msg;
+    result[7] = tag;
 }
 
 uint16_t get_client_id(uintptr_t* msg)
 {
-    uint16_t* result = (uint16_t*) msg;
-    return result[2];
+    uint8_t* result = (uint8_t*) msg;
+    return result[6];
 }
 
 
 void set_client_id(uintptr_t* msg, uint16_t cid)
+{
+    uint8_t* result = (uint8_t*) msg;
+    result[6] = cid;
+}
+
+uint16_t get_cmd_len(uintptr_t* msg)
 {
     uint16_t* result = (uint16_t*) msg;
-    result[2] = cid;
+    return result[2];
+}
+
+void set_cmd_len(uintptr_t* msg, uint16_t len)
+{
+    uint16_t* result = (uint16_t*) msg;
+    result[2] = len;
+}
+
+uint32_t get_msg_words(uintptr_t* msg)
+{
+    return CONS_HDR_WORDS + CONS_CMD_WORDS(CONS_CMD_BYTES(get_cmd_len(msg)));
 }
 
 uint32_t get_request_id(uintptr_t* msg)
@@ -258,9 +541,9 @@ static void print_results_file(void) {
     FILE* f = fopen(f_name, "a");
     COND_PANIC(f!=NULL, "could not open result file");
 #endif
-    RESULT_PRINTF(f, "Algo %d algo_below %d num_clients %d \n", 
+    RESULT_PRINTF(f, "Algo %d algo_below %d num_clients %d window %d cmd_size %d \n", 
             client->algo, client->algo_below,
-            client->num_clients);
+            client->num_clients, client->window, client->cmd_size);
     incr_stats avg_avg, avg_stdv;
     init_stats(&avg_avg);
     init_stats(&avg_stdv);
@@ -285,7 +568,8 @@ static void print_results_file(void) {
 /*
  * Start benchmark client
  */
-static __thread uintptr_t payload[3];
+static __thread uintptr_t payload[CONS_CMD_WORDS(ARENA_CHUNK_SIZE)];
+static __thread uint64_t submit_time[MAX_WINDOW];
 void* init_benchmark_client(void* args) 
 {
     benchmark_client_args_t* cl = (benchmark_client_args_t*) args;
@@ -295,6 +579,7 @@ void* init_benchmark_client(void* args)
                                 cl->num_replicas,
                                 cl->num_clients,
                                 cl->topo,
+                                cl->num_groups,
                                 cl->recv_from,
                                 cl->leader);
 #ifdef BARRELFISH
@@ -309,13 +594,42 @@ void* init_benchmark_client(void* args)
     uint64_t start;
     uint64_t end;
 
+    consensus_set_window(cl->window);
+    client->cmd_size = MIN(cl->cmd_size, ARENA_CHUNK_SIZE);
+    if (client->cmd_size == 0) {
+        client->cmd_size = CONS_DEFAULT_CMD_SIZE;
+    }
+
+    if (client->window > 1) {
+        // keep the window full and measure the rt of every completion
+        uint32_t done[MAX_WINDOW];
+        while(!client->exit) {
+            int64_t rid;
+            // the request count as key spreads the requests over the groups
+            while ((rid = consensus_submit_key(client->request_count, payload,
+                                               client->cmd_size)) >= 0) {
+                submit_time[rid % MAX_WINDOW] = rdtsc();
+            }
+
+            int num = consensus_poll_completions(done, MAX_WINDOW);
+            end = rdtsc();
+            for (int i = 0; i < num; i++) {
+                start = submit_time[done[i] % MAX_WINDOW];
+                if ((end - start) < 500000) {
+                    add(&(client->rt[client->current_run]), (double) end - start);
+                }
+            }
+        }
+    }
+
     while(!client->exit) {   
         if (cl->sleep_time > 0) {
            printf("Client %d: send request \n", client->id);
         }
 
         start = rdtsc();
-        consensus_send_request(payload);
+        consensus_send_request_key(client->request_count, payload,
+                                   client->cmd_size);
         end = rdtsc();
         // avoid scheduling measurements
         if ((end - start) < 500000) {
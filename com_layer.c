@@ -19,6 +19,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <sys/time.h>
 #include <numa.h>
 #include <smlt.h>
 #include <smlt_node.h>
@@ -32,6 +35,9 @@
 #include "client.h"
 #include "internal_com_layer.h"
 #include "shm_queue.h"
+#include "arena.h"
+#include "doorbell.h"
+#include "incremental_stats.h"
 #include "kvs.h"
 
 typedef struct com_layer_t{	
@@ -51,24 +57,76 @@ typedef struct com_layer_t{
     struct waitset* ws;
 
     uint8_t current_core;
+    uint8_t group;
     bool init_done;
 
     uint64_t req_count;
+    // requests sent to the core level that are not yet acked
+    uint16_t in_flight;
+    uint64_t acked;
+
+    // decisions coalesced into the next request to the core level
+    struct smlt_msg* batch;
+    uint8_t batch_count;
+    uint16_t batch_bytes;
+    uint64_t batch_start;
+    uint64_t batch_delay;
+    // decisions forwarded and requests sent to the core level
+    uint64_t num_cmds;
+    uint64_t num_batches;
     void (*exec_func) (void *);
 
     // shared memory for SHM queue
     void* shared_mem;
+    // writer of the core level SHM queue, the thread local writer of a
+    // replica can be the one of the node level
+    shm_queue_t* shm_queue;
 } com_layer_t;
 
+/*
+ * A consensus group has its own replicas, leader and Smelt context. The
+ * groups only share the clients, a replica belongs to a single group.
+ */
+typedef struct cons_group_t{
+    uint8_t algorithm;
+    uint8_t alg_below;
+    uint8_t* cores;
+    uint8_t num_cores;
+    struct smlt_context* ctx;
+    struct smlt_topology* topo;
+    // queue of the node level replicas for SHM on the node level
+    void* shared_mem;
+} cons_group_t;
+
+// commands a replica executed, all replicas of a group execute the same
+typedef struct cons_exec_t{
+    uint64_t count;
+    uint8_t group;
+    uint8_t level;
+    bool used;
+} cons_exec_t;
+
 static __thread com_layer_t com_core;
 static __thread com_layer_t com_node;
-static __thread cons_args_t thr_args[64];
+static __thread cons_args_t thr_args[CONS_MAX_GROUPS][64];
 static __thread cons_args_t thr_args2[64];
 static void* (*replica_function) (void*);
 static void* (*client_function) (void*);
-
-extern struct smlt_context* ctx;
-extern struct smlt_topology* topo;
+static cons_group_t groups[CONS_MAX_GROUPS];
+static cons_exec_t executed[CONS_MAX_CORES];
+static uint8_t num_groups;
+// group of the calling replica
+static __thread uint8_t cur_group;
+// tree and context of the Smelt protocols of the group of the replica
+__thread struct smlt_context* ctx;
+__thread struct smlt_topology* topo;
+// command size all tiers agreed on
+static uint16_t cons_cmd_size = CONS_MAX_CMD_SIZE;
+// replicas of all tiers that are ready to handle messages and replicas
+// of all groups started so far
+static uint32_t num_ready;
+static uint32_t num_failed;
+static uint32_t num_started;
 
 // TODO init this buffer!
 static __thread struct smlt_msg* buf;
@@ -91,15 +149,17 @@ static void init_protocol_core(uint8_t algorithm)
         thr_args2[i].alg_below = ALG_NONE;
         thr_args2[i].num_requests = 0;
         thr_args2[i].started_from = com_core.current_core;
+        thr_args2[i].group = com_core.group;
         thr_args2[i].exec_func = com_core.exec_func;
         thr_args2[i].id = i;
         thr_args2[i].current_core = com_core.cores[i];
         thr_args2[i].shared_mem = com_core.shared_mem;
+        thr_args2[i].cmd_size = com_core.cmd_size;
         thr_args2[i].replicas = com_core.cores;
         thr_args2[i].clients = &com_core.current_core;
         
         node = smlt_get_node_by_id(com_core.cores[i]);
-        err = smlt_node_start(node, replica_function, (void*) &thr_args[i]);
+        err = smlt_node_start(node, replica_function, (void*) &thr_args2[i]);
         if (smlt_err_is_fail(err)) {
             printf("Staring node failed \n");
         }
@@ -113,8 +173,10 @@ static void init_protocol_core(uint8_t algorithm)
     thr_args2[0].level = CORE_LEVEL;
     thr_args2[0].alg_below = ALG_NONE;
     thr_args2[0].shared_mem = com_core.shared_mem;
+    thr_args2[0].cmd_size = com_core.cmd_size;
     thr_args2[0].num_requests = 0;
     thr_args2[0].started_from = com_core.current_core;
+    thr_args2[0].group = com_core.group;
     thr_args2[0].current_core = com_core.cores[0];
     thr_args2[0].exec_func = com_core.exec_func;
     thr_args2[0].id = 0;
@@ -122,7 +184,7 @@ static void init_protocol_core(uint8_t algorithm)
     thr_args2[0].clients = &com_core.current_core;
 
     node = smlt_get_node_by_id(com_core.cores[0]);
-    err = smlt_node_start(node, replica_function, (void*) &thr_args[0]);
+    err = smlt_node_start(node, replica_function, (void*) &thr_args2[0]);
     if (smlt_err_is_fail(err)) {
         printf("Staring node failed \n");
     }
@@ -135,78 +197,217 @@ static void init_protocol_node(uint8_t algorithm)
 {
     struct smlt_node* node;
     errval_t err;
-    printf("################## Node 0 ##################\n");
+    cons_args_t* group_args = thr_args[com_node.group];
+    printf("################## Group %d Node 0 ##################\n",
+           com_node.group);
     // at the end start leader so he can directly connect to every replicaa
-    thr_args[0].num_clients = com_node.num_clients;
-    thr_args[0].num_replicas = com_node.num_cores;
-    thr_args[0].algo = algorithm;
-    thr_args[0].level = NODE_LEVEL;
-    thr_args[0].alg_below = com_node.alg_below;
-    thr_args[0].num_requests = 0;
-    thr_args[0].node_size = com_node.node_size;
-    thr_args[0].started_from = 0;
-    thr_args[0].cores = com_node.node_cores;
-    thr_args[0].exec_func = com_node.exec_func;
-    thr_args[0].id = 0;
-    thr_args[0].current_core = com_node.cores[0];
-    thr_args[0].replicas = com_node.cores;
-    thr_args[0].clients = com_node.client_cores;
+    group_args[0].num_clients = com_node.num_clients;
+    group_args[0].num_replicas = com_node.num_cores;
+    group_args[0].algo = algorithm;
+    group_args[0].level = NODE_LEVEL;
+    group_args[0].alg_below = com_node.alg_below;
+    group_args[0].num_requests = 0;
+    group_args[0].node_size = com_node.node_size;
+    group_args[0].started_from = 0;
+    group_args[0].group = com_node.group;
+    group_args[0].shared_mem = groups[com_node.group].shared_mem;
+    group_args[0].cmd_size = cons_cmd_size;
+    group_args[0].cores = com_node.node_cores;
+    group_args[0].exec_func = com_node.exec_func;
+    group_args[0].id = 0;
+    group_args[0].current_core = com_node.cores[0];
+    group_args[0].replicas = com_node.cores;
+    group_args[0].clients = com_node.client_cores;
 
     node = smlt_get_node_by_id(com_node.cores[0]);
-    err = smlt_node_start(node, replica_function, (void*) &thr_args[0]);
+    err = smlt_node_start(node, replica_function, (void*) &group_args[0]);
     if (smlt_err_is_fail(err)) {
         printf("Staring node failed \n");
     }
 
-    sleep(2);
+    // the nodes start in parallel, messages to a replica that is not
+    // running yet wait in its channel
     uint8_t** core_tmp = (uint8_t**) malloc(sizeof(uint8_t*) * com_node.num_cores);
     for (int i = 1; i < com_node.num_cores; i++) {
-        printf("################## Node %d ##################\n",i);
+        printf("################## Group %d Node %d ##################\n",
+               com_node.group, i);
         //thr_args[i] = (cons_args_t*) malloc(sizeof(cons_args_t));
         core_tmp[i] = (uint8_t*) malloc(sizeof(uint8_t)* com_node.num_cores);
 
-        thr_args[i].num_clients = com_node.num_clients;
-        thr_args[i].num_replicas = com_node.num_cores;
-        thr_args[i].algo = algorithm;
-        thr_args[i].level = NODE_LEVEL;
-        thr_args[i].alg_below = com_node.alg_below;
-        thr_args[i].num_requests = 0;
-        thr_args[i].node_size = com_node.node_size;
-        thr_args[i].started_from = 0;
-        thr_args[i].cores = com_node.node_cores;
-        thr_args[i].exec_func = com_node.exec_func;
-        thr_args[i].replicas = com_node.cores;
+        group_args[i].num_clients = com_node.num_clients;
+        group_args[i].num_replicas = com_node.num_cores;
+        group_args[i].algo = algorithm;
+        group_args[i].level = NODE_LEVEL;
+        group_args[i].alg_below = com_node.alg_below;
+        group_args[i].num_requests = 0;
+        group_args[i].node_size = com_node.node_size;
+        group_args[i].started_from = 0;
+        group_args[i].group = com_node.group;
+        group_args[i].shared_mem = groups[com_node.group].shared_mem;
+        group_args[i].cmd_size = cons_cmd_size;
+        group_args[i].cores = com_node.node_cores;
+        group_args[i].exec_func = com_node.exec_func;
+        group_args[i].replicas = com_node.cores;
 
         for (int j = 0; j < com_node.node_size;j++) {
             core_tmp[i][j] = com_node.node_cores[i*com_node.node_size+j];
         } 
 
-        thr_args[i].cores = core_tmp[i];
-        thr_args[i].clients = com_node.client_cores;
-        thr_args[i].current_core = com_node.cores[i];
-        thr_args[i].id = i;
+        group_args[i].cores = core_tmp[i];
+        group_args[i].clients = com_node.client_cores;
+        group_args[i].current_core = com_node.cores[i];
+        group_args[i].id = i;
 
         node = smlt_get_node_by_id(com_node.cores[i]);
-        err = smlt_node_start(node, replica_function, (void*) &thr_args[i]);
+        err = smlt_node_start(node, replica_function, (void*) &group_args[i]);
         if (smlt_err_is_fail(err)) {
             printf("Staring node failed \n");
         }
+    }
+
+    com_node.init_done = true;
+}
+
+void com_layer_enter_group(uint8_t group)
+{
+    cur_group = group;
+    ctx = groups[group].ctx;
+    topo = groups[group].topo;
+}
+
+uint64_t* com_layer_exec_counter(uint8_t core, uint8_t level)
+{
+    executed[core].group = cur_group;
+    executed[core].level = level;
+    executed[core].used = true;
+    return &executed[core].count;
+}
 
-        if (com_node.node_size > 1) {
-            sleep(2);
+void consensus_print_executed(void)
+{
+    for (int c = 0; c < CONS_MAX_CORES; c++) {
+        if (executed[c].used) {
+            printf("Executed: group %d level %s core %d commands %"PRIu64" \n",
+                   executed[c].group,
+                   (executed[c].level == NODE_LEVEL) ? "node" : "core", c,
+                   __atomic_load_n(&executed[c].count, __ATOMIC_RELAXED));
         }
     }
+}
 
-    // give it some time to start
-    sleep(1);
-    com_node.init_done = true;
+void com_layer_replica_ready(void)
+{
+    __atomic_fetch_add(&num_ready, 1, __ATOMIC_RELEASE);
+}
+
+void com_layer_replica_failed(void)
+{
+    __atomic_fetch_add(&num_failed, 1, __ATOMIC_RELEASE);
 }
 
+static double get_time_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000.0 + tv.tv_usec/1000.0;
+}
+
+// TSC cycles per us, measured once before the replicas of the first group
+// are started
+static uint64_t tsc_per_us;
+
+static void calibrate_tsc(void)
+{
+    double start = get_time_ms();
+    uint64_t tsc_start = rdtsc();
+    // long enough that the resolution of the clock does not matter
+    while ((get_time_ms() - start) < COM_LAYER_TSC_CALIBRATION) {
+    }
+    uint64_t cycles = rdtsc() - tsc_start;
+    tsc_per_us = cycles/((get_time_ms() - start)*1000.0);
+    if (tsc_per_us == 0) {
+        tsc_per_us = 1;
+    }
+}
+
+uint64_t com_layer_tsc_per_us(void)
+{
+    return tsc_per_us;
+}
+
+// waits until the replicas of all tiers are ready, returns false on timeout
+// or as soon as a replica could not be initialized
+static bool wait_for_replicas(uint32_t num_replicas, double start)
+{
+    while (__atomic_load_n(&num_ready, __ATOMIC_ACQUIRE) < num_replicas) {
+        if (__atomic_load_n(&num_failed, __ATOMIC_ACQUIRE) > 0) {
+            printf("Startup failed: %d replicas could not be initialized \n",
+                   __atomic_load_n(&num_failed, __ATOMIC_ACQUIRE));
+            return false;
+        }
+        if ((get_time_ms() - start) > CONS_STARTUP_TIMEOUT) {
+            printf("Startup timed out: %d of %d replicas ready \n",
+                   __atomic_load_n(&num_ready, __ATOMIC_ACQUIRE), num_replicas);
+            return false;
+        }
+#ifdef BARRELFISH
+        thread_yield();
+#else
+        sched_yield();
+#endif
+    }
+    return true;
+}
+
+#ifdef MEASURE_TP
+// throughput of the node level in decisions and of the core level in requests
+static void* results_com_layer(void* arg)
+{
+    com_layer_t* com = (com_layer_t*) arg;
+    uint64_t last_cmds = 0;
+    uint64_t last_batches = 0;
+    for (int runs = 0; runs < 7; runs++) {
+        sleep(20);
+        uint64_t cmds = com->num_cmds - last_cmds;
+        uint64_t batches = com->num_batches - last_batches;
+        last_cmds += cmds;
+        last_batches += batches;
+        printf("Com Layer %d : Tier1 decisions/s %10.6g Tier2 requests/s %10.6g "
+               "(%5.2f decisions per request) \n", com->current_core,
+               (double) cmds/20, (double) batches/20,
+               batches ? (double) cmds/batches : 0.0);
+    }
+    return 0;
+}
+
+// decisions of every group and of all groups together
+static void* results_groups(void* arg)
+{
+    uint64_t last[CONS_MAX_GROUPS] = {0};
+    for (int runs = 0; runs < 7; runs++) {
+        sleep(20);
+        uint64_t total = 0;
+        uint8_t num = __atomic_load_n(&num_groups, __ATOMIC_ACQUIRE);
+        for (int g = 0; g < num; g++) {
+            // the first replica of the group counts its decisions
+            uint64_t decided = executed[groups[g].cores[0]].count;
+            printf("Group %d : decisions/s %10.6g \n", g,
+                   (double) (decided - last[g])/20);
+            total += decided - last[g];
+            last[g] = decided;
+        }
+        printf("Groups %d : total decisions/s %10.6g \n", num,
+               (double) total/20);
+    }
+    return 0;
+}
+#endif
+
 /*
  * Interface functions
  */
 
-void com_layer_core_init(uint8_t algorithm, 
+int com_layer_core_init(uint8_t algorithm, 
         uint8_t replica_id,
         uint8_t current_core,
         uint8_t* cores,
@@ -214,35 +415,92 @@ void com_layer_core_init(uint8_t algorithm,
         uint16_t cmd_size,
         void (*exec_fn)(void*))
 {
+    // the command size has to fit through the tier below
+    if ((cmd_size > CONS_MAX_CMD_SIZE) ||
+        ((algorithm == ALG_SHM) && (cmd_size > shm_max_cmd_size(num_cores-1)))) {
+        printf("Com Layer: command size %d not supported by protocol %d \n",
+               cmd_size, algorithm);
+        com_layer_replica_failed();
+        return -1;
+    }
+    if (algorithm >= 7) {
+        printf("Com Layer: Unknown algorithm \n");
+        com_layer_replica_failed();
+        return -1;
+    }
+
     com_core.algorithm = algorithm;
     com_core.replica_id = replica_id;
     com_core.cores = cores;
     com_core.num_cores = num_cores;
     com_core.cmd_size = cmd_size;
     com_core.req_count = 0;
+    com_core.in_flight = 0;
+    com_core.acked = 0;
+    com_core.batch_count = 0;
+    com_core.batch_bytes = 0;
+    com_core.batch_delay = (uint64_t) COM_LAYER_BATCH_DELAY*tsc_per_us;
+    com_core.num_cmds = 0;
+    com_core.num_batches = 0;
     com_core.exec_func = exec_fn;
-    com_core.shared_mem = calloc(1, 4096);
+    // only a shared memory tier below maps a region
+    com_core.shared_mem = NULL;
+    if (algorithm == ALG_SHM) {
+        com_core.shared_mem = shm_alloc(current_core);
+    }
     com_core.current_core = current_core;
+    com_core.group = cur_group;
     com_core.core_to_send_to = cores[0]; 
    
 
     if (algorithm == ALG_SHM) {
-        init_shm_writer(replica_id, current_core, 1, num_cores-1, 
-                        cmd_size, false, com_core.shared_mem, exec_fn);
+        com_core.shm_queue = shm_writer_create(replica_id, current_core,
+                                               num_cores-1, cmd_size, false,
+                                               com_core.shared_mem, exec_fn);
         init_protocol_core(ALG_SHM);
         com_core.init_done = true;
     } else {
-        if (algorithm < 7) {
-            init_protocol_core(algorithm);
-        } else {
-            printf("Com Layer: Unknown algorithm \n");
-            return;
-        }
+        init_protocol_core(algorithm);
     }
 
-    buf = smlt_message_alloc(56);
+    buf = smlt_message_alloc(CONS_MSG_SIZE);
+    // room for the length word of a single command of cmd_size
+    com_core.batch = smlt_message_alloc(CONS_MSG_SIZE+sizeof(uintptr_t));
     //mp_connect(current_core, cores[0]);
     com_core.init_done = true;
+
+#ifdef MEASURE_TP
+    if (replica_id == 0) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, results_com_layer, &com_core);
+    }
+#endif
+    return 0;
+}
+
+void consensus_set_cmd_size(uint16_t cmd_size)
+{
+    cons_cmd_size = cmd_size;
+}
+
+uint16_t consensus_get_cmd_size(void)
+{
+    return cons_cmd_size;
+}
+
+// replicas a protocol needs to make progress
+static uint8_t min_replicas(uint8_t algorithm, uint8_t level)
+{
+    switch (algorithm) {
+        case ALG_BROAD:
+            return 1;
+        case ALG_SHM:
+            // the writer on the core level is the node level replica
+            return level == NODE_LEVEL ? 2 : 1;
+        default:
+            // leader and acceptor/follower/tail
+            return 2;
+    }
 }
 
 #ifdef BARRELFISH
@@ -252,8 +510,8 @@ static void domain_init_done(void *arg, errval_t err)
 }
 #endif
 
-void consensus_init(
-        uint8_t total_cores,
+int consensus_init(
+        uint16_t total_cores,
         uint8_t algorithm, 
         uint8_t* cores,
         uint8_t num_cores,
@@ -263,12 +521,62 @@ void consensus_init(
         uint8_t* node_cores,
         uint8_t* client_cores,
         void (*exec_fn)(void*))
+{
+    return consensus_init_group(total_cores, algorithm, cores, num_cores,
+                                num_clients, alg_below, node_size, node_cores,
+                                client_cores, exec_fn);
+}
+
+uint8_t consensus_num_groups(void)
+{
+    return num_groups;
+}
+
+uint8_t consensus_group_of(uint64_t key)
+{
+    if (num_groups <= 1) {
+        return 0;
+    }
+    // fibonacci hashing, the upper bits are mixed best
+    return ((key * 0x9E3779B97F4A7C15ULL) >> 32) % num_groups;
+}
+
+int consensus_init_group(
+        uint16_t total_cores,
+        uint8_t algorithm,
+        uint8_t* cores,
+        uint8_t num_cores,
+        uint8_t num_clients,
+        uint8_t alg_below,
+        uint8_t node_size,
+        uint8_t* node_cores,
+        uint8_t* client_cores,
+        void (*exec_fn)(void*))
 {
     errval_t err;
-    if ((algorithm == ALG_SHM) && (alg_below) != ALG_NONE) {
-        printf("Can not start SHARED MEMORY on node level with \
-                other algorithm on core level");
-        return;
+    double start = get_time_ms();
+    if (num_groups >= CONS_MAX_GROUPS) {
+        printf("Can not start more than %d groups \n", CONS_MAX_GROUPS);
+        return -1;
+    }
+
+    // a node runs node_size-1 core level replicas next to the node level one
+    if ((algorithm >= ALG_NONE) || (alg_below > ALG_NONE) ||
+        (num_cores < min_replicas(algorithm, NODE_LEVEL)) ||
+        ((alg_below != ALG_NONE) &&
+         ((node_size-1) < min_replicas(alg_below, CORE_LEVEL)))) {
+        printf("Can not start protocol %d on %d replicas with protocol %d "
+               "on %d replicas below \n", algorithm, num_cores, alg_below,
+               node_size-1);
+        return -1;
+    }
+
+    // at least a handle has to fit for larger commands
+    if ((cons_cmd_size < sizeof(struct arena_handle)) ||
+        (cons_cmd_size > CONS_MAX_CMD_SIZE)) {
+        printf("Command size has to be between %zu and %d bytes \n",
+               sizeof(struct arena_handle), CONS_MAX_CMD_SIZE);
+        return -1;
     }
 
 #ifdef BARRELFISH
@@ -311,6 +619,8 @@ void consensus_init(
         printf("Cores[%d] %d \n", i, cores[i]);
     }
 
+    uint8_t group = num_groups;
+    com_node.group = group;
     com_node.algorithm = algorithm;
     com_node.cores = cores;
     com_node.node_cores = node_cores;
@@ -321,10 +631,22 @@ void consensus_init(
     com_node.exec_func = exec_fn;
     com_node.client_cores = client_cores;
 
-    err = smlt_init(total_cores, true);
-    if (smlt_err_is_fail(err)) {
-        printf("FAILED TO INITIALIZE !\n");
-        return;
+    // every node level replica starts node_size-1 core level replicas
+    uint32_t num_replicas = num_cores;
+    if (alg_below != ALG_NONE) {
+        num_replicas = num_cores*node_size;
+    }
+
+    // every command is executed once by every replica
+    arena_init(group, num_replicas);
+
+    if (group == 0) {
+        err = smlt_init(total_cores, true);
+        if (smlt_err_is_fail(err)) {
+            printf("FAILED TO INITIALIZE !\n");
+            return -1;
+        }
+        calibrate_tsc();
     }
 
     struct smlt_generated_model* model = NULL;
@@ -337,57 +659,339 @@ void consensus_init(
     err = smlt_generate_model(cores_cpy, num_cores, "adaptivetree", &model);
     if (smlt_err_is_fail(err)) {
         printf("Failed to generated model, aborting\n");
-        return;
+        return -1;
     }
 
-    smlt_topology_create(model, "adaptivetree", &topo);
-    err = smlt_context_create(topo, &ctx);
+    // every group has its own tree
+    smlt_topology_create(model, "adaptivetree", &groups[group].topo);
+    err = smlt_context_create(groups[group].topo, &groups[group].ctx);
     if (smlt_err_is_fail(err)) {
         printf("FAILED TO INITIALIZE CONTEXT !\n");
-        return;
+        return -1;
     }
-    
+
+    groups[group].algorithm = algorithm;
+    groups[group].alg_below = alg_below;
+    groups[group].cores = cores;
+    groups[group].num_cores = num_cores;
+    // the node level queue of a group is not shared with other groups
+    groups[group].shared_mem = NULL;
+    if (algorithm == ALG_SHM) {
+        groups[group].shared_mem = shm_alloc(cores[0]);
+    }
+    com_layer_enter_group(group);
+    __atomic_store_n(&num_groups, group+1, __ATOMIC_RELEASE);
 
     if (algorithm < 7) {
         init_protocol_node(algorithm);
     } else {
         printf("Com Layer: Unknown algorithm \n");
+        return -1;
+    }
+
+    // the replicas of the groups started before are ready already
+    num_started += num_replicas;
+    if (!wait_for_replicas(num_started, start)) {
+        return -1;
     }
+    printf("Startup of %d replicas of group %d took %10.3f ms \n",
+           num_replicas, group, get_time_ms() - start);
+
+#ifdef MEASURE_TP
+    if (group == 0) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, results_groups, NULL);
+    }
+#endif
+    return group;
 }
 
-void com_layer_core_send_request(struct smlt_msg* msg)
+/*
+ * Automatic placement
+ */
+
+static cons_plan_t plan;
+
+// a hardware thread is used if it is the first of its SMT siblings
+static bool is_first_sibling(int cpu)
+{
+    char path[128];
+    int first = cpu;
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+            cpu);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return true;
+    }
+    if (fscanf(f, "%d", &first) != 1) {
+        first = cpu;
+    }
+    fclose(f);
+    return first == cpu;
+}
+
+// fills cpus with the cores of a NUMA node without SMT siblings
+static int node_cpus(int node, int total, uint8_t* cpus, uint8_t* siblings,
+                     int* num_siblings)
+{
+    int num = 0;
+    *num_siblings = 0;
+    struct bitmask* mask = numa_allocate_cpumask();
+    if (numa_node_to_cpus(node, mask) < 0) {
+        numa_free_cpumask(mask);
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < total; cpu++) {
+        if (!numa_bitmask_isbitset(mask, cpu)) {
+            continue;
+        }
+        if (is_first_sibling(cpu)) {
+            cpus[num++] = cpu;
+        } else {
+            siblings[(*num_siblings)++] = cpu;
+        }
+    }
+    numa_free_cpumask(mask);
+    return num;
+}
+
+// prints the plan in the format of the benchmark config files
+static void print_plan(void)
+{
+    printf("############################################### \n");
+    printf("Plan: tier1 %d tier2 %d, config: \n", plan.algo, plan.alg_below);
+    printf("%d\n%d\n%d\n%d\n", plan.total_cores, plan.num_replicas,
+           plan.node_size, plan.num_clients);
+    for (int i = 0; i < plan.num_replicas; i++) {
+        printf("%d", plan.cores[i]);
+        for (int j = 0; j < plan.node_size-1; j++) {
+            printf(" %d", plan.node_cores[i*plan.node_size+j]);
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < plan.num_clients; i++) {
+        printf("%d ", plan.client_cores[i]);
+    }
+    printf("\n");
+    printf("############################################### \n");
+}
+
+int consensus_init_auto(void (*exec_func)(void* arg),
+                        bool failures,
+                        bool full_replication)
+{
+#ifdef BARRELFISH
+    printf("consensus_init_auto: topology discovery not supported \n");
+    return -1;
+#else
+    int total = numa_num_configured_cpus();
+    int num_nodes = numa_available() < 0 ? 1 : numa_max_node()+1;
+    if (total > CONS_MAX_CORES) {
+        total = CONS_MAX_CORES;
+    }
+
+    uint8_t cpus[num_nodes][CONS_MAX_CORES];
+    uint8_t siblings[CONS_MAX_CORES];
+    int num_cpus[num_nodes];
+    int min_cpus = CONS_MAX_CORES;
+
+    memset(&plan, 0, sizeof(plan));
+    plan.total_cores = total;
+
+    // one tier1 replica per NUMA node, a client on the last core of a node
+    // or on an SMT sibling, the other cores of a node are tier2 replicas
+    for (int n = 0; n < num_nodes; n++) {
+        int num_siblings = 0;
+        num_cpus[n] = 0;
+        if (numa_available() < 0) {
+            for (int cpu = 0; cpu < total; cpu++) {
+                cpus[n][num_cpus[n]++] = cpu;
+            }
+        } else {
+            num_cpus[n] = node_cpus(n, total, cpus[n], siblings, &num_siblings);
+        }
+
+        if ((num_cpus[n] == 0) || (plan.num_replicas == MAX_NUM_REPLICAS)) {
+            // memory only node
+            continue;
+        }
+
+        if ((num_siblings > 0) && (plan.num_clients < MAX_NUM_CLIENTS)) {
+            plan.client_cores[plan.num_clients++] = siblings[0];
+        } else if ((num_cpus[n] > 1) && (plan.num_clients < MAX_NUM_CLIENTS)) {
+            plan.client_cores[plan.num_clients++] = cpus[n][--num_cpus[n]];
+        }
+
+        if (num_cpus[n] < min_cpus) {
+            min_cpus = num_cpus[n];
+        }
+        // the core of the tier1 replica first, then the tier2 cores
+        memmove(&cpus[plan.num_replicas][0], &cpus[n][0], num_cpus[n]);
+        num_cpus[plan.num_replicas] = num_cpus[n];
+        plan.num_replicas++;
+    }
+
+    if ((plan.num_replicas == 0) || (plan.num_clients == 0)) {
+        printf("consensus_init_auto: not enough cores for replicas and clients \n");
+        return -1;
+    }
+
+    if (failures && (plan.num_replicas < 3)) {
+        printf("consensus_init_auto: %d NUMA nodes, less than one failure "
+               "is tolerated \n", plan.num_replicas);
+    }
+
+    // the nodes are the failure domain, only tier1 has to tolerate failures
+    plan.algo = failures ? ALG_1PAXOS : ALG_BROAD;
+    plan.node_size = full_replication ? min_cpus : 1;
+    plan.alg_below = plan.node_size > 1 ? ALG_SHM : ALG_NONE;
+
+    for (int i = 0; i < plan.num_replicas; i++) {
+        plan.cores[i] = cpus[i][0];
+        for (int j = 1; j < plan.node_size; j++) {
+            plan.node_cores[i*plan.node_size+(j-1)] = cpus[i][j];
+        }
+    }
+
+    print_plan();
+    int group = consensus_init(plan.total_cores, plan.algo, plan.cores,
+                               plan.num_replicas, plan.num_clients,
+                               plan.alg_below, plan.node_size, plan.node_cores,
+                               plan.client_cores, exec_func);
+    if (group < 0) {
+        // e.g. a single node with failures has too few replicas
+        printf("consensus_init_auto: starting the plan failed \n");
+        memset(&plan, 0, sizeof(plan));
+    }
+    return group;
+#endif
+}
+
+const cons_plan_t* consensus_get_plan(void)
+{
+    return &plan;
+}
+
+static void recv_ack(void)
+{
+    errval_t err;
+    err = smlt_recv(com_core.core_to_send_to, buf);
+    if (smlt_err_is_fail(err)) {
+        // TODO;
+    }
+    com_core.in_flight--;
+    com_core.acked++;
+}
+
+// sends the batch, a single command is sent as is
+static void flush_batch(void)
 {
     errval_t err;
     struct smlt_node* node;
-    if (!com_core.init_done) {
-        printf("Com Layer: Can not send request to core layer, not initialized yet \n");
-        return;
+    uintptr_t* data = com_core.batch->data;
+    uint16_t len = CONS_CMD_BATCH | com_core.batch_bytes;
+
+    if (com_core.batch_count == 1) {
+        len = (uint16_t) data[CONS_HDR_WORDS];
+        memmove(&data[CONS_HDR_WORDS], &data[CONS_HDR_WORDS+1],
+                CONS_CMD_WORDS(CONS_CMD_BYTES(len))*sizeof(uintptr_t));
     }
-    
-    if (com_core.algorithm== ALG_SHM) {
-        shm_write(&msg->data[4]);
+
+    if (com_core.algorithm == ALG_SHM) {
+        // batches are limited to the negotiated command size, a record
+        // that does not fit is a command larger than the tier supports
+        int ret = shm_queue_write(com_core.shm_queue, &data[CONS_HDR_WORDS],
+                                  len);
+        COND_PANIC(ret == 0, "Com Layer: batch does not fit the SHM queue");
     } else {
-        // save client id since we change it
-        uint8_t cid = get_client_id(&msg->data[0]);
+        // only block if all credits are used up
+        while (com_core.in_flight >= COM_LAYER_CREDITS) {
+            recv_ack();
+        }
 
-        // send message to lower layer
-        set_tag(&msg->data[0], REQ_TAG);
-        set_client_id(&msg->data[0], 0);
-        set_request_id(&msg->data[0], com_core.req_count);
-    
-        node = smlt_get_node_by_id(com_core.cores[0]);
-        err = smlt_node_send(node, msg);
-        if (smlt_err_is_fail(err)) {
-            // TODO;
-        }       
+        data[0] = 0;
+        set_tag(data, REQ_TAG);
+        set_client_id(data, 0);
+        set_request_id(data, com_core.req_count);
+        set_cmd_len(data, len);
+        com_core.batch->words = get_msg_words(data);
 
-        err = smlt_node_recv(node, buf);
+        node = smlt_get_node_by_id(com_core.cores[0]);
+        err = smlt_node_send(node, com_core.batch);
         if (smlt_err_is_fail(err)) {
             // TODO;
-        }       
-        set_client_id(&msg->data[0], cid);
+        }
+        doorbell_ring(com_core.cores[0]);
+        com_core.in_flight++;
     }
+
     com_core.req_count++;
+    com_core.num_batches++;
+    com_core.batch_count = 0;
+    com_core.batch_bytes = 0;
+}
+
+void com_layer_core_poll(void)
+{
+    if (!com_core.init_done) {
+        return;
+    }
+
+    if ((com_core.batch_count > 0) &&
+        ((rdtsc() - com_core.batch_start) > com_core.batch_delay)) {
+        flush_batch();
+    }
+
+    if (com_core.algorithm == ALG_SHM) {
+        return;
+    }
+
+    while ((com_core.in_flight > 0) && smlt_can_recv(com_core.core_to_send_to)) {
+        recv_ack();
+    }
+}
+
+bool com_layer_core_busy(void)
+{
+    return (com_core.batch_count > 0) || (com_core.in_flight > 0);
+}
+
+void com_layer_core_send_request(struct smlt_msg* msg)
+{
+    if (!com_core.init_done) {
+        printf("Com Layer: Can not send request to core layer, not initialized yet \n");
+        return;
+    }
+
+    uint16_t len = get_cmd_len(&msg->data[0]);
+    uint16_t words = CONS_CMD_WORDS(CONS_CMD_BYTES(len));
+    uint16_t rec_bytes = (1 + words)*sizeof(uintptr_t);
+
+    // records are aligned to words, a batch has to fit into a command
+    if ((com_core.batch_bytes + rec_bytes) > com_core.cmd_size) {
+        if (com_core.batch_count > 0) {
+            flush_batch();
+        }
+    }
+
+    uintptr_t* rec = &com_core.batch->data[CONS_HDR_WORDS +
+                                           com_core.batch_bytes/sizeof(uintptr_t)];
+    rec[0] = len;
+    memcpy(&rec[1], &msg->data[CONS_HDR_WORDS], words*sizeof(uintptr_t));
+    if (com_core.batch_count == 0) {
+        com_core.batch_start = rdtsc();
+    }
+    com_core.batch_count++;
+    com_core.batch_bytes += rec_bytes;
+    com_core.num_cmds++;
+
+    // a command that only fits alone is sent as is
+    if ((com_core.batch_count >= COM_LAYER_BATCH) ||
+        (com_core.batch_bytes > com_core.cmd_size)) {
+        flush_batch();
+    }
+    com_layer_core_poll();
 }
 
 /*
@@ -395,8 +999,42 @@ void com_layer_core_send_request(struct smlt_msg* msg)
  */
 
 
+// cores a client sends its requests to and receives the replies from
+static void group_endpoints(uint8_t group, uint8_t client_core,
+                            uint8_t* leader, uint8_t* recv_from)
+{
+    uint8_t protocol = groups[group].algorithm;
+    uint8_t* replica_cores = groups[group].cores;
+    uint8_t num_replicas = groups[group].num_cores;
+    if (protocol != ALG_1PAXOS) {
+        *leader = replica_cores[0];
+        if (protocol != ALG_CHAIN) {
+            *recv_from = replica_cores[0];
+        } else {
+            *recv_from = replica_cores[num_replicas-1];
+        }
+    } else { 
+#ifdef SMLT
+        *leader = replica_cores[1];
+        *recv_from = replica_cores[1];
+#else
+        *leader = replica_cores[0];
+        *recv_from = replica_cores[0];
+#endif
+#ifdef KVS
+        int numa = numa_node_of_cpu(client_core);
+        if ((numa == 1) || (numa == 0)) {
+            //numa = rand() % (num_replicas-2);
+            numa += 2;
+        }
+        printf("Numa %d \n", numa);
+        *recv_from = replica_cores[numa];
+#endif
+    }
+}
+
 static __thread benchmark_client_args_t args[64];
-void consensus_bench_clients_init(uint8_t num_cores,
+void consensus_bench_clients_init(uint16_t num_cores,
                                   uint8_t* cores,
                                   uint8_t num_clients,
                                   uint8_t num_replicas,
@@ -405,7 +1043,8 @@ void consensus_bench_clients_init(uint8_t num_cores,
                                   uint8_t protocol,
                                   uint8_t protocol_below,
                                   uint8_t topo2,
-                                  uint8_t* replica_cores)
+                                  uint16_t window,
+                                  uint16_t cmd_size)
 {
     errval_t err;
     struct smlt_node* node;
@@ -419,30 +1058,13 @@ void consensus_bench_clients_init(uint8_t num_cores,
         args[i].protocol = protocol;
         args[i].protocol_below = protocol_below;
         args[i].topo = topo2;
-        if (protocol != ALG_1PAXOS) {
-            args[i].leader = replica_cores[0];
-            if (protocol != ALG_CHAIN) {
-                args[i].recv_from = replica_cores[0];
-            } else {
-                args[i].recv_from = replica_cores[num_replicas-1];
-            }
-        } else { 
-#ifdef SMLT
-            args[i].leader = replica_cores[1];
-            args[i].recv_from = replica_cores[1];
-#else
-            args[i].leader = replica_cores[0];
-            args[i].recv_from = replica_cores[0];
-#endif
-#ifdef KVS
-            int numa = numa_node_of_cpu(cores[i]);
-            if ((numa == 1) || (numa == 0)) {
-                //numa = rand() % (num_replicas-2);
-                numa += 2;
-            }
-            printf("Numa %d \n", numa);
-            args[i].recv_from = replica_cores[numa];
-#endif
+        args[i].window = window;
+        args[i].cmd_size = cmd_size;
+        // every client connects to every group
+        args[i].num_groups = num_groups;
+        for (int g = 0; g < num_groups; g++) {
+            group_endpoints(g, cores[i], &args[i].leader[g],
+                            &args[i].recv_from[g]);
         }
     
         node = smlt_get_node_by_id(cores[i]);
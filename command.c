@@ -0,0 +1,87 @@
+/**
+ * \file
+ * \brief Execution of commands of variable length
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <stdio.h>
+
+#include "command.h"
+#include "arena.h"
+
+// length of the command the execution function is called on
+static __thread uint16_t cmd_len;
+// commands executed by the thread
+static __thread uint64_t* exec_count;
+
+uint16_t consensus_get_cmd_len(void)
+{
+    return cmd_len;
+}
+
+void consensus_exec_count(uint64_t* counter)
+{
+    exec_count = counter;
+}
+
+void consensus_exec_cmd(void (*exec_fn)(void*), void* cmd, uint16_t len)
+{
+    if (len & CONS_CMD_BATCH) {
+        uintptr_t* rec = (uintptr_t*) cmd;
+        uintptr_t* end = rec + CONS_CMD_WORDS(CONS_CMD_BYTES(len));
+        while (rec < end) {
+            uint16_t rec_len = (uint16_t) rec[0];
+            consensus_exec_cmd(exec_fn, &rec[1], rec_len);
+            rec += 1 + CONS_CMD_WORDS(CONS_CMD_BYTES(rec_len));
+        }
+        return;
+    }
+
+    if (exec_count != NULL) {
+        (*exec_count)++;
+    }
+
+    if (len & CONS_CMD_HANDLE) {
+        struct arena_handle* handle = (struct arena_handle*) cmd;
+        void* payload = arena_get(handle);
+        if (payload == NULL) {
+            printf("Command: handle to reused chunk, not executed \n");
+            return;
+        }
+
+        cmd_len = handle->len;
+        exec_fn(payload);
+        arena_release(handle);
+        return;
+    }
+
+    cmd_len = len;
+    exec_fn(cmd);
+}
+
+void consensus_skip_cmd(void* cmd, uint16_t len)
+{
+    if (len & CONS_CMD_BATCH) {
+        uintptr_t* rec = (uintptr_t*) cmd;
+        uintptr_t* end = rec + CONS_CMD_WORDS(CONS_CMD_BYTES(len));
+        while (rec < end) {
+            uint16_t rec_len = (uint16_t) rec[0];
+            consensus_skip_cmd(&rec[1], rec_len);
+            rec += 1 + CONS_CMD_WORDS(CONS_CMD_BYTES(rec_len));
+        }
+        return;
+    }
+
+    if (len & CONS_CMD_HANDLE) {
+        arena_release((struct arena_handle*) cmd);
+    }
+}
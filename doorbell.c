@@ -0,0 +1,198 @@
+/**
+ * \file
+ * \brief Doorbells to find the channels with pending messages
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <string.h>
+#include <sched.h>
+
+#include "consensus.h"
+#include "doorbell.h"
+
+/*
+ * Every core has a doorbell on its own cache line, a sender sets the bit
+ * of its core after sending. The receiver takes all bits at once and
+ * probes only the channels whose bit was set.
+ */
+struct doorbell {
+    uint64_t bits[DOORBELL_WORDS];
+    // the receiver parks here if its idle policy lets it
+    idle_word_t wake;
+    // avoid false sharing
+    uint8_t padding[64-DOORBELL_WORDS*sizeof(uint64_t)-sizeof(idle_word_t)];
+} __attribute__((aligned(64)));
+
+static struct doorbell doorbells[CONS_MAX_CORES];
+
+// core of the calling thread, the threads are pinned
+static __thread int self = -1;
+
+static inline int get_self(void)
+{
+    if (self < 0) {
+#ifdef BARRELFISH
+        self = disp_get_core_id();
+#else
+        self = sched_getcpu();
+#endif
+    }
+    return self;
+}
+
+void doorbell_ring(uint8_t receiver)
+{
+    int core = get_self();
+    uint64_t bit = 1ULL << (core % 64);
+    uint64_t* word = &doorbells[receiver].bits[core / 64];
+    // always an RMW, a set bit that was read before could already be taken
+    // by the receiver, which probed the channel before the message arrived
+    __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+    idle_wake(&doorbells[receiver].wake);
+}
+
+static inline void set_add(doorbell_set_t* set, uint8_t core)
+{
+    set->bits[core / 64] |= 1ULL << (core % 64);
+}
+
+// takes the bells rung for the core so far
+static void collect(doorbell_loop_t* loop)
+{
+    for (int i = 0; i < DOORBELL_WORDS; i++) {
+        uint64_t* word = &doorbells[loop->self].bits[i];
+        if (__atomic_load_n(word, __ATOMIC_RELAXED)) {
+            loop->pending.bits[i] |= __atomic_exchange_n(word, 0,
+                                                         __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+static void sweep(doorbell_loop_t* loop, doorbell_set_t* set)
+{
+    for (int core = 0; core < CONS_MAX_CORES; core++) {
+        if ((set->bits[core / 64] & (1ULL << (core % 64))) &&
+            smlt_can_recv(core)) {
+            set_add(&loop->pending, core);
+        }
+    }
+}
+
+/*
+ * Removes and returns the next core in pending that is also in set,
+ * starting after the core returned before
+ */
+static int pop(doorbell_set_t* pending, doorbell_set_t* set, int* cursor)
+{
+    int start = (*cursor + 1) % CONS_MAX_CORES;
+    // the word of the start is searched twice, above and below the start
+    for (int i = 0; i <= DOORBELL_WORDS; i++) {
+        int w = ((start / 64) + i) % DOORBELL_WORDS;
+        uint64_t ready = pending->bits[w] & set->bits[w];
+        if (i == 0) {
+            ready &= ~0ULL << (start % 64);
+        } else if (i == DOORBELL_WORDS) {
+            ready &= ~(~0ULL << (start % 64));
+        }
+
+        if (ready) {
+            int bit = __builtin_ctzll(ready);
+            pending->bits[w] &= ~(1ULL << bit);
+            *cursor = w*64 + bit;
+            return *cursor;
+        }
+    }
+    return -1;
+}
+
+// the core stays pending as long as it has messages
+static int next_in(doorbell_loop_t* loop, doorbell_set_t* set, int* cursor)
+{
+    int core;
+    while ((core = pop(&loop->pending, set, cursor)) >= 0) {
+        if (smlt_can_recv(core)) {
+            set_add(&loop->pending, core);
+            return core;
+        }
+    }
+    return -1;
+}
+
+void doorbell_loop_init(doorbell_loop_t* loop, uint8_t self,
+                        uint8_t* replicas, uint8_t num_replicas,
+                        uint8_t* clients, uint8_t num_clients)
+{
+    memset(loop, 0, sizeof(doorbell_loop_t));
+    loop->self = self;
+    loop->replica_cursor = -1;
+    loop->client_cursor = -1;
+    for (int i = 0; i < num_replicas; i++) {
+        if (replicas[i] != self) {
+            set_add(&loop->replicas, replicas[i]);
+        }
+    }
+    for (int i = 0; i < num_clients; i++) {
+        if (clients[i] != self) {
+            set_add(&loop->clients, clients[i]);
+        }
+    }
+    // messages sent before the loop started
+    sweep(loop, &loop->replicas);
+    sweep(loop, &loop->clients);
+}
+
+int doorbell_next(doorbell_loop_t* loop, bool take_clients)
+{
+    // also under load, a sender that did not ring is not starved
+    loop->rounds++;
+    if (loop->rounds >= DOORBELL_SWEEP) {
+        sweep(loop, &loop->replicas);
+        sweep(loop, &loop->clients);
+        loop->rounds = 0;
+    }
+
+    collect(loop);
+    int core = next_in(loop, &loop->replicas, &loop->replica_cursor);
+    if ((core < 0) && take_clients) {
+        core = next_in(loop, &loop->clients, &loop->client_cursor);
+    }
+    return core;
+}
+
+static bool loop_ready(void* arg)
+{
+    doorbell_loop_t* loop = (doorbell_loop_t*) arg;
+    collect(loop);
+    for (int i = 0; i < DOORBELL_WORDS; i++) {
+        if (loop->pending.bits[i] &
+            (loop->replicas.bits[i] | loop->clients.bits[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void doorbell_idle(doorbell_loop_t* loop, idle_state_t* idle)
+{
+    idle_backoff(idle, &doorbells[loop->self].wake, loop_ready, loop);
+}
+
+static bool core_ready(void* arg)
+{
+    return smlt_can_recv((uintptr_t) arg);
+}
+
+void doorbell_idle_core(uint8_t core, idle_state_t* idle)
+{
+    idle_backoff(idle, &doorbells[get_self()].wake, core_ready,
+                 (void*) (uintptr_t) core);
+}
@@ -0,0 +1,130 @@
+/**
+ * \file
+ * \brief Spinning, pausing and parking of idle replicas
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#ifndef BARRELFISH
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "consensus.h"
+#include "idle.h"
+
+static uint8_t policy = CONS_IDLE_POLICY;
+static uint32_t spin_rounds = CONS_IDLE_SPIN_ROUNDS;
+static uint32_t pause_rounds = CONS_IDLE_PAUSE_ROUNDS;
+
+void consensus_set_idle_policy(uint8_t p, uint32_t spin, uint32_t pause)
+{
+    if (p > CONS_IDLE_PARK) {
+        printf("Idle policy %d unknown, spinning \n", p);
+        p = CONS_IDLE_SPIN;
+    }
+    policy = p;
+    spin_rounds = spin;
+    pause_rounds = pause;
+}
+
+uint8_t consensus_get_idle_policy(void)
+{
+    return policy;
+}
+
+static inline void cpu_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+static void park(idle_word_t* word, uint32_t seq)
+{
+#ifdef BARRELFISH
+    // no futex, back off with a yield
+    thread_yield();
+#else
+    struct timespec timeout;
+    timeout.tv_sec = CONS_IDLE_PARK_TIMEOUT / 1000000;
+    timeout.tv_nsec = (CONS_IDLE_PARK_TIMEOUT % 1000000) * 1000;
+    // returns right away if seq changed in between
+    syscall(SYS_futex, &word->seq, FUTEX_WAIT_PRIVATE, seq, &timeout,
+            NULL, 0);
+#endif
+}
+
+void idle_init(idle_state_t* idle, bool (*busy)(void))
+{
+    memset(idle, 0, sizeof(idle_state_t));
+    idle->busy = busy;
+}
+
+void idle_backoff(idle_state_t* idle, idle_word_t* word,
+                  bool (*ready)(void*), void* arg)
+{
+    if (policy == CONS_IDLE_SPIN) {
+        return;
+    }
+
+    if (idle->rounds < spin_rounds) {
+        idle->rounds++;
+        return;
+    }
+
+    if ((policy == CONS_IDLE_PAUSE) ||
+        (idle->rounds < (spin_rounds + pause_rounds))) {
+        idle->rounds++;
+        cpu_pause();
+        return;
+    }
+
+    if (idle->busy != NULL && idle->busy()) {
+        cpu_pause();
+        return;
+    }
+
+    /*
+     * The sender makes its work visible, then checks for sleepers. We
+     * announce that we sleep, then check for work. One of the two sees
+     * the other, the sender bumps seq and the futex does not block.
+     */
+    uint32_t seq = __atomic_load_n(&word->seq, __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&word->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (!ready(arg)) {
+        park(word, seq);
+        idle->parks++;
+    }
+    __atomic_fetch_sub(&word->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+void idle_wake(idle_word_t* word)
+{
+    if (policy != CONS_IDLE_PARK) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&word->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(&word->seq, 1, __ATOMIC_RELEASE);
+#ifndef BARRELFISH
+        syscall(SYS_futex, &word->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+#endif
+    }
+}
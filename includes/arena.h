@@ -0,0 +1,81 @@
+/**
+ * \file
+ * \brief Shared payload arena for commands that are passed by reference
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _arena_h
+#define _arena_h 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// size of a chunk i.e. maximum size of a command in the arena
+#define ARENA_CHUNK_SIZE 4096
+// chunks per client, at least one per outstanding request
+#define ARENA_NUM_CHUNKS 64
+// max time in ms an allocation waits for the replicas to release a chunk
+#ifndef ARENA_ALLOC_TIMEOUT
+#define ARENA_ALLOC_TIMEOUT 1000
+#endif
+
+/*
+ * Handle of a command in the arena. Only the handle is agreed on
+ * and passed to the replicas.
+ */
+struct arena_handle {
+    uint32_t region;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t gen;
+};
+
+// region of a client in a consensus group
+#define ARENA_REGION(group, client) ((group)*MAX_NUM_CLIENTS + (client))
+
+/**
+ * \brief initializes the arena of a consensus group
+ *
+ * \param group     the consensus group
+ * \param num_refs  number of replicas of the group that execute every
+ *                  command i.e. that have to release a chunk before it can
+ *                  be reused
+ */
+void arena_init(uint8_t group, uint32_t num_refs);
+
+/**
+ * \brief allocates a chunk in the region of a client. The region is
+ *        allocated on the NUMA node of the calling thread on first use.
+ *        Blocks until the chunk is released by all replicas.
+ *
+ * \param region    the region, ARENA_REGION() of the group and client id
+ * \param len       size of the command
+ * \param handle    returns the handle of the chunk
+ *
+ * \returns the memory of the chunk or NULL if len is too large or the
+ *          chunk was not released within ARENA_ALLOC_TIMEOUT
+ */
+void* arena_alloc(uint32_t region, uint32_t len, struct arena_handle* handle);
+
+/**
+ * \brief returns the memory a handle refers to or NULL if the chunk was
+ *        already reused
+ */
+void* arena_get(struct arena_handle* handle);
+
+/**
+ * \brief releases the reference of the calling replica to a handle. A
+ *        replica releases a handle only once, releasing it again e.g. for
+ *        a duplicate of the command does nothing
+ */
+void arena_release(struct arena_handle* handle);
+
+#endif // _arena_h
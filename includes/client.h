@@ -15,16 +15,64 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "consensus.h"
+#include "command.h"
+
 #define SETUP_TAG 0
 #define REQ_TAG 1
 #define RESP_TAG 2
 
+// maximum number of outstanding requests per client
+#define MAX_WINDOW 64
+
 /*
  * Initializes a client that can be used to send requets
  * to the consensus service 
  */
 int init_consensus_client(void);
 int consensus_send_request(uintptr_t* req);
+/*
+ * Sends a command of len bytes, consensus_send_request() sends
+ * CONS_DEFAULT_CMD_SIZE bytes. Commands larger than consensus_get_cmd_size()
+ * (up to ARENA_CHUNK_SIZE) are copied to the payload arena and only
+ * a handle is agreed on.
+ */
+int consensus_send_request_len(uintptr_t* req, uint16_t len);
+
+/*
+ * Zero copy interface. consensus_cmd_alloc() returns arena memory of
+ * len bytes to write the command to, consensus_send_cmd() and
+ * consensus_submit_cmd() send the handle of the last allocated command.
+ * The replicas execute the command in the arena directly.
+ */
+void* consensus_cmd_alloc(uint16_t len);
+int consensus_send_cmd(void);
+int64_t consensus_submit_cmd(void);
+
+/*
+ * Sharded interface. The command is ordered by the group
+ * consensus_group_of() returns for the partition key, the commands of
+ * a key are executed in the order they were sent. The functions
+ * without a key send to the first group.
+ */
+int consensus_send_request_key(uint64_t key, uintptr_t* req, uint16_t len);
+int64_t consensus_submit_key(uint64_t key, uintptr_t* req, uint16_t len);
+void* consensus_cmd_alloc_key(uint64_t key, uint16_t len);
+
+/*
+ * Pipelined interface. consensus_submit() does not wait for the reply
+ * and returns the request id of the command or -1 if there are already
+ * window requests outstanding. consensus_poll_completions() does not block
+ * and returns the number of replies received, their request ids
+ * are written to rids. The blocking sends keep the replies to submits
+ * they receive for the next poll, they fail if no slot gets free because
+ * MAX_WINDOW replies were not polled.
+ */
+void consensus_set_window(uint16_t window);
+int64_t consensus_submit(uintptr_t* req);
+int64_t consensus_submit_len(uintptr_t* req, uint16_t len);
+int consensus_poll_completions(uint32_t* rids, int max);
+uint16_t consensus_outstanding(void);
 
 uint16_t get_tag(uintptr_t* msg);
 void set_tag(uintptr_t* msg, uint16_t tag);
@@ -35,10 +83,18 @@ void set_client_id(uintptr_t* msg, uint16_t cid);
 uint32_t get_request_id(uintptr_t* msg);
 void set_request_id(uintptr_t* msg, uint32_t client_id);
 
+/*
+ * Length of the command in bytes that follows the header
+ */
+uint16_t get_cmd_len(uintptr_t* msg);
+void set_cmd_len(uintptr_t* msg, uint16_t len);
+// number of words of a message carrying the command
+uint32_t get_msg_words(uintptr_t* msg);
+
 
 typedef struct benchmark_client_args_t{
     uint8_t core;
-    uint8_t num_cores;
+    uint16_t num_cores;
     uint8_t num_replicas;
     uint8_t num_clients;
     bool dummy;
@@ -46,8 +102,12 @@ typedef struct benchmark_client_args_t{
     uint8_t protocol;
     uint8_t protocol_below;
     uint8_t topo;
-    uint8_t leader;
-    uint8_t recv_from;
+    // leader and replica that replies of every group
+    uint8_t num_groups;
+    uint8_t leader[CONS_MAX_GROUPS];
+    uint8_t recv_from[CONS_MAX_GROUPS];
+    uint16_t window;
+    uint16_t cmd_size;
 } benchmark_client_args_t;
 
 void* init_benchmark_client(void* args);
@@ -58,6 +118,7 @@ int init_consensus_client_bench(int current_core,
                                 int num_replicas,
                                 int num_clients,
                                 int topo,
-                                int last_replica,
-                                int leader);
+                                int num_groups,
+                                uint8_t* recv_from,
+                                uint8_t* leaders);
 #endif // _client_h
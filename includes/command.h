@@ -0,0 +1,72 @@
+/**
+ * \file
+ * \brief Commands of variable length that are agreed on
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _command_h
+#define _command_h 1
+
+#include <stdint.h>
+
+// maximum size of a command in bytes
+#define CONS_MAX_CMD_SIZE 512
+// size of a command if none is given
+#define CONS_DEFAULT_CMD_SIZE 24
+// header words in front of the command in every message
+#define CONS_HDR_WORDS 4
+// number of words a command of len bytes occupies
+#define CONS_CMD_WORDS(len) (((len)+sizeof(uintptr_t)-1)/sizeof(uintptr_t))
+// size of a message buffer that can hold any command
+#define CONS_MSG_SIZE ((CONS_HDR_WORDS*sizeof(uintptr_t))+CONS_MAX_CMD_SIZE)
+
+// flag in the length field, the command is a handle to the payload arena
+#define CONS_CMD_HANDLE 0x8000
+// flag in the length field, the command is a batch of commands where each
+// one is a word holding its length field followed by the command words
+#define CONS_CMD_BATCH 0x4000
+// number of bytes of the length field that are carried in the message
+#define CONS_CMD_BYTES(len) ((len) & ~(CONS_CMD_HANDLE | CONS_CMD_BATCH))
+
+/**
+ * \brief returns the length in bytes of the command that is executed.
+ *        Only valid when called from within the execution function.
+ */
+uint16_t consensus_get_cmd_len(void);
+
+/**
+ * \brief calls the execution function on a command. If the command is a
+ *        handle, the function is called on the arena memory and the
+ *        reference of this replica is released afterwards. A batch is
+ *        executed command by command in the order it was built.
+ *
+ * \param exec_fn   the execution function
+ * \param cmd       the command
+ * \param len       length field of the command
+ */
+void consensus_exec_cmd(void (*exec_fn)(void*), void* cmd, uint16_t len);
+
+/**
+ * \brief drops a command that is not executed e.g. a duplicate, the
+ *        references of this replica to the handles in it are released
+ *
+ * \param cmd       the command
+ * \param len       length field of the command
+ */
+void consensus_skip_cmd(void* cmd, uint16_t len);
+
+/**
+ * \brief counts the commands consensus_exec_cmd() executes on the calling
+ *        thread in counter, NULL stops counting
+ */
+void consensus_exec_count(uint64_t* counter);
+
+#endif // _command_h
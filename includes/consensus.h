@@ -21,6 +21,10 @@
 
 #define MAX_NUM_CLIENTS 64
 #define MAX_NUM_REPLICAS 64
+// core ids are 8 bit
+#define CONS_MAX_CORES 256
+// independent consensus groups in a process
+#define CONS_MAX_GROUPS 8
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
@@ -54,8 +58,9 @@
 
 struct smlt_context;
 struct smlt_topology;
-struct smlt_context* ctx;
-struct smlt_topology* topo;
+// context and tree of the group the calling replica belongs to
+extern __thread struct smlt_context* ctx;
+extern __thread struct smlt_topology* topo;
 // should we use libsyncs tree?
 
 
@@ -72,6 +77,10 @@ typedef struct cons_args_t{
     uint8_t algo;
     uint8_t node_size;
     uint8_t started_from;
+    // consensus group the replica belongs to
+    uint8_t group;
+    // maximum size of a command that is passed inline
+    uint16_t cmd_size;
     uint8_t* cores;
     void* shared_mem;
     uint8_t* clients;
@@ -80,6 +89,33 @@ typedef struct cons_args_t{
 } cons_args_t;
 
 
+/**
+ * \brief sets the maximum size of a command that is passed inline through
+ *        all tiers, larger commands are passed by handle. Has to be set
+ *        before consensus_init(), default CONS_MAX_CMD_SIZE.
+ */
+void consensus_set_cmd_size(uint16_t cmd_size);
+uint16_t consensus_get_cmd_size(void);
+
+// what replicas and SHM readers do while there are no messages
+#define CONS_IDLE_SPIN 0
+#define CONS_IDLE_PAUSE 1
+#define CONS_IDLE_PARK 2
+
+/**
+ * \brief sets what replicas and SHM readers do while they have nothing to
+ *        handle. CONS_IDLE_SPIN polls all the time (default),
+ *        CONS_IDLE_PAUSE polls with a pause in between after spin polls,
+ *        CONS_IDLE_PARK in addition sleeps after another pause polls until
+ *        a sender wakes it. Has to be set before consensus_init().
+ *
+ * \param policy  CONS_IDLE_SPIN, CONS_IDLE_PAUSE or CONS_IDLE_PARK
+ * \param spin    polls without pausing before the thread backs off
+ * \param pause   polls with a pause before the thread parks
+ */
+void consensus_set_idle_policy(uint8_t policy, uint32_t spin, uint32_t pause);
+uint8_t consensus_get_idle_policy(void);
+
 /**
  * \brief initializing algorithm on node level, core level will be started automatically
  *
@@ -93,8 +129,14 @@ typedef struct cons_args_t{
  * \param node_size	number of cores in a node
  * \param client_cores the cores on which clients are started
  * \param exec_func function that should be executed after agreement
+ *
+ * Returns once the replicas of all tiers are ready to handle requests,
+ * the time the startup took is printed.
+ *
+ * \returns the id of the first group or -1 if the replicas were not
+ *          ready within CONS_STARTUP_TIMEOUT
  */
-void consensus_init(uint8_t total_cores,
+int consensus_init(uint16_t total_cores,
             uint8_t algorithm, 
 		    uint8_t* cores,
 		    uint8_t num_cores,
@@ -105,19 +147,88 @@ void consensus_init(uint8_t total_cores,
             uint8_t* client_cores,
             void (*exec_func)(void*));
 
+/**
+ * \brief starts an additional consensus group with its own leader, log and
+ *        Smelt context. Takes the same arguments as consensus_init(), which
+ *        starts the first group. The groups have to run on disjoint cores,
+ *        every client connects to every group. Returns once the replicas
+ *        of the group are ready.
+ *
+ * \returns the id of the group or -1 if it could not be started
+ */
+int consensus_init_group(uint16_t total_cores,
+            uint8_t algorithm,
+		    uint8_t* cores,
+		    uint8_t num_cores,
+		    uint8_t num_clients,
+		    uint8_t alg_below,
+		    uint8_t node_size,
+		    uint8_t* node_cores,
+            uint8_t* client_cores,
+            void (*exec_func)(void*));
+
+/**
+ * \brief returns the number of consensus groups that were started
+ */
+uint8_t consensus_num_groups(void);
+
+/**
+ * \brief returns the group that orders the commands with the partition
+ *        key, the keys are hashed so consecutive keys are spread over
+ *        the groups
+ */
+uint8_t consensus_group_of(uint64_t key);
+
+/**
+ * \brief prints the number of commands every replica of every tier
+ *        executed, once the clients stopped they are the same for all
+ *        replicas of a group
+ */
+void consensus_print_executed(void);
+
+// placement and protocols consensus_init_auto() chose
+typedef struct cons_plan_t{
+    uint16_t total_cores;
+    uint8_t algo;
+    uint8_t alg_below;
+    uint8_t num_replicas;
+    uint8_t node_size;
+    uint8_t num_clients;
+    uint8_t cores[MAX_NUM_REPLICAS];
+    uint8_t node_cores[CONS_MAX_CORES];
+    uint8_t client_cores[MAX_NUM_CLIENTS];
+} cons_plan_t;
+
 /**
  * \brief initializing algorithm on node level, core level will be started automatically
  *
+ * The NUMA nodes, cores and SMT siblings are discovered through libnuma and
+ * sysfs. Every NUMA node gets a tier1 replica, the clients are placed on an
+ * SMT sibling or the last core of a node and with full replication the
+ * other cores of a node are tier2 replicas. The tier1 protocol is 1Paxos
+ * if failures have to be tolerated and broadcast otherwise, tier2 is SHM.
+ * The plan is printed in the format of the benchmark config files.
+ *
  * \param exec_func	function that should be executed after agreement
  * \param failures	Should the consensus protocol started tolerate failures?
  * \param full_replication	Should the replication be on all cores or only once per NUMA node?
+ *
+ * \returns the id of the group or -1 if no plan was found or the replicas
+ *          could not be started, the plan is cleared then
  */
-void consensus_init_auto(
+int consensus_init_auto(
 		    void (*exec_func)(void* arg),
 		    bool failures,
 		    bool full_replication);
+
+/**
+ * \brief returns the plan of the last consensus_init_auto() call e.g.
+ *        to start the clients on the chosen cores
+ */
+const cons_plan_t* consensus_get_plan(void);
 /**
- * \brief initializing benchmark clients on node level
+ * \brief initializing benchmark clients on node level, every client connects
+ *        to the leaders of all groups started so far
  *
  * \param num_cores number of cores the machine has
  * \param cores		array of core numbers on which the clients should 
@@ -129,11 +240,12 @@ void consensus_init_auto(
  * \param protocol      Only used when compiled with libsync
  * \param protocol_below      Only used when compiled with libsync
  * \param topo          If libsync is used the number of the tree topology
- * \param replica_cores          cores on which the replicas are running
+ * \param window       number of outstanding requests per client
+ * \param cmd_size     size of the commands the clients send in bytes
  *                  
  */
 
-void consensus_bench_clients_init(uint8_t num_cores,
+void consensus_bench_clients_init(uint16_t num_cores,
             uint8_t* cores,
 		    uint8_t num_clients,
             uint8_t num_replicas,
@@ -142,7 +254,8 @@ void consensus_bench_clients_init(uint8_t num_cores,
             uint8_t protocol,
             uint8_t protocol_below,
             uint8_t topo,
-            uint8_t* replica_cores);
+            uint16_t window,
+            uint16_t cmd_size);
 
 
 /*
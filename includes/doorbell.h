@@ -0,0 +1,113 @@
+/**
+ * \file
+ * \brief Doorbells to find the channels with pending messages
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _doorbell_h
+#define _doorbell_h 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <smlt.h>
+
+#include "idle.h"
+
+// one bit per core that can send
+#define DOORBELL_WORDS 4
+// calls after which all channels are probed in case a bell was missed
+#ifndef DOORBELL_SWEEP
+#define DOORBELL_SWEEP 1024
+#endif
+
+/*
+ * Set of cores, used for the bells taken from a doorbell and for the
+ * cores a loop receives from
+ */
+typedef struct doorbell_set {
+    uint64_t bits[DOORBELL_WORDS];
+} doorbell_set_t;
+
+/**
+ * \brief rings the doorbell of a core after a message was sent to it
+ *
+ * \param receiver  the core the message was sent to
+ */
+void doorbell_ring(uint8_t receiver);
+
+/**
+ * \brief sends a message and rings the doorbell of the receiver
+ */
+static inline errval_t doorbell_send(uint8_t receiver, struct smlt_msg* msg)
+{
+    errval_t err = smlt_send(receiver, msg);
+    doorbell_ring(receiver);
+    return err;
+}
+
+/*
+ * State of a receive loop: the bells taken so far and the cores it
+ * receives from, split into replicas and clients
+ */
+typedef struct doorbell_loop {
+    uint8_t self;
+    doorbell_set_t pending;
+    doorbell_set_t replicas;
+    doorbell_set_t clients;
+    int replica_cursor;
+    int client_cursor;
+    uint32_t rounds;
+} doorbell_loop_t;
+
+/**
+ * \brief initializes the receive loop of a core
+ *
+ * \param loop          the loop state
+ * \param self          the core the loop runs on, it is not received from
+ * \param replicas      cores of the replicas
+ * \param num_replicas  length of replicas
+ * \param clients       cores of the clients
+ * \param num_clients   length of clients
+ */
+void doorbell_loop_init(doorbell_loop_t* loop, uint8_t self,
+                        uint8_t* replicas, uint8_t num_replicas,
+                        uint8_t* clients, uint8_t num_clients);
+
+/**
+ * \brief returns a core with a message in its channel or -1 if there is
+ *        none. Replicas go before clients, within each group the cores
+ *        are served round robin. Every DOORBELL_SWEEP calls all
+ *        channels are probed in case a sender did not ring.
+ *
+ * \param loop          the loop state
+ * \param take_clients  false if no client requests should be taken
+ */
+int doorbell_next(doorbell_loop_t* loop, bool take_clients);
+
+/**
+ * \brief backs off when doorbell_next() found nothing, a parked thread is
+ *        woken when a bell of the loop is rung
+ *
+ * \param loop  the loop state
+ * \param idle  the idle state of the thread
+ */
+void doorbell_idle(doorbell_loop_t* loop, idle_state_t* idle);
+
+/**
+ * \brief backs off when a loop that receives from a single core found
+ *        nothing, a parked thread is woken when its doorbell is rung
+ *
+ * \param core  the core the loop receives from
+ * \param idle  the idle state of the thread
+ */
+void doorbell_idle_core(uint8_t core, idle_state_t* idle);
+
+#endif // _doorbell_h
@@ -0,0 +1,100 @@
+/**
+ * \file
+ * \brief What a replica does while it has nothing to handle
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _idle_h
+#define _idle_h 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// policy until consensus_set_idle_policy() is called
+#ifndef CONS_IDLE_POLICY
+#define CONS_IDLE_POLICY CONS_IDLE_SPIN
+#endif
+
+// polls without finding anything before a thread pauses
+#ifndef CONS_IDLE_SPIN_ROUNDS
+#define CONS_IDLE_SPIN_ROUNDS 10000
+#endif
+
+// polls with a pause before a thread parks
+#ifndef CONS_IDLE_PAUSE_ROUNDS
+#define CONS_IDLE_PAUSE_ROUNDS 1000
+#endif
+
+// max time in us a parked thread sleeps, bounds the delay if a
+// sender did not wake it
+#ifndef CONS_IDLE_PARK_TIMEOUT
+#define CONS_IDLE_PARK_TIMEOUT 1000
+#endif
+
+/*
+ * Word a thread parks on, the sender bumps seq if a thread sleeps
+ */
+typedef struct idle_word {
+    uint32_t seq;
+    uint32_t sleepers;
+} idle_word_t;
+
+/*
+ * Idle state of a receive loop
+ */
+typedef struct idle_state {
+    // polls without finding anything since the last message
+    uint32_t rounds;
+    // number of times the thread parked
+    uint64_t parks;
+    // returns true while the thread has work that does not arrive as
+    // a message e.g. a batch that is sent after a delay, it does not park
+    bool (*busy)(void);
+} idle_state_t;
+
+/**
+ * \brief initializes the idle state of a receive loop
+ *
+ * \param idle  the idle state
+ * \param busy  NULL or function that returns true while the thread must
+ *              not park
+ */
+void idle_init(idle_state_t* idle, bool (*busy)(void));
+
+/**
+ * \brief has to be called when the loop found work
+ */
+static inline void idle_reset(idle_state_t* idle)
+{
+    idle->rounds = 0;
+}
+
+/**
+ * \brief called when the loop found nothing to do. Depending on the policy
+ *        set with consensus_set_idle_policy() it returns right away,
+ *        pauses or parks on word until a sender calls idle_wake().
+ *
+ * \param idle   the idle state
+ * \param word   the word the thread parks on
+ * \param ready  returns true if there is work, checked before parking
+ * \param arg    argument to ready
+ */
+void idle_backoff(idle_state_t* idle, idle_word_t* word,
+                  bool (*ready)(void*), void* arg);
+
+/**
+ * \brief wakes the threads parked on word, has to be called after the
+ *        work is visible to the receiver. Only costs a fence if the
+ *        policy is CONS_IDLE_PARK.
+ */
+void idle_wake(idle_word_t* word);
+
+#endif // _idle_h
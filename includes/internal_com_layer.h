@@ -12,6 +12,33 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+// decisions a node level replica sends to its core level protocol
+// before it waits for an ack
+#ifndef COM_LAYER_CREDITS
+#define COM_LAYER_CREDITS 16
+#endif
+
+// max time in ms consensus_init() waits for the replicas to be ready
+#ifndef CONS_STARTUP_TIMEOUT
+#define CONS_STARTUP_TIMEOUT 10000
+#endif
+
+// decisions that are coalesced into one request to the core level
+#ifndef COM_LAYER_BATCH
+#define COM_LAYER_BATCH 8
+#endif
+
+// max delay in us before an incomplete batch is sent to the core level
+#ifndef COM_LAYER_BATCH_DELAY
+#define COM_LAYER_BATCH_DELAY 20
+#endif
+
+// time in ms the TSC rate is measured at startup
+#ifndef COM_LAYER_TSC_CALIBRATION
+#define COM_LAYER_TSC_CALIBRATION 10
+#endif
 
 /**
  * \brief initializing the layer between node level and core level algorithms
@@ -24,10 +51,13 @@
  * \param num_cores	length of the array cores
  * \param cmd_size	mostly for shared memory part where the slots are fixed size
  * \param exec_func function that is executed after agreement on a value
+ *
+ * \returns 0 or -1 if the command size or the algorithm is not supported,
+ *          the startup of the group fails then
  */
 
 struct smlt_msg;
-void com_layer_core_init(uint8_t algorithm, 
+int com_layer_core_init(uint8_t algorithm, 
         uint8_t replica_id,
         uint8_t current_core,
         uint8_t* cores,
@@ -35,7 +65,57 @@ void com_layer_core_init(uint8_t algorithm,
         uint16_t cmd_size, 
         void (*exec_func)(void*));
 
+/**
+ * \brief forwards a decided command to the core level. Consecutive commands
+ *        are coalesced into a batch that is sent when it is full
+ *
+ * \param msg   message holding the command, it is not changed
+ */
 void com_layer_core_send_request(struct smlt_msg* msg);
 
+/**
+ * \brief sets the group of the calling replica thread i.e. the Smelt
+ *        context and tree its protocol uses, has to be called before the
+ *        protocol is initialized
+ */
+void com_layer_enter_group(uint8_t group);
+
+/**
+ * \brief returns the counter of the commands the replica on core executes,
+ *        registered for the group of the calling replica
+ */
+uint64_t* com_layer_exec_counter(uint8_t core, uint8_t level);
+
+/**
+ * \brief signals that a replica of any tier is initialized and about to
+ *        handle messages, consensus_init() returns once all are ready
+ */
+void com_layer_replica_ready(void);
+
+/**
+ * \brief signals that a replica could not be initialized, the startup of
+ *        its group fails instead of waiting for CONS_STARTUP_TIMEOUT
+ */
+void com_layer_replica_failed(void);
+
+/**
+ * \brief processes the acks of the core level protocol that arrived so far
+ *        and sends a batch that is older than COM_LAYER_BATCH_DELAY,
+ *        has to be called by the node level replica when it is idle
+ */
+void com_layer_core_poll(void);
+
+/**
+ * \brief returns the TSC cycles per us that were measured when the first
+ *        group was started, the delays of the replicas are converted with it
+ */
+uint64_t com_layer_tsc_per_us(void);
+
+/**
+ * \brief returns true while a batch waits to be sent or acks of the core
+ *        level are outstanding, the node level replica must not park
+ */
+bool com_layer_core_busy(void);
+
 
 #endif // _com_layer_h
@@ -20,10 +20,54 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "consensus.h"
+#include "arena.h"
+
 #define MAX_REPLICAS 64
-#define KVS_MEM_SIZE 16384
-// shared memory for different replicas
-extern void* kvs_memory[MAX_REPLICAS];
+
+struct kvs_table;
+// hash tables of the replicas, every consensus group stores the keys
+// that are routed to it
+extern struct kvs_table* kvs_memory[CONS_MAX_GROUPS][MAX_REPLICAS];
+
+/*
+ * Log position of a node level replica. A set counts as started before
+ * its value is stored and as applied once it is visible in kvs_memory.
+ * The values a set replaces are kept as older versions as long as a
+ * snapshot at gc or later can still read them.
+ */
+typedef struct kvs_index {
+    uint64_t started;
+    uint64_t applied;
+    uint64_t gc;
+} __attribute__((aligned(64))) kvs_index_t;
+
+extern kvs_index_t* kvs_index[CONS_MAX_GROUPS][MAX_REPLICAS];
+
+// most clients that read snapshots at once
+#define KVS_MAX_READERS 64
+
+// applied sets after which a replica looks for the oldest snapshot again
+#ifndef KVS_GC_INTERVAL
+#define KVS_GC_INTERVAL 64
+#endif
+
+/*
+ * Log index + 1 of the snapshot a client reads in a group, 0 while it
+ * reads none. The replicas of the group keep the versions it reads.
+ */
+typedef struct kvs_reader {
+    uint64_t index;
+} __attribute__((aligned(64))) kvs_reader_t;
+
+extern kvs_reader_t kvs_readers[CONS_MAX_GROUPS][KVS_MAX_READERS];
+
+// reads return the newest value of the closest replica, which can miss
+// sets that already completed
+#define KVS_READ_STALE 0
+// reads wait until the closest replica applied every set that started
+// anywhere before the read
+#define KVS_READ_LINEARIZABLE 1
 
 void* init_kvs_replica(void* arg);
 
@@ -39,6 +83,100 @@ struct kvs_value {
 uint64_t kvs_get(uintptr_t key, struct kvs_value* val);
 uint64_t kvs_set(uintptr_t key, struct kvs_value* val);
 
+/*
+ * A set command is the number of keys followed by key, length and value
+ * of every key, the values are padded to words. A set of a single key is
+ * a multi set of one key.
+ */
+#define KVS_VALUE_WORDS(len) (((len) + sizeof(uintptr_t) - 1)/sizeof(uintptr_t))
+#define KVS_SET_HDR (3*sizeof(uintptr_t))
+#define KVS_SET_SIZE(len) (KVS_SET_HDR + KVS_VALUE_WORDS(len)*sizeof(uintptr_t))
+// the largest value, a set of it fills a chunk of the payload arena
+#define KVS_MAX_VALUE (ARENA_CHUNK_SIZE - KVS_SET_HDR)
+
+// most keys of a multi set, larger commands go through the payload arena
+#define KVS_MULTI_MAX_KEYS 64
+#define KVS_MULTI_SET_SIZE(n) \
+    ((1 + (n)*(2 + KVS_VALUE_WORDS(sizeof(struct kvs_value))))*sizeof(uintptr_t))
+
+/**
+ * \brief sets a value of len bytes, the replicas store it in a chunk of
+ *        their slab allocator
+ *
+ * \returns 0 on success, -1 if len is larger than KVS_MAX_VALUE
+ */
+int kvs_set_len(uintptr_t key, void* val, uint16_t len);
+
+/**
+ * \brief reads up to max bytes of the value of a key, the rest of val is
+ *        zeroed
+ *
+ * \returns the length of the value, 0 if the key was never set
+ */
+uint16_t kvs_get_len(uintptr_t key, void* val, uint16_t max);
+
+/**
+ * \brief sets num keys with a single command, the replicas apply all of
+ *        them at the same log position. With several consensus groups
+ *        all keys have to belong to the group of the first key.
+ *
+ * \returns 0 on success, -1 if there are too many keys or they belong
+ *          to different groups
+ */
+int kvs_multi_set(uintptr_t* keys, struct kvs_value* vals, int num);
+
+/**
+ * \brief reads num keys from the closest replica, the lookups of the keys
+ *        are overlapped by prefetching the buckets of the following keys.
+ *        Waits for the read index once per group.
+ */
+void kvs_multi_get(uintptr_t* keys, struct kvs_value* vals, int num);
+
+/**
+ * \brief reads num keys of one group as they were at the same log index
+ *        without taking a lock. The replica keeps the versions of the
+ *        snapshot until the read is done. In KVS_READ_LINEARIZABLE mode
+ *        the snapshot includes every set that started before.
+ *
+ * \param index  returns the log index of the snapshot
+ *
+ * \returns 0 on success, -1 if there are too many keys or they belong
+ *          to different groups
+ */
+int kvs_snapshot_get(uintptr_t* keys, struct kvs_value* vals, int num,
+                     uint64_t* index);
+
+/**
+ * \brief sets how kvs_get() reads, KVS_READ_LINEARIZABLE (default) or
+ *        KVS_READ_STALE. Has to be set before the clients are started.
+ */
+void kvs_set_read_mode(uint8_t mode);
+uint8_t kvs_get_read_mode(void);
+
+/**
+ * \brief number of keys the benchmark clients set and get with one
+ *        kvs_multi_set()/kvs_multi_get(), 1 uses kvs_set()/kvs_get()
+ */
+void kvs_set_bench_keys(uint8_t num);
+
+/**
+ * \brief lets the benchmark clients read their keys with
+ *        kvs_snapshot_get() instead of kvs_multi_get()
+ */
+void kvs_set_bench_snapshot(bool snapshot);
+
+/**
+ * \brief size of the values the benchmark clients set with kvs_set_len()
+ *        when they set single keys, default sizeof(struct kvs_value)
+ */
+void kvs_set_bench_value(uint16_t len);
+
+/**
+ * \brief prints the memory of the hash table and of every size class of
+ *        the slab allocator of the node level replicas
+ */
+void kvs_print_memory(void);
+
 void* init_benchmark_kvs_client(void* args);
 
 #endif // _kvs_h
@@ -0,0 +1,87 @@
+/**
+ * \file
+ * \brief Size class allocator for the values of a KVS replica
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _kvs_slab_h
+#define _kvs_slab_h 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// chunks of 16, 32, ... 4096 bytes
+#define KVS_SLAB_MIN_CHUNK 16
+#define KVS_SLAB_CLASSES 9
+
+// memory that is mapped at once for a size class
+#ifndef KVS_SLAB_SIZE
+#define KVS_SLAB_SIZE (64*1024)
+#endif
+
+/*
+ * Reference to a value that the hash table stores: the length in the
+ * upper 16 bits, the address of the chunk in the lower 48 bits
+ */
+#define KVS_REF(ptr, len) (((uint64_t) (len) << 48) | (uint64_t) (uintptr_t) (ptr))
+#define KVS_REF_PTR(ref) ((void*) (uintptr_t) ((ref) & ((1ULL << 48) - 1)))
+#define KVS_REF_LEN(ref) ((uint16_t) ((ref) >> 48))
+
+struct kvs_slab_class {
+    // chunks that were freed, linked through their first word
+    void* free;
+    // rest of the slab that was mapped last
+    uint8_t* next;
+    uint8_t* end;
+    uint64_t slabs;
+    uint64_t chunks;
+    // bytes of the values in the chunks
+    uint64_t bytes;
+};
+
+/*
+ * Allocator of a single replica, only the replica allocates and frees.
+ * Slabs are never unmapped, so a reader that still holds a reference to
+ * a freed chunk reads mapped memory.
+ */
+typedef struct kvs_slab {
+    struct kvs_slab_class classes[KVS_SLAB_CLASSES];
+} kvs_slab_t;
+
+/**
+ * \brief creates an allocator in the memory of the NUMA node of the
+ *        caller, every size class gets its first slab right away
+ */
+kvs_slab_t* kvs_slab_create(void);
+
+/**
+ * \brief returns a chunk of the smallest size class len fits in or NULL
+ *        if len is larger than the largest class. A slab is only mapped
+ *        if the class has no free chunk left.
+ */
+void* kvs_slab_alloc(kvs_slab_t* s, uint16_t len);
+
+/**
+ * \brief returns a chunk of a value of len bytes to its size class
+ */
+void kvs_slab_free(kvs_slab_t* s, void* chunk, uint16_t len);
+
+/**
+ * \brief prints the slabs, chunks and value bytes of every size class
+ *
+ * \param name  printed in front of every line
+ *
+ * \returns the bytes mapped for all classes
+ */
+uint64_t kvs_slab_print(kvs_slab_t* s, const char* name);
+
+#endif // _kvs_slab_h
@@ -0,0 +1,169 @@
+/**
+ * \file
+ * \brief Open addressing hash table of a KVS replica
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#ifndef _kvs_table_h
+#define _kvs_table_h 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// keys in a bucket, the keys and the version of a bucket fill one cache
+// line
+#define KVS_BUCKET_KEYS 7
+
+// entries a table is created for
+#ifndef KVS_TABLE_INIT_ENTRIES
+#define KVS_TABLE_INIT_ENTRIES 1024
+#endif
+
+// buckets of the old table moved to the new one by every set while the
+// table grows
+#ifndef KVS_TABLE_MIGRATE
+#define KVS_TABLE_MIGRATE 8
+#endif
+
+// versions of the value of a key that are kept at most
+#ifndef KVS_VERSIONS
+#define KVS_VERSIONS 4
+#endif
+
+// the largest key, UINT64_MAX is reserved for empty slots
+#define KVS_MAX_KEY (UINT64_MAX-1)
+
+// returned by kvs_table_read_at() if the version was dropped
+#define KVS_TOO_OLD -1
+
+/*
+ * Keys are stored +1 so zeroed memory is an empty bucket. The version is a
+ * seqlock of the slots of the bucket: it is odd while the replica changes
+ * a slot, a reader that sees it change copies the value again.
+ */
+typedef struct kvs_bucket {
+    uint64_t keys[KVS_BUCKET_KEYS];
+    uint64_t version;
+} __attribute__((aligned(64))) kvs_bucket_t;
+
+struct kvs_version {
+    // log index of the set, the value is part of every snapshot at this
+    // index or later
+    uint64_t index;
+    // reference to the value
+    uint64_t ref;
+};
+
+/*
+ * Versions of the value of a key, the newest first
+ */
+struct kvs_slot {
+    struct kvs_version versions[KVS_VERSIONS];
+    // oldest index a snapshot can be read at, older versions were dropped
+    uint64_t since;
+};
+
+struct kvs_table_mem {
+    uint64_t num_buckets;
+    kvs_bucket_t* buckets;
+    // versions of the key in slot i of bucket b at b*KVS_BUCKET_KEYS+i
+    struct kvs_slot* slots;
+    // table that was replaced by this one, kept for readers
+    struct kvs_table_mem* retired;
+};
+
+/*
+ * A table is written by its replica only and read by any thread. Sets are
+ * applied in log order and the table grows at the same count on every
+ * replica, so all replicas end up with the same layout.
+ */
+typedef struct kvs_table {
+    // table new keys are inserted into
+    struct kvs_table_mem* tab;
+    // table that is moved to tab while growing, NULL otherwise
+    struct kvs_table_mem* old;
+    uint64_t migrated;
+    uint64_t count;
+} kvs_table_t;
+
+/**
+ * \brief creates a table in the memory of the NUMA node of the caller
+ *
+ * \param num_entries  number of entries the table holds before it grows
+ */
+kvs_table_t* kvs_table_create(uint64_t num_entries);
+
+/**
+ * \brief adds a version of the value of a key, only called by the replica
+ *        owning the table. The table grows incrementally i.e. every set
+ *        moves a few buckets, so a set never rehashes the whole table.
+ *        Versions that no snapshot at bound or later reads are dropped,
+ *        so are the oldest ones once a key has KVS_VERSIONS.
+ *
+ * \param ref        reference to the value, not 0
+ * \param index      log index of the set
+ * \param bound      oldest index a snapshot is read at
+ * \param freed      returns the references of the dropped versions, room
+ *                   for KVS_VERSIONS
+ * \param num_freed  returns the number of dropped versions
+ *
+ * \returns false if the key is larger than KVS_MAX_KEY
+ */
+bool kvs_table_set(kvs_table_t* t, uint64_t key, uint64_t ref,
+                   uint64_t index, uint64_t bound, uint64_t* freed,
+                   int* num_freed);
+
+/**
+ * \brief looks up the reference of the newest value of a key, can be
+ *        called from any thread
+ *
+ * \returns the reference or 0 if the key is not in the table
+ */
+uint64_t kvs_table_get(kvs_table_t* t, uint64_t key);
+
+/**
+ * \brief copies the value of a key without taking a lock, can be called
+ *        from any thread. The copy is retried if the replica changed the
+ *        bucket of the key or freed the chunk of the value meanwhile.
+ *
+ * \param val      copy of up to max bytes of the value, the rest is zeroed
+ * \param retries  incremented for every copy that was retried
+ *
+ * \returns the length of the value, 0 if the key is not in the table
+ */
+uint16_t kvs_table_read(kvs_table_t* t, uint64_t key, void* val,
+                        uint16_t max, uint64_t* retries);
+
+/**
+ * \brief copies the value a key had at a log index like kvs_table_read()
+ *
+ * \returns the length of the value, 0 if the key was not set at the index
+ *          or KVS_TOO_OLD if its version at the index was dropped
+ */
+int kvs_table_read_at(kvs_table_t* t, uint64_t key, uint64_t index,
+                      void* val, uint16_t max, uint64_t* retries);
+
+/**
+ * \brief prefetches the bucket of a key for a following kvs_table_get()
+ */
+void kvs_table_prefetch(kvs_table_t* t, uint64_t key);
+
+/**
+ * \brief returns the number of keys in the table
+ */
+uint64_t kvs_table_count(kvs_table_t* t);
+
+/**
+ * \brief returns the bytes the table and the tables it replaced use
+ */
+uint64_t kvs_table_memory(kvs_table_t* t);
+
+#endif // _kvs_table_h
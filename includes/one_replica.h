@@ -19,6 +19,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// default batching of client commands into one accept/learn instance
+#ifndef ONE_BATCH_SIZE
+#define ONE_BATCH_SIZE 8
+#endif
+// max delay in us before an incomplete batch is proposed
+#ifndef ONE_BATCH_DELAY
+#define ONE_BATCH_DELAY 20
+#endif
+#define ONE_MAX_BATCH 16
+// proposals the leader has in flight, has to be a power of 2
+#ifndef ONE_RING_SIZE
+#define ONE_RING_SIZE 64
+#endif
+
 void init_replica_onepaxos(uint8_t id, 
                            uint8_t current_core,
                            uint8_t num_clients, 
@@ -35,5 +49,14 @@ void init_replica_onepaxos(uint8_t id,
 
 void message_handler_loop_onepaxos(void);
 void set_execution_fn_onepaxos(void (*exec_fn)(void *));
+
+/**
+ * \brief sets how many client commands the leader proposes in one instance
+ *
+ * \param batch_size   maximum number of commands in a batch
+ * \param max_delay    maximum time in us a command waits for the batch to fill
+ */
+void set_batching_onepaxos(uint8_t batch_size, uint32_t max_delay);
+
 uint16_t get_cmd_size(void);
 #endif //_replica_onepaxos_h
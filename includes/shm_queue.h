@@ -21,8 +21,118 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "idle.h"
+
 //#define DEBUG_SHM
 
+// default size of the shared memory of a queue
+#ifndef SHM_SIZE
+#define SHM_SIZE 65536
+#endif
+#define SHM_HUGEPAGE_SIZE (2*1024*1024)
+// number of groups in the registry, one per replica id
+#define SHM_MAX_GROUPS 256
+
+/*
+ * A queue handle is the state of one writer or one reader of a group.
+ * Groups are independent, a thread can hold handles of several groups
+ * e.g. write to the group of its node and read from another one.
+ */
+typedef struct shm_queue_t shm_queue_t;
+
+/**
+ * \brief creates the writer of a shared memory queue
+ *
+ * \param replica_id   id of the group, if shared_mem is NULL the memory
+ *                     of the group is taken from the registry
+ * \param current_core the core on which the writer runs
+ * \param num_readers  number of readers of the group
+ * \param cmd_size     maximum size of a command, at most shm_max_cmd_size()
+ * \param node_level   Is this writer running on the node level?
+ * \param shared_mem   the shared memory used for the queue or NULL
+ * \param exec_fn      execution function
+ *
+ * \returns the handle of the writer
+ */
+shm_queue_t* shm_writer_create(uint8_t replica_id,
+                               uint8_t current_core,
+                               uint8_t num_readers,
+                               uint64_t cmd_size,
+                               bool node_level,
+                               void* shared_mem,
+                               void (*exec_fn)(void *));
+
+/**
+ * \brief creates a reader of a shared memory queue
+ *
+ * \param id           the readers id within the group
+ * \param current_core the core on which the reader runs
+ * \param num_readers  number of readers of the group
+ * \param cmd_size     maximum size of a command, has to be the same as
+ *                     the writer's
+ * \param node_level   Is this reader running on the node level?
+ * \param replica_id   id of the group
+ * \param shared_mem   the shared memory used for the queue or NULL
+ * \param exec_fn      execution function
+ *
+ * \returns the handle of the reader
+ */
+shm_queue_t* shm_reader_create(uint8_t id,
+                               uint8_t current_core,
+                               uint8_t num_readers,
+                               uint64_t cmd_size,
+                               bool node_level,
+                               uint8_t replica_id,
+                               void* shared_mem,
+                               void (*exec_fn)(void* addr));
+
+/**
+ * \brief writes a command of len bytes to the queue of a writer
+ *
+ * \returns 0 on success, -1 if the command is larger than the command
+ *          size of the queue, then nothing is written
+ */
+int shm_queue_write(shm_queue_t* q, void* addr, uint16_t len);
+
+/**
+ * \brief returns the next command of a reader or NULL if there is none
+ */
+void* shm_queue_read(shm_queue_t* q);
+
+/**
+ * \brief reads and executes commands of a reader, does not return.
+ *        While the queue is empty the reader backs off according to the
+ *        idle policy.
+ */
+void shm_queue_poll_and_execute(shm_queue_t* q);
+
+/**
+ * \brief backs off when shm_queue_read() returned NULL, a parked reader
+ *        is woken by the next write
+ *
+ * \param q     the queue of a reader
+ * \param idle  the idle state of the thread
+ */
+void shm_queue_idle(shm_queue_t* q, idle_state_t* idle);
+
+void shm_queue_set_execution_fn(shm_queue_t* q, void (*execute)(void * addr));
+
+/**
+ * \brief returns how often a writer had to wait for readers
+ */
+uint64_t shm_queue_stalls(shm_queue_t* q);
+
+/**
+ * \brief returns the shared memory of a group from the registry. It is
+ *        allocated on the NUMA node of core on the first call.
+ */
+void* shm_group_mem(uint8_t group, uint8_t core);
+
+/*
+ * The functions below use one writer and one reader per thread which
+ * are set up by init_shm_writer() and init_shm_reader().
+ */
+
 /**
  * \brief initializing a shared memory queue writer
  *
@@ -32,7 +142,7 @@
  * \param current_core	the core on which the writer should run
  * \param num_replicas	number of readers for setting up the memory
  * \param num_clients	number of clients that connect to the leader
- * \param slot_size	Size of a slot of the queue
+ * \param cmd_size	maximum size of a command, at most shm_max_cmd_size()
  * \param shared_mem   the shared memory used for the queue
  * \param node_level	Is this writer running on the node level?
  * \param exec_fn	execution function
@@ -41,7 +151,7 @@ void init_shm_writer(uint8_t replica_id,
           uint8_t current_core,
           uint8_t num_clients,
 	      uint8_t num_replicas,
- 	      uint64_t slot_size,
+ 	      uint64_t cmd_size,
 	      bool node_level,	    
           void* shared_mem,
 	      void (*exec_fn)(void *));
@@ -52,7 +162,8 @@ void init_shm_writer(uint8_t replica_id,
  * \param current_core the core on which the writer should be started
  * \param num_replicas the number of replicas (require for setting up the shared
  *                      memory)
- * \param slot_size    the size of the slots of the queue
+ * \param cmd_size     maximum size of a command, has to be the same as
+ *                     the writer's
  * \param node_level   Is this reader running on the node level?
  * \param started_from the replica id which started the readers
  * \param shared_mem   the shared memory used for the queue
@@ -61,16 +172,66 @@ void init_shm_writer(uint8_t replica_id,
 void init_shm_reader(uint8_t id, 
                      uint8_t current_core,
                      uint8_t num_replicas, 
-                     uint64_t slot_size,
+                     uint64_t cmd_size,
                      bool node_level,
                      uint8_t started_from,
                      void* shared_mem,
                      void (*exec_fn)(void* addr));
+/**
+ * \brief writes a command of cmd_size bytes to the queue
+ */
 void shm_write(void* addr);
+
+/**
+ * \brief writes a command of len bytes to the queue, at most cmd_size
+ *        bytes are written. The command takes as many cache lines as
+ *        it needs.
+ */
+void shm_write_len(void* addr, uint16_t len);
+
+/**
+ * \brief returns the next command or NULL if there is none
+ */
 void* shm_read(void);
 
+/**
+ * \brief returns the length of a command returned by shm_read()
+ */
+uint16_t shm_cmd_len(void* cmd);
+
 
 void set_execution_fn_shm(void (*execute)(void * addr));
 
+/**
+ * \brief sets the size of the shared memory of the queues that are
+ *        allocated afterwards. Has to be set before the consensus
+ *        service is started.
+ */
+void set_shm_size(uint64_t size);
+uint64_t get_shm_size(void);
+
+/**
+ * \brief returns the largest command size a queue with num_readers
+ *        readers of the current size supports
+ */
+uint16_t shm_max_cmd_size(uint8_t num_readers);
+
+/**
+ * \brief allocates zeroed shared memory for a queue on the NUMA node of
+ *        core. The memory is backed by a 2MB hugepage if available.
+ */
+void* shm_alloc(uint8_t core);
+
+/**
+ * \brief returns how often the writer had to wait for readers because
+ *        the queue was full
+ */
+uint64_t shm_get_stalls(void);
+
 void poll_and_execute(void);
+
+/**
+ * \brief shm_queue_idle() for the reader of the calling thread
+ */
+void shm_idle(idle_state_t* idle);
 #endif // _shm_queue_h
@@ -25,28 +25,74 @@
 #include "client.h"
 #include "consensus.h"
 #include "kvs.h"
+#include "kvs_table.h"
+#include "command.h"
 #include "incremental_stats.h"
 
 
 struct kvs_client {
     int id;
     int num_clients;
-    uintptr_t* local_mem;
+    // table and log position of the closest replica of every group
+    kvs_table_t* local_mem[CONS_MAX_GROUPS];
+    kvs_index_t* local_index[CONS_MAX_GROUPS];
+    int num_replicas;
+    // reads that had to wait for the closest replica to catch up
+    uint64_t num_waits;
+    // copies of values that were retried because the replica changed them
+    uint64_t num_retries;
+    // snapshots taken again because a version they read was dropped
+    uint64_t num_old;
     int run;
     int first;
     bool exit;
     uint64_t num_reads;
     uint64_t num_writes;
+    // keys read and written, more than the ops with multi get/set
+    uint64_t num_read_keys;
+    uint64_t num_write_keys;
     uint64_t num_large;
     incr_stats w_rt[7];
     incr_stats r_rt[7];
     incr_stats r_tp;
     incr_stats w_tp;
+    incr_stats r_ktp;
+    incr_stats w_ktp;
 };
 
-extern void* kvs_memory[MAX_REPLICAS];
-
 static __thread struct kvs_client* client;
+static uint8_t read_mode = KVS_READ_LINEARIZABLE;
+static uint8_t bench_keys = 1;
+static uint16_t bench_value = sizeof(struct kvs_value);
+static bool bench_snapshot = false;
+
+// keys ahead of the lookup whose buckets are prefetched in a multi get
+#define KVS_PREFETCH_DIST 8
+
+void kvs_set_read_mode(uint8_t mode)
+{
+    read_mode = mode;
+}
+
+uint8_t kvs_get_read_mode(void)
+{
+    return read_mode;
+}
+
+void kvs_set_bench_keys(uint8_t num)
+{
+    bench_keys = MIN(MAX(num, 1), KVS_MULTI_MAX_KEYS);
+}
+
+void kvs_set_bench_snapshot(bool snapshot)
+{
+    bench_snapshot = snapshot;
+}
+
+void kvs_set_bench_value(uint16_t len)
+{
+    bench_value = MIN(MAX(len, sizeof(struct kvs_value)), KVS_MAX_VALUE);
+}
 
 static void* measure_thread(void* args)
 {
@@ -54,12 +100,16 @@ static void* measure_thread(void* args)
     while(true) {
         if (!c->first) {
 
-            printf("Client %d: w_rt %10.3f, r_rt %10.3f, w_tp %10.f, r_tp %10.3f, stdv %10.3f large %10.3f\n",
+            printf("Client %d: w_rt %10.3f, r_rt %10.3f, w_tp %10.f, r_tp %10.3f, stdv %10.3f large %10.3f waits %10.3f w_keys %10.3f r_keys %10.3f retries %10.3f old_snaps %10.3f\n",
                     c->id, get_avg(&(c->w_rt[c->run-1])), get_avg(&(c->r_rt[c->run-1])),
                     (double) c->num_writes/20, (double) c->num_reads/20,
-                    get_std_dev(&(c->w_rt[c->run-1])), (double)c->num_large/20);
+                    get_std_dev(&(c->w_rt[c->run-1])), (double)c->num_large/20,
+                    (double)c->num_waits/20, (double) c->num_write_keys/20,
+                    (double) c->num_read_keys/20, (double) c->num_retries/20,
+                    (double) c->num_old/20);
 
             if (c->id == 0) {
+                kvs_print_memory();
                 printf("###############################################################");
                 printf("######################## \n");
             }
@@ -67,6 +117,8 @@ static void* measure_thread(void* args)
             if (c->run > 1) {
                 add(&(c->r_tp), (double) c->num_reads/20);
                 add(&(c->w_tp), (double) c->num_writes/20);
+                add(&(c->r_ktp), (double) c->num_read_keys/20);
+                add(&(c->w_ktp), (double) c->num_write_keys/20);
             }
         }
 
@@ -74,7 +126,12 @@ static void* measure_thread(void* args)
         c->run++;
         c->num_reads = 0;
         c->num_writes = 0;
+        c->num_read_keys = 0;
+        c->num_write_keys = 0;
         c->num_large = 0;
+        c->num_waits = 0;
+        c->num_retries = 0;
+        c->num_old = 0;
         sleep(20);
 
         if (c->run > 5) {
@@ -100,8 +157,10 @@ static void print_results_file(void) {
 #ifndef BARRELFISH
     FILE* f = fopen(f_name, "w+");
 #endif
-    RESULT_PRINTF(f, "Client id %d num_clients %d \n",
-            client->id, client->num_clients);
+    RESULT_PRINTF(f, "Client id %d num_clients %d read_mode %s keys_per_op %d value_size %d snapshot %d \n",
+            client->id, client->num_clients,
+            (read_mode == KVS_READ_STALE) ? "stale" : "linearizable",
+            bench_keys, bench_value, bench_snapshot);
     incr_stats r_rt_avg, r_rt_stdv;
     init_stats(&r_rt_avg);
     init_stats(&r_rt_stdv);
@@ -131,30 +190,184 @@ static void print_results_file(void) {
                   get_avg(&(client->w_tp)), get_std_dev(&(client->w_tp)),
                   get_avg(&r_rt_avg), get_avg(&r_rt_stdv),
                   get_avg(&(client->r_tp)), get_std_dev(&(client->r_tp)));
+    RESULT_PRINTF(f, "\t w_keys \t stdv \t r_keys \t stdv\n");
+    RESULT_PRINTF(f, "||\t%10.3f\t%10.3f\t%10.3f\t%10.3f\n",
+                  get_avg(&(client->w_ktp)), get_std_dev(&(client->w_ktp)),
+                  get_avg(&(client->r_ktp)), get_std_dev(&(client->r_ktp)));
 #ifndef BARRELFISH
     fflush(f);
     fclose(f);
 #endif
 }
 
+/*
+ * Read index: every set that completed or is visible at some replica has
+ * started there, the largest started count of the group is at least its
+ * log position. Once the closest replica applied as many sets, it holds
+ * all of them and the read can be served locally.
+ */
+static void wait_read_index(uint8_t group)
+{
+    uint64_t read_index = 0;
+    for (int i = 0; i < client->num_replicas; i++) {
+        kvs_index_t* r = kvs_index[group][i];
+        read_index = MAX(read_index,
+                         __atomic_load_n(&r->started, __ATOMIC_ACQUIRE));
+    }
+
+    kvs_index_t* local = client->local_index[group];
+    if (__atomic_load_n(&local->applied, __ATOMIC_ACQUIRE) >= read_index) {
+        return;
+    }
+
+    client->num_waits++;
+    while (__atomic_load_n(&local->applied, __ATOMIC_ACQUIRE) < read_index) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+uint16_t kvs_get_len(uintptr_t key, void* val, uint16_t max)
+{
+    uint8_t group = consensus_group_of(key);
+    if (read_mode == KVS_READ_LINEARIZABLE) {
+        wait_read_index(group);
+    }
+    // a key that was never set reads as 0
+    return kvs_table_read(client->local_mem[group], key, val, max,
+                          &client->num_retries);
+}
+
 // TODO remove uint64_t return value
 uint64_t kvs_get(uintptr_t key, struct kvs_value* val)
 {
-    val->v1 = client->local_mem[key*2];
-    val->v2 = client->local_mem[(key*2)+1];
+    kvs_get_len(key, val, sizeof(struct kvs_value));
+    return 0;
+}
+
+void kvs_multi_get(uintptr_t* keys, struct kvs_value* vals, int num)
+{
+    bool waited[CONS_MAX_GROUPS] = {false};
+    for (int i = 0; (i < KVS_PREFETCH_DIST) && (i < num); i++) {
+        kvs_table_prefetch(client->local_mem[consensus_group_of(keys[i])],
+                           keys[i]);
+    }
+
+    for (int i = 0; i < num; i++) {
+        int next = i + KVS_PREFETCH_DIST;
+        if (next < num) {
+            kvs_table_prefetch(client->local_mem[consensus_group_of(keys[next])],
+                               keys[next]);
+        }
+
+        uint8_t group = consensus_group_of(keys[i]);
+        if ((read_mode == KVS_READ_LINEARIZABLE) && !waited[group]) {
+            wait_read_index(group);
+            waited[group] = true;
+        }
+        kvs_table_read(client->local_mem[group], keys[i], &vals[i],
+                       sizeof(struct kvs_value), &client->num_retries);
+    }
+}
+
+/*
+ * The snapshot is announced before the bound of the closest replica is
+ * checked. If the replica dropped versions of the snapshot without seeing
+ * the announcement, a newer snapshot is taken.
+ */
+static uint64_t announce_snapshot(uint8_t group)
+{
+    kvs_index_t* local = client->local_index[group];
+    kvs_reader_t* reader = &kvs_readers[group][client->id];
+    uint64_t index;
+    do {
+        index = __atomic_load_n(&local->applied, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&reader->index, index + 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&local->gc, __ATOMIC_SEQ_CST) > index);
+    return index;
+}
+
+int kvs_snapshot_get(uintptr_t* keys, struct kvs_value* vals, int num,
+                     uint64_t* index)
+{
+    if ((num < 1) || (num > KVS_MULTI_MAX_KEYS) ||
+        (client->id >= KVS_MAX_READERS)) {
+        return -1;
+    }
+
+    uint8_t group = consensus_group_of(keys[0]);
+    for (int i = 1; i < num; i++) {
+        if (consensus_group_of(keys[i]) != group) {
+            return -1;
+        }
+    }
+
+    if (read_mode == KVS_READ_LINEARIZABLE) {
+        wait_read_index(group);
+    }
+
+    bool done = false;
+    while (!done) {
+        *index = announce_snapshot(group);
+        done = true;
+        for (int i = 0; (i < num) && done; i++) {
+            // a key that was set more than KVS_VERSIONS times since
+            if (kvs_table_read_at(client->local_mem[group], keys[i], *index,
+                                  &vals[i], sizeof(struct kvs_value),
+                                  &client->num_retries) == KVS_TOO_OLD) {
+                client->num_old++;
+                done = false;
+            }
+        }
+    }
+
+    __atomic_store_n(&kvs_readers[group][client->id].index, 0, __ATOMIC_RELEASE);
     return 0;
 }
 
+static __thread uintptr_t payload[CONS_CMD_WORDS(ARENA_CHUNK_SIZE)];
+int kvs_set_len(uintptr_t key, void* val, uint16_t len)
+{
+    if (len > KVS_MAX_VALUE) {
+        return -1;
+    }
+
+    payload[0] = 1;
+    payload[1] = key;
+    payload[2] = len;
+    memcpy(&payload[3], val, len);
+    return consensus_send_request_key(key, payload, KVS_SET_SIZE(len));
+}
+
 // TODO remove uint64_t return value
-static __thread uintptr_t payload[3];
 uint64_t kvs_set(uintptr_t key, struct kvs_value* val)
 {
-    payload[0] = key;
-    payload[1] = val->v1;
-    payload[2] = val->v2;
-    consensus_send_request(payload);
+    kvs_set_len(key, val, sizeof(struct kvs_value));
     return 0;
+}
+
+int kvs_multi_set(uintptr_t* keys, struct kvs_value* vals, int num)
+{
+    if ((num < 1) || (num > KVS_MULTI_MAX_KEYS)) {
+        return -1;
+    }
 
+    uint8_t group = consensus_group_of(keys[0]);
+    uintptr_t* set = &payload[1];
+    payload[0] = num;
+    for (int i = 0; i < num; i++) {
+        if (consensus_group_of(keys[i]) != group) {
+            return -1;
+        }
+        set[0] = keys[i];
+        set[1] = sizeof(struct kvs_value);
+        memcpy(&set[2], &vals[i], sizeof(struct kvs_value));
+        set += 2 + KVS_VALUE_WORDS(sizeof(struct kvs_value));
+    }
+    return consensus_send_request_key(keys[0], payload,
+                                      KVS_MULTI_SET_SIZE(num));
 }
 
 int init_kvs_client(int current_core,
@@ -163,19 +376,31 @@ int init_kvs_client(int current_core,
                     int num_replicas,
                     int num_clients,
                     int topo,
-                    int last_replica,
-                    int leader)
+                    int num_groups,
+                    uint8_t* recv_from,
+                    uint8_t* leaders)
 {
 
     client = (struct kvs_client*) malloc(sizeof(struct kvs_client));
     int numa_node = numa_node_of_cpu(current_core);
-    client->local_mem = (uintptr_t*) kvs_memory[numa_node];
-    assert(client->local_mem != NULL);
+    for (int g = 0; g < num_groups; g++) {
+        // a group without a replica on this node is read from its first one
+        int r = (kvs_memory[g][numa_node] != NULL) ? numa_node : 0;
+        client->local_mem[g] = kvs_memory[g][r];
+        client->local_index[g] = kvs_index[g][r];
+        assert(client->local_mem[g] != NULL);
+    }
+    client->num_replicas = num_replicas;
+    client->num_waits = 0;
+    client->num_retries = 0;
+    client->num_old = 0;
     client->first = true;
     client->exit = false;
     client->num_reads = 0;
     client->num_large = 0;
     client->num_writes = 0;
+    client->num_read_keys = 0;
+    client->num_write_keys = 0;
     client->num_clients = num_clients;
     client->id = init_consensus_client_bench(current_core,
                                 algo,
@@ -183,8 +408,9 @@ int init_kvs_client(int current_core,
                                 num_replicas,
                                 num_clients,
                                 topo,
-                                last_replica,
-                                leader);
+                                num_groups,
+                                recv_from,
+                                leaders);
     return client->id;
 }
 
@@ -200,6 +426,7 @@ void* init_benchmark_kvs_client(void* args)
                     cl->num_replicas,
                     cl->num_clients,
                     cl->topo,
+                    cl->num_groups,
                     cl->recv_from,
                     cl->leader);
 
@@ -225,19 +452,43 @@ void* init_benchmark_kvs_client(void* args)
     }
     init_stats(&(client->r_tp));
     init_stats(&(client->w_tp));
-
-    struct kvs_value* val = (struct kvs_value*) malloc(sizeof(struct kvs_value));
+    init_stats(&(client->r_ktp));
+    init_stats(&(client->w_ktp));
+
+    struct kvs_value* val = (struct kvs_value*) malloc(sizeof(struct kvs_value)*
+                                                       KVS_MULTI_MAX_KEYS);
+    uintptr_t keys[KVS_MULTI_MAX_KEYS];
+    // value of a single key
+    uintptr_t* value = (uintptr_t*) calloc(1, KVS_MAX_VALUE);
     uint64_t start, end;
+    uint64_t snapshot;
     int key;
     while(!client->exit) {
         key = (rand() % 50);
         val->v1 = key;
         val->v2 = 22;
+        value[0] = key;
+        value[1] = 22;
+        // the keys of a multi set have to be in the group of the first
+        keys[0] = key;
+        for (int k = 1; k < bench_keys; k++) {
+            do {
+                keys[k] = rand() % 50;
+            } while (consensus_group_of(keys[k]) != consensus_group_of(key));
+            val[k].v1 = keys[k];
+            val[k].v2 = 22;
+        }
+
         for (int i = 0; i < 2; i++) {
             start = rdtsc();
-            kvs_set(key, val);
+            if (bench_keys > 1) {
+                kvs_multi_set(keys, val, bench_keys);
+            } else {
+                kvs_set_len(key, value, bench_value);
+            }
             end = rdtsc();
             client->num_writes++;
+            client->num_write_keys += bench_keys;
             if ((end-start) < 500000) {
                 add(&(client->w_rt[client->run]), (double) end - start);
             } else {
@@ -247,10 +498,17 @@ void* init_benchmark_kvs_client(void* args)
 
         for (int i = 0; i < 8; i++) {
             start = rdtsc();
-            kvs_get(key, val);
+            if ((bench_keys > 1) && bench_snapshot) {
+                kvs_snapshot_get(keys, val, bench_keys, &snapshot);
+            } else if (bench_keys > 1) {
+                kvs_multi_get(keys, val, bench_keys);
+            } else {
+                kvs_get_len(key, value, bench_value);
+            }
             end = rdtsc();
             add(&(client->r_rt[client->run]), (double) end - start);
             client->num_reads++;
+            client->num_read_keys += bench_keys;
         }
     }
 
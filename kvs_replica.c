@@ -21,28 +21,119 @@
 #include <assert.h>
 
 #include "consensus.h"
+#include "command.h"
 #include "kvs.h"
+#include "kvs_table.h"
+#include "kvs_slab.h"
 
 __thread int id;
-__thread int kvs_size;
-__thread int max_key;
-void* kvs_memory[MAX_REPLICAS];
+__thread int group;
+// table, values and log position of this replica, only the ones of the
+// node level replicas are published for the clients
+static __thread kvs_table_t* kvs;
+static __thread kvs_slab_t* slab;
+static __thread kvs_index_t* pos;
+struct kvs_table* kvs_memory[CONS_MAX_GROUPS][MAX_REPLICAS];
+kvs_index_t* kvs_index[CONS_MAX_GROUPS][MAX_REPLICAS];
+static kvs_slab_t* kvs_slabs[CONS_MAX_GROUPS][MAX_REPLICAS];
+kvs_reader_t kvs_readers[CONS_MAX_GROUPS][KVS_MAX_READERS];
+// oldest log index a snapshot of the group is read at
+static __thread uint64_t gc_bound;
+
+/*
+ * The bound is published before the readers are looked at, a reader that
+ * announced its snapshot too late to be seen sees the bound and takes a
+ * newer snapshot.
+ */
+static void update_gc_bound(void)
+{
+    uint64_t bound = pos->applied;
+    __atomic_store_n(&pos->gc, bound, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int c = 0; c < KVS_MAX_READERS; c++) {
+        uint64_t index = __atomic_load_n(&kvs_readers[group][c].index,
+                                         __ATOMIC_SEQ_CST);
+        if ((index != 0) && (index - 1 < bound)) {
+            bound = index - 1;
+        }
+    }
+    gc_bound = bound;
+}
+
+// copies the value to a chunk and frees the chunks of the versions that
+// no snapshot reads anymore
+static void apply_set(uintptr_t key, void* val, uint16_t len, uint64_t index)
+{
+    void* chunk = kvs_slab_alloc(slab, len);
+    if (chunk == NULL) {
+        printf("Replica %d: no chunk for %d bytes, key %lu dropped \n", id,
+               len, key);
+        return;
+    }
+    // the chunk can be a freed one, a reader that still copies it has to
+    // see the version of its bucket change before the new value
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(chunk, val, len);
+
+    uint64_t freed[KVS_VERSIONS];
+    int num_freed;
+    if (!kvs_table_set(kvs, key, KVS_REF(chunk, len), index, gc_bound, freed,
+                       &num_freed)) {
+        printf("Replica %d: Key too large %lu \n", id, key);
+        kvs_slab_free(slab, chunk, len);
+        return;
+    }
+
+    for (int i = 0; i < num_freed; i++) {
+        kvs_slab_free(slab, KVS_REF_PTR(freed[i]), KVS_REF_LEN(freed[i]));
+    }
+}
 
 static void exec_fn(void* arg)
 {
     uintptr_t* payload = (uintptr_t*) arg;    
-    uintptr_t* kvs = (uintptr_t*) kvs_memory[id];
+    uintptr_t* end = payload + consensus_get_cmd_len()/sizeof(uintptr_t);
 
-    if (payload[0] > (uintptr_t) max_key) {
-        printf("Replica %d: Key too large %ld \n", id, payload[0]);
-        return;
+    if ((pos->applied % KVS_GC_INTERVAL) == 0) {
+        update_gc_bound();
+    }
+
+    // a read that sees the value has to find the set started
+    __atomic_store_n(&pos->started, pos->started+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // all keys of a multi set are applied at the same log position, the
+    // snapshots at it and later include them
+    uint64_t index = pos->applied + 1;
+    uintptr_t* set = &payload[1];
+    for (uintptr_t i = 0; (i < payload[0]) && (set + 2 <= end); i++) {
+        uint16_t len = set[1];
+        if (set + 2 + KVS_VALUE_WORDS(len) > end) {
+            printf("Replica %d: truncated set of key %lu \n", id, set[0]);
+            break;
+        }
+        apply_set(set[0], &set[2], len, index);
+        set += 2 + KVS_VALUE_WORDS(len);
     }
 
-//    printf("Writing to memory %d key %ld addr %p \n", id, payload[0], &kvs[2*payload[0]]);
+    __atomic_store_n(&pos->applied, pos->applied+1, __ATOMIC_RELEASE);
+}
 
-    kvs[2*payload[0]] = payload[1];
-    kvs[(2*payload[0])+1] = payload[2];
-    return;   
+void kvs_print_memory(void)
+{
+    char name[32];
+    for (int g = 0; g < CONS_MAX_GROUPS; g++) {
+        for (int r = 0; r < MAX_REPLICAS; r++) {
+            if (kvs_slabs[g][r] == NULL) {
+                continue;
+            }
+            sprintf(name, "Replica %d.%d", g, r);
+            uint64_t mapped = kvs_slab_print(kvs_slabs[g][r], name);
+            printf("%s: %lu keys, table %lu bytes, slabs %lu bytes \n", name,
+                   kvs_table_count(kvs_memory[g][r]),
+                   kvs_table_memory(kvs_memory[g][r]), mapped);
+        }
+    }
 }
 
 void* init_kvs_replica(void* arg)
@@ -50,10 +141,18 @@ void* init_kvs_replica(void* arg)
 
     struct cons_args_t* rep = (struct cons_args_t*) arg;
     id = rep->id;
-    kvs_size = KVS_MEM_SIZE;
-    max_key = kvs_size/(sizeof(uintptr_t)*2);
-    kvs_memory[id] = numa_alloc_local(kvs_size);
-    assert(kvs_memory[id] != NULL);
+    group = rep->group;
+    kvs = kvs_table_create(KVS_TABLE_INIT_ENTRIES);
+    slab = kvs_slab_create();
+    pos = numa_alloc_local(sizeof(kvs_index_t));
+    assert((kvs != NULL) && (slab != NULL) && (pos != NULL));
+    memset(pos, 0, sizeof(kvs_index_t));
+    // the core level replicas have the same ids as the node level ones
+    if (rep->level == NODE_LEVEL) {
+        kvs_memory[group][id] = kvs;
+        kvs_index[group][id] = pos;
+        kvs_slabs[group][id] = slab;
+    }
     rep->exec_func = exec_fn; 
   
     init_replica(arg);   
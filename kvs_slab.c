@@ -0,0 +1,110 @@
+/**
+ * \file
+ * \brief Size class allocator for the values of a KVS replica
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <numa.h>
+
+#include "kvs_slab.h"
+
+static inline uint32_t chunk_size(int c)
+{
+    return KVS_SLAB_MIN_CHUNK << c;
+}
+
+static inline int size_class(uint16_t len)
+{
+    int c = 0;
+    while ((c < KVS_SLAB_CLASSES) && (chunk_size(c) < len)) {
+        c++;
+    }
+    return c;
+}
+
+static bool map_slab(struct kvs_slab_class* cl)
+{
+    uint8_t* slab = numa_alloc_local(KVS_SLAB_SIZE);
+    if (slab == NULL) {
+        printf("KVS slab: mapping %d bytes failed \n", KVS_SLAB_SIZE);
+        return false;
+    }
+    cl->next = slab;
+    cl->end = slab + KVS_SLAB_SIZE;
+    cl->slabs++;
+    return true;
+}
+
+kvs_slab_t* kvs_slab_create(void)
+{
+    kvs_slab_t* s = numa_alloc_local(sizeof(kvs_slab_t));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(kvs_slab_t));
+    for (int c = 0; c < KVS_SLAB_CLASSES; c++) {
+        if (!map_slab(&s->classes[c])) {
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void* kvs_slab_alloc(kvs_slab_t* s, uint16_t len)
+{
+    int c = size_class(len);
+    if (c == KVS_SLAB_CLASSES) {
+        return NULL;
+    }
+
+    struct kvs_slab_class* cl = &s->classes[c];
+    void* chunk = cl->free;
+    if (chunk != NULL) {
+        cl->free = *(void**) chunk;
+    } else {
+        if ((cl->next + chunk_size(c) > cl->end) && !map_slab(cl)) {
+            return NULL;
+        }
+        chunk = cl->next;
+        cl->next += chunk_size(c);
+    }
+
+    cl->chunks++;
+    cl->bytes += len;
+    return chunk;
+}
+
+void kvs_slab_free(kvs_slab_t* s, void* chunk, uint16_t len)
+{
+    struct kvs_slab_class* cl = &s->classes[size_class(len)];
+    *(void**) chunk = cl->free;
+    cl->free = chunk;
+    cl->chunks--;
+    cl->bytes -= len;
+}
+
+uint64_t kvs_slab_print(kvs_slab_t* s, const char* name)
+{
+    uint64_t mapped = 0;
+    for (int c = 0; c < KVS_SLAB_CLASSES; c++) {
+        struct kvs_slab_class* cl = &s->classes[c];
+        uint64_t used = cl->chunks*chunk_size(c);
+        printf("%s: class %5u slabs %6lu chunks %9lu value bytes %11lu "
+               "used %6.2f %% \n", name, chunk_size(c), cl->slabs, cl->chunks,
+               cl->bytes, used > 0 ? 100.0*cl->bytes/used : 0.0);
+        mapped += cl->slabs*KVS_SLAB_SIZE;
+    }
+    return mapped;
+}
@@ -0,0 +1,404 @@
+/**
+ * \file
+ * \brief Open addressing hash table of a KVS replica
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <numa.h>
+
+#include "kvs_table.h"
+#include "kvs_slab.h"
+
+#define NO_SLOT UINT64_MAX
+
+// mixes all bits of the key (murmur3 finalizer), same on every replica
+static inline uint64_t hash_key(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// compares all keys of a bucket without branches, the loop is vectorized
+static inline uint32_t bucket_match(kvs_bucket_t* b, uint64_t tag)
+{
+    uint32_t match = 0;
+    for (int i = 0; i < KVS_BUCKET_KEYS; i++) {
+        match |= (uint32_t) (b->keys[i] == tag) << i;
+    }
+    return match;
+}
+
+static struct kvs_table_mem* mem_create(uint64_t num_buckets)
+{
+    struct kvs_table_mem* m = numa_alloc_local(sizeof(struct kvs_table_mem));
+    if (m == NULL) {
+        return NULL;
+    }
+
+    // the pages are mapped zeroed i.e. all buckets are empty and are only
+    // touched when they are first used
+    m->num_buckets = num_buckets;
+    m->retired = NULL;
+    m->buckets = numa_alloc_local(num_buckets*sizeof(kvs_bucket_t));
+    m->slots = numa_alloc_local(num_buckets*KVS_BUCKET_KEYS*
+                                sizeof(struct kvs_slot));
+    if ((m->buckets == NULL) || (m->slots == NULL)) {
+        printf("KVS table: allocating %lu buckets failed \n", num_buckets);
+        return NULL;
+    }
+    return m;
+}
+
+/*
+ * Returns the slot of the key, or the empty slot it would be inserted at.
+ * Slots are filled in order and nothing is deleted, so the probing stops
+ * at the first bucket with an empty slot.
+ */
+static uint64_t find_slot(struct kvs_table_mem* m, uint64_t tag, bool* found)
+{
+    uint64_t mask = m->num_buckets - 1;
+    uint64_t b = hash_key(tag) & mask;
+    for (uint64_t n = 0; n < m->num_buckets; n++) {
+        kvs_bucket_t* bucket = &m->buckets[b];
+        uint32_t match = bucket_match(bucket, tag);
+        if (match) {
+            *found = true;
+            return b*KVS_BUCKET_KEYS + __builtin_ctz(match);
+        }
+
+        match = bucket_match(bucket, 0);
+        if (match) {
+            *found = false;
+            return b*KVS_BUCKET_KEYS + __builtin_ctz(match);
+        }
+        b = (b + 1) & mask;
+    }
+    *found = false;
+    return NO_SLOT;
+}
+
+// the versions are written before the key is visible to readers, both
+// while the version of the bucket is odd
+static void put_slot(struct kvs_table_mem* m, uint64_t slot, uint64_t tag,
+                     struct kvs_slot* s, bool found)
+{
+    kvs_bucket_t* b = &m->buckets[slot / KVS_BUCKET_KEYS];
+    __atomic_store_n(&b->version, b->version+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    uint64_t* dst = (uint64_t*) &m->slots[slot];
+    uint64_t* src = (uint64_t*) s;
+    for (int i = 0; i < sizeof(struct kvs_slot)/sizeof(uint64_t); i++) {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+    if (!found) {
+        __atomic_store_n(&b->keys[slot % KVS_BUCKET_KEYS], tag, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&b->version, b->version+1, __ATOMIC_RELEASE);
+}
+
+static struct kvs_slot* mem_find(struct kvs_table_mem* m, uint64_t tag)
+{
+    bool found;
+    uint64_t slot = find_slot(m, tag, &found);
+    if (!found) {
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return &m->slots[slot];
+}
+
+/*
+ * The new version goes first, the older ones are kept until one of them
+ * is part of the snapshot at bound. Snapshots before the oldest version
+ * that is left cannot be read anymore once a version is dropped.
+ */
+static void add_version(struct kvs_slot* prev, struct kvs_slot* next,
+                        uint64_t index, uint64_t ref, uint64_t bound,
+                        uint64_t* freed, int* num_freed)
+{
+    memset(next, 0, sizeof(struct kvs_slot));
+    next->versions[0].index = index;
+    next->versions[0].ref = ref;
+    next->since = prev->since;
+
+    bool needed = (index > bound);
+    int n = 1;
+    for (int i = 0; (i < KVS_VERSIONS) && (prev->versions[i].ref != 0); i++) {
+        if (needed && (n < KVS_VERSIONS)) {
+            next->versions[n++] = prev->versions[i];
+            needed = (prev->versions[i].index > bound);
+        } else {
+            freed[(*num_freed)++] = prev->versions[i].ref;
+            next->since = next->versions[n-1].index;
+        }
+    }
+}
+
+// moves up to num buckets of the old table, keys that were set since the
+// growth started are in the new table already and newer there
+static void migrate(kvs_table_t* t, uint64_t num)
+{
+    struct kvs_table_mem* old = t->old;
+    for (; (num > 0) && (t->migrated < old->num_buckets); num--) {
+        uint64_t b = t->migrated;
+        for (int i = 0; i < KVS_BUCKET_KEYS; i++) {
+            uint64_t tag = old->buckets[b].keys[i];
+            if (tag == 0) {
+                break;
+            }
+
+            bool found;
+            uint64_t slot = find_slot(t->tab, tag, &found);
+            if (!found) {
+                put_slot(t->tab, slot, tag, &old->slots[b*KVS_BUCKET_KEYS + i],
+                         false);
+            }
+        }
+        t->migrated++;
+    }
+
+    if (t->migrated == old->num_buckets) {
+        __atomic_store_n(&t->old, NULL, __ATOMIC_RELEASE);
+    }
+}
+
+static void grow(kvs_table_t* t)
+{
+    // the previous growth has to be done first
+    while (t->old != NULL) {
+        migrate(t, t->old->num_buckets);
+    }
+
+    struct kvs_table_mem* m = mem_create(t->tab->num_buckets*2);
+    if (m == NULL) {
+        return;
+    }
+
+    // readers can still be in the old table, it is not freed
+    m->retired = t->tab;
+    t->migrated = 0;
+    __atomic_store_n(&t->old, t->tab, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->tab, m, __ATOMIC_RELEASE);
+}
+
+kvs_table_t* kvs_table_create(uint64_t num_entries)
+{
+    kvs_table_t* t = numa_alloc_local(sizeof(kvs_table_t));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    // at most 3/4 of the slots are used
+    uint64_t num_buckets = 1;
+    while ((num_buckets*KVS_BUCKET_KEYS*3) < (num_entries*4)) {
+        num_buckets *= 2;
+    }
+
+    memset(t, 0, sizeof(kvs_table_t));
+    t->tab = mem_create(num_buckets);
+    if (t->tab == NULL) {
+        return NULL;
+    }
+    return t;
+}
+
+bool kvs_table_set(kvs_table_t* t, uint64_t key, uint64_t ref,
+                   uint64_t index, uint64_t bound, uint64_t* freed,
+                   int* num_freed)
+{
+    *num_freed = 0;
+    if (key > KVS_MAX_KEY) {
+        return false;
+    }
+
+    uint64_t tag = key + 1;
+    if (t->old != NULL) {
+        migrate(t, KVS_TABLE_MIGRATE);
+    }
+
+    bool found;
+    uint64_t slot = find_slot(t->tab, tag, &found);
+    if (slot == NO_SLOT) {
+        printf("KVS table: full, key %lu dropped \n", key);
+        return false;
+    }
+
+    struct kvs_slot prev;
+    memset(&prev, 0, sizeof(struct kvs_slot));
+    if (found) {
+        prev = t->tab->slots[slot];
+    } else {
+        // the key can still wait in the old table to be moved, the
+        // versions it has there are carried over
+        struct kvs_slot* s = (t->old != NULL) ? mem_find(t->old, tag) : NULL;
+        if (s != NULL) {
+            prev = *s;
+        } else {
+            __atomic_store_n(&t->count, t->count+1, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct kvs_slot next;
+    add_version(&prev, &next, index, ref, bound, freed, num_freed);
+    put_slot(t->tab, slot, tag, &next, found);
+
+    if ((t->count*4) > (t->tab->num_buckets*KVS_BUCKET_KEYS*3)) {
+        grow(t);
+    }
+    return true;
+}
+
+uint64_t kvs_table_get(kvs_table_t* t, uint64_t key)
+{
+    if (key > KVS_MAX_KEY) {
+        return 0;
+    }
+
+    uint64_t tag = key + 1;
+    // the new table before the old one, a set only goes to the new one
+    struct kvs_table_mem* m = __atomic_load_n(&t->tab, __ATOMIC_ACQUIRE);
+    struct kvs_table_mem* old = __atomic_load_n(&t->old, __ATOMIC_ACQUIRE);
+    struct kvs_slot* s = mem_find(m, tag);
+    if ((s == NULL) && (old != NULL) && (old != m)) {
+        s = mem_find(old, tag);
+    }
+    return (s != NULL) ? __atomic_load_n(&s->versions[0].ref, __ATOMIC_ACQUIRE) : 0;
+}
+
+/*
+ * Copies the newest value of a slot at index under the version of its
+ * bucket. Returns false if the bucket changed during the copy.
+ */
+static bool copy_slot(struct kvs_table_mem* m, uint64_t slot, uint64_t index,
+                      void* val, uint16_t max, int* len)
+{
+    kvs_bucket_t* b = &m->buckets[slot / KVS_BUCKET_KEYS];
+    uint64_t version = __atomic_load_n(&b->version, __ATOMIC_ACQUIRE);
+    if (version & 1) {
+        return false;
+    }
+
+    struct kvs_slot* s = &m->slots[slot];
+    bool found = false;
+    *len = 0;
+    for (int i = 0; (i < KVS_VERSIONS) && !found; i++) {
+        uint64_t ref = __atomic_load_n(&s->versions[i].ref, __ATOMIC_RELAXED);
+        if (ref == 0) {
+            break;
+        }
+
+        if (__atomic_load_n(&s->versions[i].index, __ATOMIC_RELAXED) <= index) {
+            // the chunk can be freed and reused meanwhile, slabs stay mapped
+            *len = KVS_REF_LEN(ref);
+            memcpy(val, KVS_REF_PTR(ref), (*len < max) ? *len : max);
+            found = true;
+        }
+    }
+
+    // no version at index, the key was set later or its version dropped
+    if (!found && (index < __atomic_load_n(&s->since, __ATOMIC_RELAXED))) {
+        *len = KVS_TOO_OLD;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&b->version, __ATOMIC_RELAXED) == version;
+}
+
+// a key that was copied from the old table must not be in the new one yet
+static bool copy_valid(kvs_table_t* t, struct kvs_table_mem* m,
+                       bool in_old, uint64_t tag)
+{
+    // a set frees the value of a key in an older table only after it put
+    // the key into the newer one, the versions of the older table stay
+    if (__atomic_load_n(&t->tab, __ATOMIC_ACQUIRE) != m) {
+        return false;
+    }
+
+    bool found = false;
+    if (in_old) {
+        find_slot(m, tag, &found);
+    }
+    return !found;
+}
+
+uint16_t kvs_table_read(kvs_table_t* t, uint64_t key, void* val,
+                        uint16_t max, uint64_t* retries)
+{
+    // the newest version is never dropped
+    return kvs_table_read_at(t, key, UINT64_MAX, val, max, retries);
+}
+
+int kvs_table_read_at(kvs_table_t* t, uint64_t key, uint64_t index,
+                      void* val, uint16_t max, uint64_t* retries)
+{
+    int len = 0;
+    uint64_t tag = key + 1;
+    while (key <= KVS_MAX_KEY) {
+        struct kvs_table_mem* m = __atomic_load_n(&t->tab, __ATOMIC_ACQUIRE);
+        struct kvs_table_mem* old = __atomic_load_n(&t->old, __ATOMIC_ACQUIRE);
+        bool found;
+        bool in_old = false;
+        uint64_t slot = find_slot(m, tag, &found);
+        if (!found && (old != NULL) && (old != m)) {
+            slot = find_slot(old, tag, &found);
+            in_old = true;
+        }
+
+        if (!found) {
+            len = 0;
+            break;
+        }
+
+        if (copy_slot(in_old ? old : m, slot, index, val, max, &len) &&
+            copy_valid(t, m, in_old, tag)) {
+            break;
+        }
+        (*retries)++;
+    }
+
+    uint16_t copy = (len < 0) ? 0 : ((len < max) ? len : max);
+    memset((uint8_t*) val + copy, 0, max - copy);
+    return len;
+}
+
+void kvs_table_prefetch(kvs_table_t* t, uint64_t key)
+{
+    struct kvs_table_mem* m = __atomic_load_n(&t->tab, __ATOMIC_ACQUIRE);
+    uint64_t b = hash_key(key + 1) & (m->num_buckets - 1);
+    __builtin_prefetch(&m->buckets[b], 0, 3);
+    __builtin_prefetch(&m->slots[b*KVS_BUCKET_KEYS], 0, 3);
+}
+
+uint64_t kvs_table_count(kvs_table_t* t)
+{
+    return __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+}
+
+uint64_t kvs_table_memory(kvs_table_t* t)
+{
+    uint64_t bytes = sizeof(kvs_table_t);
+    struct kvs_table_mem* m = __atomic_load_n(&t->tab, __ATOMIC_ACQUIRE);
+    for (; m != NULL; m = m->retired) {
+        bytes += sizeof(struct kvs_table_mem) +
+                 m->num_buckets*(sizeof(kvs_bucket_t) +
+                                 KVS_BUCKET_KEYS*sizeof(struct kvs_slot));
+    }
+    return bytes;
+}
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <numa.h>
 #include <smlt.h>
 #include <smlt_broadcast.h>
 #include <smlt_context.h>
@@ -30,6 +31,7 @@
 #include "consensus.h"
 #include "one_replica.h"
 #include "client.h"
+#include "doorbell.h"
 #include "flags.h"
 
 #define MAX_BACKOFF 150
@@ -53,6 +55,24 @@
 #define ONE_VERIFY 15
 
 
+/*
+ * Accept and learn messages carry a batch of client commands
+ * data[0] tag | client_id | request_id of the first command
+ * data[1] index
+ * data[2] n
+ * data[3] number of commands in the batch
+ * followed by one record per command
+ * rec[0] header of the command (request_id, length, client_id)
+ * rec[1] core that replies to the client
+ * rec[2] - rec[1+CONS_CMD_WORDS(length)] the command
+ */
+#define ONE_BATCH_HDR_WORDS 4
+#define ONE_REC_HDR_WORDS 2
+#define ONE_REC_MAX_WORDS (ONE_REC_HDR_WORDS+CONS_CMD_WORDS(CONS_MAX_CMD_SIZE))
+#define ONE_BATCH_MSG_SIZE ((ONE_BATCH_HDR_WORDS+(ONE_MAX_BATCH*ONE_REC_MAX_WORDS))* \
+                            sizeof(uintptr_t))
+
+
 /*
  * Format of messages sent around
  * The is_alive as well as
@@ -61,17 +81,22 @@
  * and the n field for the answer
  */
 
+/*
+ * Proposals of the leader that are not yet learned are kept in a ring
+ * indexed by the proposal index, the messages are allocated once
+ */
+#define ONE_RING_MASK (ONE_RING_SIZE-1)
+#if (ONE_RING_SIZE & ONE_RING_MASK)
+#error "ONE_RING_SIZE has to be a power of 2"
+#endif
+
 struct entry{
     struct smlt_msg* msg;
-	struct entry* next;
+    uint64_t index;
+    // one entry per cache line
+    uint8_t padding[48];
 };
 
-typedef struct entry_queue_t {
-	uint64_t size;
-	struct entry* head;
-	struct entry* tail;
-} entry_queue_t;
-
 typedef struct onepaxos_replica_t{
 	uint8_t id;
     uint8_t current_core;
@@ -110,10 +135,21 @@ typedef struct onepaxos_replica_t{
 	// leader state
 	uint64_t last_index[MAX_NUM_CLIENTS];
 
-	entry_queue_t entry_queue;
-	bool entry_q_initialized;
+	struct entry* ring;
+	bool ring_initialized;
 	struct entry last_entry;
 
+	// batch of client commands not yet proposed
+	struct smlt_msg* batch;
+	uint8_t batch_count;
+	uint16_t batch_words;
+	uint8_t batch_size;
+	uint64_t batch_start;
+	uint64_t batch_delay;
+
+	// single command of a batch and replies to clients
+	struct smlt_msg* cmd;
+
 	// composition information
     char* prog_string;
 	uint8_t level;
@@ -125,8 +161,8 @@ typedef struct onepaxos_replica_t{
 } onepaxos_replica_t;
 
 static __thread onepaxos_replica_t replica;
-extern struct smlt_context* ctx;
-extern struct smlt_topology* topo;
+extern __thread struct smlt_context* ctx;
+extern __thread struct smlt_topology* topo;
 
 #ifdef VERIFY
 uint32_t* crcs;
@@ -158,6 +194,12 @@ static void handle_change_acceptor(struct smlt_msg* msg);
 
 static bool execute(uintptr_t* msg);
 static uint16_t next_acceptor_id(void);
+static void flush_batch(void);
+static inline bool ring_full(void);
+static void learn_batch(struct smlt_msg* msg);
+
+static uint8_t default_batch_size = ONE_BATCH_SIZE;
+static uint32_t default_batch_delay = ONE_BATCH_DELAY;
 
 
 // Throughput mesaurement
@@ -311,12 +353,26 @@ static void message_handler_onepaxos(struct smlt_msg *msg)
 }
 
 
+// propose a batch that did not fill up within the max delay, while the
+// ring is full it stays pending and is proposed once a slot is learned
+static inline void check_batch_timeout(void)
+{
+    if (replica.alg_below != ALG_NONE) {
+        com_layer_core_poll();
+    }
+
+    if ((replica.batch_count > 0) && !ring_full() &&
+        ((rdtsc() - replica.batch_start) > replica.batch_delay)) {
+        flush_batch();
+    }
+}
+
 #ifdef SMLT
 __thread uintptr_t msg2[7];
 void message_handler_loop_onepaxos(void)
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(ONE_BATCH_MSG_SIZE);
     if (replica.id == replica.current_leader) {
         uint64_t* cores = (uint64_t*) malloc(sizeof(uint64_t)*
                                              replica.num_clients*2);
@@ -343,6 +399,15 @@ void message_handler_loop_onepaxos(void)
                     continue;
                 }
 
+                // back-pressure, only wait for learns
+                if (ring_full() && (i < replica.num_clients)) {
+                    if (smlt_broadcast_can_recv(ctx)) {
+                        smlt_broadcast(ctx, message);
+                        message_handler_onepaxos(message);
+                    }
+                    continue;
+                }
+
                 if (smlt_can_recv(cores[i]) || smlt_broadcast_can_recv(ctx)) {
                     
                 
@@ -375,6 +440,9 @@ void message_handler_loop_onepaxos(void)
                         message_handler_onepaxos(message);
                     }
                     */ 
+                } else {
+                    check_batch_timeout();
+                    com_layer_core_poll();
                 }
             }
         }
@@ -383,16 +451,19 @@ void message_handler_loop_onepaxos(void)
             if (smlt_can_recv(replica.replicas[replica.current_leader])) {
                 smlt_recv(replica.replicas[replica.current_leader], message);
                 message_handler_onepaxos(message);
+            } else {
+                // a partial batch for the core level is sent after its delay
+                com_layer_core_poll();
             }
         }
 
     } else {
         while (true) {
-            smlt_broadcast(ctx, message);
-            message_handler_onepaxos(message);
-            if (message->data[3] == replica.current_core) {
-                set_tag(message->data, RESP_TAG);
-                smlt_send(replica.clients[get_client_id(message->data)], message);
+            if (smlt_broadcast_can_recv(ctx)) {
+                smlt_broadcast(ctx, message);
+                message_handler_onepaxos(message);
+            } else {
+                com_layer_core_poll();
             }
         }
     }
@@ -401,37 +472,32 @@ void message_handler_loop_onepaxos(void)
 void message_handler_loop_onepaxos(void)
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(ONE_BATCH_MSG_SIZE);
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
     if (replica.id == replica.current_leader) {
-        int j = 0;
-        uint8_t* all_cores = (uint8_t*) malloc(sizeof(uint8_t)* (replica.num_replicas +
-                                replica.num_clients));
-        for (int i = 0; i < replica.num_replicas; i++) {
-            all_cores[i] = replica.replicas[i];
-        }
-
-        for (int i = replica.num_replicas; i < 
-                (replica.num_replicas+ replica.num_clients); i++) {
-            all_cores[i] = replica.clients[(i-replica.num_replicas)];
-        }
-
+        doorbell_loop_t loop;
+        doorbell_loop_init(&loop, replica.current_core, replica.replicas,
+                           replica.num_replicas, replica.clients,
+                           replica.num_clients);
         while (true) {
-            if (all_cores[j] == replica.current_core){
-                    j++;
-                    j = j % (replica.num_replicas + replica.num_clients);
-                    continue;
-            }
-
-            if (smlt_can_recv(all_cores[j])) {
-                err = smlt_recv(all_cores[j], message);
+            // back-pressure, no client requests while the ring is full
+            int core = doorbell_next(&loop, !ring_full());
+            if (core >= 0) {
+                err = smlt_recv(core, message);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
                 message_handler_onepaxos(message);
+                idle_reset(&idle);
+            } else {
+                check_batch_timeout();
+                com_layer_core_poll();
+                // an open batch is proposed after its delay
+                if (replica.batch_count == 0) {
+                    doorbell_idle(&loop, &idle);
+                }
             }
-            j++;
-
-            j = j % (replica.num_replicas + replica.num_clients);
         }
 
     } else if (replica.id == replica.current_acceptor) {
@@ -442,6 +508,11 @@ void message_handler_loop_onepaxos(void)
                     // TODO
                 }
                 message_handler_onepaxos(message);
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(replica.replicas[replica.current_leader],
+                                   &idle);
             }
         }
 
@@ -454,64 +525,45 @@ void message_handler_loop_onepaxos(void)
                     // TODO
                 }
                 message_handler_onepaxos(message);
-
-#ifdef KVS
-                if (message->data[3] == replica.current_core) {
-                    set_tag(message->data, RESP_TAG);
-                    err = smlt_send(replica.clients[get_client_id(message->data)], 
-                                    message);
-                    if (smlt_err_is_fail(err)) {
-                        // TODO
-                    }
-                }
-#endif
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(replica.replicas[replica.current_acceptor],
+                                   &idle);
             }
         }
     }
 }
 #endif
 
-static void entry_queue_init(entry_queue_t *st)
+static void entry_ring_alloc(void)
 {
-	st->size = 0;
-	st->head = st->tail = NULL;
+    if (replica.ring == NULL) {
+        // page aligned i.e. entries are cache line aligned
+        replica.ring = (struct entry*) numa_alloc_local(sizeof(struct entry)*
+                                                        ONE_RING_SIZE);
+        for (int i = 0; i < ONE_RING_SIZE; i++) {
+            replica.ring[i].msg = smlt_message_alloc(ONE_BATCH_MSG_SIZE);
+            replica.ring[i].index = 0;
+        }
+    }
 }
 
-static bool entry_q_empty(entry_queue_t *client) {
-	return client->head == NULL;
+static void entry_ring_init(void)
+{
+    entry_ring_alloc();
+    replica.ring_initialized = true;
 }
 
-static void entry_q_enqueue(struct entry *ele)
+static inline struct entry* ring_entry(uint64_t index)
 {
-	entry_queue_t *client = &replica.entry_queue;
-
-	ele->next = NULL;
-
-	if (client->head == NULL) {
-	    client->head = client->tail = ele;
-	    client->size++;
-	} else {
-	    client->tail->next = ele;
-	    client->tail = ele;
-	    client->size++;
-	}
-
+    return &replica.ring[index & ONE_RING_MASK];
 }
 
-static struct entry *entry_q_dequeue(void)
+// the slot of the next proposal still holds one that is not learned
+static inline bool ring_full(void)
 {
-	entry_queue_t *client = &replica.entry_queue;
-	if (client->head == NULL) {
-	   return NULL;
-	} else {
-	   struct entry *ele = client->head;
-	   client->head = ele->next;
-	   if (client->head == NULL) {
-	       client->tail = NULL;
-	   }
-	   client->size--;
-	   return ele;
-	}
+    return (replica.proposal_index - replica.index) >= ONE_RING_SIZE;
 }
 
 /*
@@ -601,7 +653,7 @@ static void handle_setup(struct smlt_msg* msg)
         }
     }
 
-    err = smlt_send(core, msg);
+    err = doorbell_send(core, msg);
     if (smlt_err_is_fail(err)) {
         // TODO
     }   
@@ -625,27 +677,85 @@ static void handle_request(struct smlt_msg* msg)
     }
 #endif
     if (replica.id == replica.current_leader){
-        struct entry* ele = (struct entry*) malloc(sizeof(struct entry));
-        ele->msg = msg;
-        entry_q_enqueue(ele);
-        set_tag(msg->data, ONE_ACC);
-        err = smlt_send(replica.replicas[replica.current_acceptor], msg);
-        if (smlt_err_is_fail(err)) {
-            // TODO
+        if (replica.batch_count == 0) {
+            replica.batch_start = rdtsc();
         }
 
-        replica.proposal_index++;
+        uint16_t len = CONS_CMD_BYTES(get_cmd_len(msg->data));
+        uintptr_t* rec = &replica.batch->data[replica.batch_words];
+        rec[0] = msg->data[0];
+        rec[1] = msg->data[3];
+        memcpy(&rec[ONE_REC_HDR_WORDS], &msg->data[CONS_HDR_WORDS], len);
+        replica.batch_words += ONE_REC_HDR_WORDS + CONS_CMD_WORDS(len);
+        replica.batch_count++;
 
+        if (replica.batch_count >= replica.batch_size) {
+            flush_batch();
+        }
     } else {
         printf("Core %d: Forward to %d \n", replica.current_core,
                replica.replicas[replica.current_leader]);
-        err = smlt_send(replica.replicas[replica.current_leader], msg);
+        err = doorbell_send(replica.replicas[replica.current_leader], msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
     }
 }
 
+/*
+ * Propose all commands of the current batch as one instance
+ */
+static void flush_batch(void)
+{
+    errval_t err;
+    struct smlt_msg* batch = replica.batch;
+
+    batch->data[0] = batch->data[ONE_BATCH_HDR_WORDS];
+    set_tag(batch->data, ONE_ACC);
+    batch->data[1] = replica.proposal_index;
+    batch->data[2] = replica.current_n;
+    batch->data[3] = replica.batch_count;
+    batch->words = replica.batch_words;
+
+    // the batch is built in its ring entry and kept until it is learned
+    ring_entry(replica.proposal_index)->index = replica.proposal_index;
+
+    err = doorbell_send(replica.replicas[replica.current_acceptor], batch);
+    if (smlt_err_is_fail(err)) {
+        // TODO
+    }
+
+    replica.proposal_index++;
+    replica.batch = ring_entry(replica.proposal_index)->msg;
+    replica.batch_count = 0;
+    replica.batch_words = ONE_BATCH_HDR_WORDS;
+}
+
+/*
+ * Unpacks the command of the batch at word offset off into the single
+ * command message and advances off to the next command
+ */
+static struct smlt_msg* get_batch_cmd(struct smlt_msg* msg, uint64_t* off)
+{
+    uintptr_t* rec = &msg->data[*off];
+    uint16_t len = CONS_CMD_BYTES(get_cmd_len(&rec[0]));
+    struct smlt_msg* cmd = replica.cmd;
+    cmd->data[0] = rec[0];
+    cmd->data[1] = msg->data[1];
+    cmd->data[2] = msg->data[2];
+    cmd->data[3] = rec[1];
+    memcpy(&cmd->data[CONS_HDR_WORDS], &rec[ONE_REC_HDR_WORDS], len);
+    cmd->words = get_msg_words(cmd->data);
+    *off += ONE_REC_HDR_WORDS + CONS_CMD_WORDS(len);
+    return cmd;
+}
+
+static void copy_batch(struct smlt_msg* copy, struct smlt_msg* msg)
+{
+    memcpy(copy->data, msg->data, msg->words*sizeof(uintptr_t));
+    copy->words = msg->words;
+}
+
 static void handle_prepare(struct smlt_msg* msg)
 {
     errval_t err;
@@ -654,14 +764,14 @@ static void handle_prepare(struct smlt_msg* msg)
     	// send to leader that I'm alive to reset timer
         // TODO SEND prepare response
         set_tag(msg->data, ONE_PREP_RESP);
-        err = smlt_send(replica.current_leader, msg);
+        err = doorbell_send(replica.current_leader, msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
 
         // TODO SEND alive to leader
         set_tag(msg->data, ONE_IS_ALIVE);
-        err = smlt_send(replica.current_leader, msg);
+        err = doorbell_send(replica.current_leader, msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
@@ -683,16 +793,20 @@ static void handle_prepare_response(struct smlt_msg* msg)
     // acceptor died
 
     bool proposals_was_null = false;
-    if (replica.entry_q_initialized == false) {
+    if (replica.ring_initialized == false) {
 	    proposals_was_null = true;
-        entry_queue_init(&replica.entry_queue);
-	    replica.entry_q_initialized = true;
+        entry_ring_init();
 
         replica.proposal_index = replica.index;
-	    // just to be sure resend last entry
-	    struct entry* ele1 = (struct entry*) malloc(sizeof(struct entry));
-        ele1->msg = replica.last_entry.msg;
-	    entry_q_enqueue(ele1);
+	    // just to be sure keep last entry
+        if ((replica.last_entry.msg != NULL) && (replica.index > 0)) {
+            struct entry* ele1 = ring_entry(replica.index-1);
+            copy_batch(ele1->msg, replica.last_entry.msg);
+            ele1->index = replica.index-1;
+        }
+        replica.batch = ring_entry(replica.proposal_index)->msg;
+        replica.batch_count = 0;
+        replica.batch_words = ONE_BATCH_HDR_WORDS;
 
         // TODO cancel periodic function call
  	   // periodic_event_cancel(&leader_alive);
@@ -703,14 +817,14 @@ static void handle_prepare_response(struct smlt_msg* msg)
 
     replica.change = false;
     if (!proposals_was_null) {
-        while (!entry_q_empty(&replica.entry_queue)) {
-            struct entry* ele = entry_q_dequeue();
+        // resend the proposals that are not learned to the new acceptor
+        for (uint64_t i = replica.index; i < replica.proposal_index; i++) {
+            struct entry* ele = ring_entry(i);
             set_tag(ele->msg->data, ONE_ACC);
-            err = smlt_send(replica.current_leader, msg);
+            err = doorbell_send(replica.replicas[replica.current_acceptor], ele->msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
-            free(ele);
         }
     }
 
@@ -752,17 +866,13 @@ static void handle_accept(struct smlt_msg* msg)
                 continue;
             }
 
-            err = smlt_send(replica.replicas[i], msg);
+            err = doorbell_send(replica.replicas[i], msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
         }
 #endif
-	    execute(msg->data);
-
-        if (replica.alg_below != ALG_NONE) {
-	        com_layer_core_send_request(msg);
-        }
+        learn_batch(msg);
 
         if (replica.index != msg->data[1]){
 	        // Same index twice -> some other server may be down
@@ -799,7 +909,6 @@ static void handle_accept(struct smlt_msg* msg)
 
 static void handle_learn(struct smlt_msg* msg)
 {
-    errval_t err;
 #ifdef MEASURE_TP
     if (!timer_started){
        total_start = rdtsc();
@@ -814,48 +923,16 @@ static void handle_learn(struct smlt_msg* msg)
     cid[msg->data[1]] = get_client_id(msg);
 #endif
 
-    bool success = execute(msg->data);
-
-    if (replica.alg_below != ALG_NONE) {
-	    com_layer_core_send_request(msg);
-    }
+    learn_batch(msg);
 
     if (replica.index != msg->data[1]){
 	    // Same index twice -> some other server may be down
 	    replica.index = msg->data[1];
     }
 
+    // the ring entry of a learned proposal is reused by the leader
     replica.index++;
 
-    if (replica.id == replica.current_leader) {
-	    if (replica.entry_queue.size > ((replica.proposal_index-replica.index)+1)){
-	        struct entry* ele = entry_q_dequeue();
-            free(ele);
-	    }
-	    // was no duplica i.e. not yet replied to
-	    if (success) {
-	        // don't care for reply on core level
-	        if (replica.level == NODE_LEVEL) {
-#ifndef KVS
-                set_tag(msg->data, RESP_TAG);
-                err = smlt_send(replica.clients[get_client_id(msg->data)], msg);
-                if (smlt_err_is_fail(err)) {
-                    // TODO
-                }
-#endif
- 	        } else {
-                set_tag(msg->data, RESP_TAG);
-                err = smlt_send(replica.started_from_id, msg);
-                if (smlt_err_is_fail(err)) {
-                    // TODO
-                }
-	        }
-#ifdef MEASURE_TP
-	        num_reqs++;
-#endif
-	    }
-    }
-
 #ifdef VERIFY
     if (replica.index == (replica.num_requests)) {
 	    crc_t crc;
@@ -879,6 +956,63 @@ static void handle_learn(struct smlt_msg* msg)
 
 }
 
+/*
+ * Executes the commands of a batch in order and replies to the clients
+ */
+static void learn_batch(struct smlt_msg* msg)
+{
+    errval_t err;
+    uint64_t off = ONE_BATCH_HDR_WORDS;
+    for (uint64_t i = 0; i < msg->data[3]; i++) {
+        struct smlt_msg* cmd = get_batch_cmd(msg, &off);
+        bool success = execute(cmd->data);
+
+        // was no duplica i.e. not yet replied to
+        if (!success) {
+            continue;
+        }
+
+        // the core level only executes what this replica executed
+        if (replica.alg_below != ALG_NONE) {
+	        com_layer_core_send_request(cmd);
+        }
+#ifdef KVS
+        // the replica on the NUMA node of the client replies
+        if ((cmd->data[3] == replica.current_core) &&
+            (replica.level == NODE_LEVEL)) {
+            set_tag(cmd->data, RESP_TAG);
+            err = doorbell_send(replica.clients[get_client_id(cmd->data)], cmd);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+        }
+#endif
+        if (replica.id != replica.current_leader) {
+            continue;
+        }
+
+        // don't care for reply on core level
+        if (replica.level == NODE_LEVEL) {
+#ifndef KVS
+            set_tag(cmd->data, RESP_TAG);
+            err = doorbell_send(replica.clients[get_client_id(cmd->data)], cmd);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+#endif
+        } else {
+            set_tag(cmd->data, RESP_TAG);
+            err = doorbell_send(replica.started_from_id, cmd);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+        }
+#ifdef MEASURE_TP
+        num_reqs++;
+#endif
+    }
+}
+
 static void handle_abandon(struct smlt_msg* msg)
 {
     // still leader
@@ -1078,6 +1212,15 @@ static void handle_is_alive_response(struct smlt_msg* msg)
 	}
 }
 
+void set_batching_onepaxos(uint8_t batch_size, uint32_t max_delay)
+{
+    if (batch_size == 0) {
+        batch_size = 1;
+    }
+    default_batch_size = MIN(batch_size, ONE_MAX_BATCH);
+    default_batch_delay = max_delay;
+}
+
 void set_execution_fn_onepaxos(void (*exec_fn)(void *))
 {
      replica.exec_fn = exec_fn;
@@ -1091,7 +1234,7 @@ static void default_exec_fn(void* addr)
 
 uint16_t get_cmd_size(void)
 {
-     return sizeof(3*sizeof(uint64_t));
+     return consensus_get_cmd_size();
 }
 
 void init_replica_onepaxos(uint8_t id,
@@ -1151,12 +1294,11 @@ void init_replica_onepaxos(uint8_t id,
 	replica.voted = false;
 	replica.backoff = rdtsc() % MAX_BACKOFF;
 
-	if (id == 0) {
-	    entry_queue_init(&replica.entry_queue);
-	    replica.entry_q_initialized = true;
-	} else {
-	    replica.entry_q_initialized = false;
-	}
+	// every replica gets a ring, a leader change never finds a NULL batch.
+	// Only the leader starts proposing from it
+	replica.ring = NULL;
+	entry_ring_alloc();
+	replica.ring_initialized = (id == replica.current_leader);
 
 
 #ifdef VERIFY
@@ -1166,8 +1308,14 @@ void init_replica_onepaxos(uint8_t id,
 	crc_count = 0;
 #endif
 
-    // TODO GET frequency in cycles
-	tsc_per_ms = 2400000;
+	tsc_per_ms = com_layer_tsc_per_us()*1000;
+
+	replica.batch = ring_entry(replica.proposal_index)->msg;
+	replica.cmd = smlt_message_alloc(CONS_MSG_SIZE);
+	replica.batch_count = 0;
+	replica.batch_words = ONE_BATCH_HDR_WORDS;
+	replica.batch_size = default_batch_size;
+	replica.batch_delay = (default_batch_delay*tsc_per_ms)/1000;
 
     if (replica.alg_below != ALG_NONE) {
         com_layer_core_init(replica.alg_below, replica.id, replica.current_core,
@@ -1213,11 +1361,12 @@ static bool execute(uintptr_t* msg)
 	if ((replica.last_executed_rid[get_client_id(msg)] == get_request_id(msg)) ||
 	    ((replica.last_executed_rid[get_client_id(msg)] > get_request_id(msg)) &&
 	      !(replica.last_executed_rid[get_client_id(msg)] == (uint64_t)-1))) {
-
+	   // a retry may carry its own chunk, every replica has to release it
+	   consensus_skip_cmd(&msg[CONS_HDR_WORDS], get_cmd_len(msg));
 	   return false;
 	}
 
-	replica.exec_fn(&msg[4]);
+	consensus_exec_cmd(replica.exec_fn, &msg[CONS_HDR_WORDS], get_cmd_len(msg));
 	replica.last_executed_rid[get_client_id(msg)] = get_request_id(msg);
 
 	return true;
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <numa.h>
 #include <smlt.h>
 #include <smlt_message.h>
 
@@ -19,6 +20,7 @@
 
 #include "incremental_stats.h"
 #include "client.h"
+#include "doorbell.h"
 #include "internal_com_layer.h"
 #include "consensus.h"
 #include "raft_replica.h"
@@ -30,25 +32,49 @@
 #define RAFT_REQV 6
 #define RAFT_REQVR 7
 
+// status of an append response besides false and true, the follower acks
+// once it applied entries and the leader waits for it until then
+#define RAFT_APPR_FULL 2
+// an append carries the term of its entry and of the previous entry
+// after the command
+#define RAFT_TERM_WORDS 2
+#define RAFT_MSG_SIZE (CONS_MSG_SIZE+RAFT_TERM_WORDS*sizeof(uintptr_t))
+
 #define HEARTBEAT_TIMEOUT 50
 #define ELECTION_RESET_TIMEOUT 100
 #define ELECTION_TIMEOUT  200
 #define BACKOFF_MAX 150
 
-struct log_queue{
-    int size;
-    struct log_entry* head;
-    struct log_entry* tail;
-};
+// max number of log entries the leader has not yet replicated on all followers
+#define RAFT_MAX_INFLIGHT 32
+// followers ack at the latest after this many appended entries
+#define RAFT_ACK_BATCH 8
+// entries the log keeps, has to be a power of 2
+#ifndef RAFT_LOG_SIZE
+#define RAFT_LOG_SIZE 256
+#endif
+#define RAFT_LOG_MASK (RAFT_LOG_SIZE-1)
+
+#if (RAFT_LOG_SIZE & RAFT_LOG_MASK) || (RAFT_LOG_SIZE <= 2*RAFT_MAX_INFLIGHT)
+#error "RAFT_LOG_SIZE has to be a power of 2 larger than 2*RAFT_MAX_INFLIGHT"
+#endif
 
 struct log_entry{
     uint8_t exec_count;
     uint64_t index;
     uint64_t term;
     uintptr_t header;
-    uintptr_t payload[3];
-    struct log_entry* next;
-    struct log_entry* prev;
+    // command, length is part of the header
+    uintptr_t payload[CONS_CMD_WORDS(CONS_MAX_CMD_SIZE)];
+};
+
+/*
+ * The log holds the entries first_index to last_log_index in an array
+ * that is indexed by the log index modulo RAFT_LOG_SIZE
+ */
+struct log_segment{
+    struct log_entry* entries;
+    uint64_t first_index;
 };
 
 typedef struct raft_replica_t{	
@@ -73,15 +99,22 @@ typedef struct raft_replica_t{
 	uint64_t last_applied;
 	uint64_t last_log_index;
     uint64_t previous_term;
-    struct log_entry* previous_entry;
+    struct log_segment log;
 
 	// leader state
-    struct log_queue queue;
+	// largest commit index the followers were sent
+	uint64_t commit_sent;
 	uint64_t next_index[MAX_NUM_REPLICAS];
 	uint64_t match_index[MAX_NUM_REPLICAS];
 	uint64_t last_client_request[MAX_NUM_CLIENTS];
 	uint16_t num_appendEntry_replys[MAX_NUM_REPLICAS];	
 	uint16_t num_requestVoted_replys[MAX_NUM_REPLICAS];	
+	bool catching_up[MAX_NUM_REPLICAS];
+
+	// follower state, appended entries not yet acked
+	uint16_t unacked;
+	// an append was rejected because the log was full
+	bool log_was_full;
 
 	uint16_t num_votes;
 	uint16_t num_rejects;
@@ -109,6 +142,7 @@ typedef struct raft_replica_t{
 
 
 static __thread struct smlt_msg* buf;
+static __thread struct smlt_msg* commit_msg;
 static __thread raft_replica_t replica;
 
 static void handle_setup(struct smlt_msg* msg);
@@ -119,7 +153,8 @@ static void handle_append_response(struct smlt_msg* msg);
 static void handle_vote(struct smlt_msg* msg);
 static void handle_vote_response(struct smlt_msg* msg);
 
-static void cleanup_queue(struct log_queue* queue);
+static void cleanup_log(void);
+static bool pipeline_full(void);
 
 /*
  * Measurement stuff
@@ -182,80 +217,58 @@ static void* results_raft(void* arg)
 
 
 /*
- * Log queue operations.
+ * Log operations.
  */
-/*
-static void print_queue_state(struct log_queue *queue);
-static void print_queue_state(struct log_queue *queue)
+static void log_init(struct log_segment* log)
 {
-    struct log_entry *ele = queue->head;
-    while (ele != NULL) {
-        
-        printf("Replica %d: ele->index %" PRIu64" \n", 
-                replica.current_core, ele->index);
-        printf("Replica %d: ele->term %" PRIu64" \n",
-                replica.current_core, ele->term);
-        printf("Replica %d: ele->exec_count %d \n", 
-                replica.current_core, ele->exec_count);
-        ele = ele->next;
-    }
+    // page aligned and local to the replica
+    log->entries = (struct log_entry*) numa_alloc_local(sizeof(struct log_entry)*
+                                                        RAFT_LOG_SIZE);
+    log->first_index = 0;
 }
-*/
-static void log_queue_init(struct log_queue *queue)
+
+static struct log_entry* log_get(struct log_segment* log, uint64_t index)
 {
-    queue->size = 0;
-    queue->head = queue->tail = NULL;
+    if ((index < log->first_index) || (index > replica.last_log_index)) {
+        return NULL;
+    }
+    return &log->entries[index & RAFT_LOG_MASK];
 }
 
-static void enqueue(struct log_queue *queue, struct log_entry *ele) 
+static bool log_full(struct log_segment* log)
 {
-	ele->next = NULL;
-	
-	if (queue->head == NULL) {
-	    queue->head = queue->tail = ele;
-	    queue->size++;
-	} else {
-        struct log_entry* prev_t = queue->tail;
-	    queue->tail->next = ele;
-	    queue->tail = ele;
-        queue->tail->prev = prev_t;
-	    queue->size++;
-	}
-
+    return (replica.last_log_index+1 - log->first_index) >= RAFT_LOG_SIZE;
 }
 
-static struct log_entry* remove_entry(struct log_queue *queue,
-                                   uint64_t index)
+/*
+ * Appends the command of msg at index, all entries after index-1 are
+ * dropped i.e. a conflicting suffix is truncated in one step
+ */
+static struct log_entry* log_append(struct log_segment* log, uint64_t index,
+                                    uint64_t term, struct smlt_msg* msg)
 {
-    struct log_entry *ele = queue->head;
-    while (ele != NULL) {
-        if ((ele->index == index)) {
-            struct log_entry* prev;
-            struct log_entry* next;
-            prev = ele->prev;
-            next = ele->next;
-            prev->next = next;
-            next->prev = prev;
-            return ele;
-        }
-        ele = ele->next;
+    if ((index - log->first_index) >= RAFT_LOG_SIZE) {
+        return NULL;
     }
-    return NULL;
 
+    uint16_t len = CONS_CMD_BYTES(get_cmd_len(&msg->data[0]));
+    struct log_entry* ele = &log->entries[index & RAFT_LOG_MASK];
+    ele->index = index;
+    ele->term = term;
+    ele->exec_count = 0;
+    ele->header = msg->data[0];
+    memcpy(ele->payload, &msg->data[CONS_HDR_WORDS], len);
+    replica.last_log_index = index;
+    return ele;
 }
 
-
-static struct log_entry* queue_contains(struct log_queue *queue, 
-                                        uint64_t index)
+// drops all entries before index, the last entry is always kept
+static void log_drop_head(struct log_segment* log, uint64_t index)
 {
-    struct log_entry *ele = queue->head;
-    while (ele != NULL) {
-        if ((ele->index == index)) {
-            return ele;
-        }
-        ele = ele->next;
+    index = MIN(index, replica.last_log_index);
+    if (index > log->first_index) {
+        log->first_index = index;
     }
-    return NULL;
 }
 
 
@@ -269,7 +282,7 @@ static void handle_setup(struct smlt_msg* msg)
         }
     }
 
-    err = smlt_send(core, msg);
+    err = doorbell_send(core, msg);
     if (smlt_err_is_fail(err)) {
         // TODO
     }
@@ -314,31 +327,30 @@ static void message_handler_raft(struct smlt_msg *msg)
 void message_handler_loop_raft(void)
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(RAFT_MSG_SIZE);
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
     if (replica.id == replica.current_leader) {
-        int j = 0;
-        uint8_t* all_cores = (uint8_t*) malloc(sizeof(uint8_t)* (replica.num_replicas +
-                                replica.num_clients));
-        for (int i = 0; i < replica.num_replicas; i++) {
-            all_cores[i] = replica.replicas[i];
-        }
-
-        for (int i = replica.num_replicas; i < 
-             (replica.num_replicas+ replica.num_clients); i++) {
-            all_cores[i] = replica.clients[(i-replica.num_replicas)];
-        }
+        doorbell_loop_t loop;
+        doorbell_loop_init(&loop, replica.current_core, replica.replicas,
+                           replica.num_replicas, replica.clients,
+                           replica.num_clients);
 
         while (true) {
-            if (smlt_can_recv(all_cores[j])) {
-                err = smlt_recv(all_cores[j], message);
+            // do not take new client requests while too many entries
+            // are not yet replicated
+            int core = doorbell_next(&loop, !pipeline_full());
+            if (core >= 0) {
+                err = smlt_recv(core, message);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
                 message_handler_raft(message);
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle(&loop, &idle);
             }
-            j++;
-
-            j = j % (replica.num_replicas + replica.num_clients);
         }
     }else {
         while (true) {
@@ -348,6 +360,11 @@ void message_handler_loop_raft(void)
                     // TODO
                 }
                 message_handler_raft(message);
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(replica.replicas[replica.current_leader],
+                                   &idle);
             }
         }
     }
@@ -357,9 +374,22 @@ void message_handler_loop_raft(void)
 /*
  * State udpate Methods
  */ 
-static void execute(uintptr_t* msg)
+static void execute(struct log_entry* ele)
 {
-    replica.exec_fn(msg);
+    consensus_exec_cmd(replica.exec_fn, ele->payload, get_cmd_len(&ele->header));
+}
+
+// every node level replica passes the applied entries to its node
+static void forward(struct log_entry* ele)
+{
+    if ((replica.level != NODE_LEVEL) || (replica.alg_below == ALG_NONE)) {
+        return;
+    }
+
+    buf->data[0] = ele->header;
+    memcpy(&buf->data[CONS_HDR_WORDS], ele->payload,
+           CONS_CMD_BYTES(get_cmd_len(&ele->header)));
+    com_layer_core_send_request(buf);
 }
 
 static void update_state(uint64_t term, uint16_t leader_id) 
@@ -385,27 +415,30 @@ static void update_applied_entries(void)
 
         // TODO APPLY ENTRY
         struct log_entry* ele;
-        ele = queue_contains(&replica.queue, replica.last_applied);
+        ele = log_get(&replica.log, replica.last_applied);
     
-        execute(ele->payload);
+        execute(ele);
+        forward(ele);
 
 	    // respond to client if I am the leader
 	    if (replica.id == replica.current_leader) {
-  	        // find client which sent this request
-            err = smlt_send(replica.clients[get_client_id(&(ele->header))],
+  	        // find client which sent this request, the reply carries
+            // the request id so pipelining clients can match it
+            buf->data[0] = ele->header;
+            set_tag(&buf->data[0], RESP_TAG);
+            buf->words = CONS_HDR_WORDS;
+            err = doorbell_send(replica.clients[get_client_id(&(ele->header))],
                             buf);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
-            ele->exec_count++;
-            cleanup_queue(&replica.queue);
+            cleanup_log();
 #ifdef MEASURE_TP
             replica.num_reqs++;
 #endif
 	    } else {
             if (replica.last_applied > 2) {
-                ele = remove_entry(&replica.queue, replica.last_applied-2);
-                free(ele);
+                log_drop_head(&replica.log, replica.last_applied-2);
             }
         }
     }	
@@ -418,53 +451,109 @@ static void update_applied_entries(void)
  */ 
 static void update_commit_index_leader(void)
 {
-	// majority of replicas TODO replica.num_replicas -1 since i do not follow
-	// with the match_index of the leader itself
-	
-	int majority = (replica.num_replicas-1)/2;
-	uint64_t to_test = 0;
-	int num_larger = 0;	
-
 	for (int i = 0; i < replica.num_replicas; i++) {
-	    to_test = replica.match_index[i];
-	    
-	    num_larger = 0;
-	    if (to_test > replica.commit_index) {
-            for (int j = 0; j < replica.num_replicas; j++) {	  
-	            if (to_test <= replica.match_index[j]) {
-		            num_larger++;
-		        }
-		        if (num_larger >= majority) {
-		            replica.commit_index = to_test;			
-		        }
-	        }
+	    uint64_t to_test = replica.match_index[i];
+	    if ((i == replica.id) || (to_test <= replica.commit_index)) {
+            continue;
 	    }
+
+        // the leader itself always matches
+        int num_larger = 1;
+        for (int j = 0; j < replica.num_replicas; j++) {
+            if ((j != replica.id) && (to_test <= replica.match_index[j])) {
+                num_larger++;
+            }
+        }
+
+        if (num_larger > (replica.num_replicas/2)) {
+            replica.commit_index = to_test;
+        }
 	}
 }
 
-static void cleanup_queue(struct log_queue* queue) 
+static uint64_t min_match_index(void)
 {
-    struct log_entry* ele = queue->head;
-    while(ele != NULL) {
-        // check received count and clean up
-        if ((ele->exec_count == replica.num_replicas) &&
-            (ele->index < replica.commit_index-1)) {
-            // remove entry and free it
-            struct log_entry* prev;
-            struct log_entry* next;
-            prev = ele->prev;
-            next = ele->next;
-            if (prev != NULL) {
-                prev->next = next;
-            }
-        
-            if (next != NULL) {
-                next->prev = prev;
-            }
-            free(ele);
+    uint64_t min = replica.last_log_index;
+	for (int i = 0; i < replica.num_replicas; i++) {
+        if (i != replica.id) {
+            min = MIN(min, replica.match_index[i]);
+        }
+    }
+    return min;
+}
+
+static bool pipeline_full(void)
+{
+    return ((replica.last_log_index - min_match_index()) >= RAFT_MAX_INFLIGHT) ||
+           log_full(&replica.log);
+}
+
+/*
+ * Drop all entries that are applied and replicated on all followers.
+ * The newest of them stays in the log as the previous entry.
+ */
+static void cleanup_log(void)
+{
+    log_drop_head(&replica.log, MIN(min_match_index(), replica.last_applied));
+}
+
+static void send_append(uint8_t replica_id, struct log_entry* ele,
+                        struct smlt_msg* msg)
+{
+    errval_t err;
+    msg->data[0] = ele->header;
+    set_tag(&msg->data[0], RAFT_APP);
+    // combine current term and current leader
+    msg->data[1] = 0;
+    set_request_id(&msg->data[1], replica.current_term);
+    set_tag(&msg->data[1], replica.current_leader);
+    msg->data[2] = ele->index-1;
+    msg->data[3] = replica.commit_index;
+    replica.commit_sent = MAX(replica.commit_sent, replica.commit_index);
+    memcpy(&msg->data[CONS_HDR_WORDS], ele->payload,
+           CONS_CMD_BYTES(get_cmd_len(&ele->header)));
+    msg->words = get_msg_words(&msg->data[0]);
+
+    // the follower checks that its previous entry has the same term
+    struct log_entry* prev = log_get(&replica.log, ele->index-1);
+    msg->data[msg->words] = ele->term;
+    msg->data[msg->words+1] = (prev != NULL) ? prev->term : 0;
+    msg->words += RAFT_TERM_WORDS;
+
+    err = doorbell_send(replica.replicas[replica_id], msg);
+    if (smlt_err_is_fail(err)) {
+        // TODO
+    }
+}
+
+/*
+ * Followers only apply entries up to the commit index an append brings
+ * them. Without a heartbeat, the last entries would wait for the next
+ * request, so the leader sends the commit index on its own once nothing
+ * is in flight anymore.
+ */
+static void send_commit_notice(void)
+{
+    errval_t err;
+    if ((replica.commit_index <= replica.commit_sent) ||
+        (replica.commit_index < replica.last_log_index)) {
+        return;
+    }
+
+    commit_msg->data[0] = 0;
+    set_tag(&commit_msg->data[0], RAFT_APPE);
+    commit_msg->data[1] = replica.commit_index;
+    commit_msg->words = CONS_HDR_WORDS;
+    for (int i = 0; i < replica.num_replicas; i++) {
+        if (i == replica.current_leader) {
+            continue;
         }
-        ele = ele->next;
-    }    
+        err = doorbell_send(replica.replicas[i], commit_msg);
+        if (smlt_err_is_fail(err)) {
+            // TODO
+        }
+    }
+    replica.commit_sent = replica.commit_index;
 }
 
 /*
@@ -474,56 +563,58 @@ static void handle_request(struct smlt_msg* msg)
 {
     errval_t err;
     if (replica.id == replica.current_leader) {
-        replica.last_log_index++;
-        struct log_entry* ele = (struct log_entry*) malloc(sizeof(struct log_entry));
-        ele->payload[0] = msg->data[4];
-        ele->payload[1] = msg->data[5];
-        ele->payload[2] = msg->data[6];
-        ele->header = msg->data[0];
-        ele->index = replica.last_log_index;
-        ele->term = replica.current_term;       
-        ele->exec_count = 0;
-
-        enqueue(&replica.queue, ele);
-
-        set_tag(&msg->data[0], RAFT_APP);
+        // the handler loop does not take requests while the log is full
+        struct log_entry* ele = log_append(&replica.log,
+                                           replica.last_log_index+1,
+                                           replica.current_term, msg);
+        if (ele == NULL) {
+            printf("Replica %d: log full, request %"PRIu32" of client %d "
+                   "rejected \n", replica.id, get_request_id(&msg->data[0]),
+                   get_client_id(&msg->data[0]));
+            return;
+        }
+
+        // the acks are handled asynchronously in the handler loop
         for (int i = 0; i < replica.num_replicas; i++) {
-            // combine current term and current leader
-            if (i == replica.current_leader) {
+            if ((i == replica.current_leader) || replica.catching_up[i]) {
               continue;
             }
-            set_request_id(&msg->data[1], replica.current_term);
-            set_tag(&msg->data[1], replica.current_leader);
-            msg->data[2] = replica.last_log_index-1;
-            msg->data[3] = replica.commit_index;
-
-            err = smlt_send(replica.replicas[i], msg);
-            if (smlt_err_is_fail(err)) {
-                // TODO
-            }
+            send_append(i, ele, msg);
         }
-        for (int i = 0; i < replica.num_replicas; i++) {
-            // combine current term and current leader
-            if (i == replica.current_leader) {
-               continue;
-            }
-            err = smlt_recv(replica.replicas[i],buf);
-            if (smlt_err_is_fail(err)) {
-                // TODO
-            }
-            message_handler_raft(buf);
-       }
 
        replica.previous_term = replica.current_term;
     } else {
         // forward
-        err = smlt_send(replica.replicas[replica.current_leader], msg);
+        err = doorbell_send(replica.replicas[replica.current_leader], msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
     }
 }
 
+// acks the last entry once a full log has room again
+static void ack_after_full(void)
+{
+    errval_t err;
+    if (!replica.log_was_full || log_full(&replica.log)) {
+        return;
+    }
+
+    buf->data[0] = 0;
+    set_tag(&buf->data[0], RAFT_APPR);
+    buf->data[1] = replica.current_term;
+    buf->data[2] = replica.last_log_index;
+    buf->data[3] = replica.id;
+    buf->data[4] = true;
+    buf->words = CONS_HDR_WORDS+1;
+    err = doorbell_send(replica.replicas[replica.current_leader], buf);
+    if (smlt_err_is_fail(err)) {
+        // TODO
+    }
+    replica.log_was_full = false;
+    replica.unacked = 0;
+}
+
 static void handle_empty_append(struct smlt_msg* msg)
 {
     if (msg->data[1] >= replica.commit_index) {
@@ -531,6 +622,7 @@ static void handle_empty_append(struct smlt_msg* msg)
      	update_applied_entries();
     }
     replica.election_timeout = false;
+    ack_after_full();
 }
 
 
@@ -544,6 +636,9 @@ static void handle_append(struct smlt_msg* msg)
     uint8_t leader = get_tag(&msg->data[1]);
     uintptr_t prev_index = msg->data[2];
     uintptr_t commit_index = msg->data[3];
+    uintptr_t* terms = &msg->data[get_msg_words(&msg->data[0])];
+    uint64_t entry_term = terms[0];
+    uint64_t prev_term = terms[1];
     // see if leader is same leader 
     update_state(term, leader);
 	
@@ -557,8 +652,9 @@ static void handle_append(struct smlt_msg* msg)
             msg->data[2] = prev_index;
             msg->data[3] = replica.id;
             msg->data[4] = false;
+            msg->words = CONS_HDR_WORDS+1;
  
-            err = smlt_send(replica.replicas[leader],msg);
+            err = doorbell_send(replica.replicas[leader],msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -567,13 +663,21 @@ static void handle_append(struct smlt_msg* msg)
 	
 	    // log doesn't contain entry at prev_log_index whose term matches prev_log_term
         //print_queue_state(&replica.queue);
-	    if (!queue_contains(&replica.queue, prev_index)) {
+        struct log_entry* prev = log_get(&replica.log, prev_index);
+	    if ((prev == NULL) || (prev->term != prev_term)) {
+            // the conflicting entry and all that follow it are dropped,
+            // the leader resends from prev_index. Committed entries never
+            // conflict
+            if ((prev != NULL) && (prev_index > replica.commit_index)) {
+                replica.last_log_index = prev_index-1;
+            }
             msg->data[1] = replica.current_term;
             msg->data[2] = prev_index;
             msg->data[3] = replica.id;
             msg->data[4] = false;
+            msg->words = CONS_HDR_WORDS+1;
  
-            err = smlt_send(replica.replicas[leader],msg);
+            err = doorbell_send(replica.replicas[leader],msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
@@ -581,43 +685,57 @@ static void handle_append(struct smlt_msg* msg)
 	    }   
 
 
-        if (queue_contains(&replica.queue, prev_index+1)) {
-	    // conflict -> delete existing entry and all that follow it
-	        uint64_t entry_index = prev_index+1;
-	        while (remove_entry(&replica.queue, entry_index) != NULL) {
-		           entry_index++;
-	        }
-	    }
-
-	    // append log
-        struct log_entry* ele = (struct log_entry*) malloc(sizeof(struct log_entry));
-        ele->index = prev_index+1;
-        ele->term = term;
-        ele->header = msg->data[0];
-        ele->payload[0] = msg->data[4];        
-        ele->payload[1] = msg->data[5];        
-        ele->payload[2] = msg->data[6];        
-        replica.last_log_index = prev_index+1;
-
-        enqueue(&replica.queue, ele);
+	    // append log, on a conflict the existing entry and all that
+	    // follow it are deleted. A resent entry that is already in the
+	    // log is kept with its suffix
+        struct log_entry* ele = log_get(&replica.log, prev_index+1);
+        if ((ele == NULL) || (ele->term != entry_term)) {
+            if (log_full(&replica.log)) {
+                update_applied_entries();
+            }
+            if (log_append(&replica.log, prev_index+1, entry_term, msg) == NULL) {
+                // log full, the leader waits for the ack once entries
+                // are applied instead of resending right away
+                msg->data[1] = replica.current_term;
+                msg->data[2] = replica.last_log_index;
+                msg->data[3] = replica.id;
+                msg->data[4] = RAFT_APPR_FULL;
+                msg->words = CONS_HDR_WORDS+1;
+
+                err = doorbell_send(replica.replicas[leader],msg);
+                if (smlt_err_is_fail(err)) {
+                    // TODO
+                }
+                replica.log_was_full = true;
+	            return;
+            }
+        }
 	    if (commit_index > replica.commit_index) {
 	        replica.commit_index = MIN(commit_index, replica.last_log_index);
 	    }
 
-        msg->data[1] = replica.current_term;
-        msg->data[2] = prev_index+1;
-        msg->data[3] = replica.id;
-        msg->data[4] = true;
+        // ack cumulatively once all appends sent so far are processed
+        replica.unacked++;
+        if ((replica.unacked >= RAFT_ACK_BATCH) ||
+            !smlt_can_recv(replica.replicas[leader])) {
+            msg->data[1] = replica.current_term;
+            msg->data[2] = replica.last_log_index;
+            msg->data[3] = replica.id;
+            msg->data[4] = true;
+            msg->words = CONS_HDR_WORDS+1;
 
-        err = smlt_send(replica.replicas[leader],msg);
-        if (smlt_err_is_fail(err)) {
-            // TODO
+            err = doorbell_send(replica.replicas[leader],msg);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+            replica.unacked = 0;
         }
     } else { // forward to leader
 	    printf("Replica %d: Leader should not receive appendEntry requests \n", replica.id);
     }
 
     update_applied_entries();
+    ack_after_full();
 }
 
 
@@ -789,78 +907,56 @@ static void handle_requestVote_reply(struct raft_binding *b,
 
 static void handle_append_response(struct smlt_msg* msg)
 {
-    errval_t err;
     //printf("Repica %d: handle append response \n", replica.id);
     uint32_t term = (uint32_t) msg->data[1];
     uint64_t last_index = msg->data[2];
     uint8_t replica_id = (uint8_t) msg->data[3];
-    bool success = (bool) msg->data[4];
+    uintptr_t status = msg->data[4];
     struct log_entry* ele = NULL;
 
     update_state(term, replica.current_leader);
 
-    
-    if (success) { // send next
-    //    printf("term %d last_index %" PRIu64 " replica_id %d success %d \n",
-    //          term, last_index, replica_id, success);
-	    replica.next_index[replica_id] = last_index+1;
-	    replica.match_index[replica_id] = last_index;
-        ele = queue_contains(&replica.queue, last_index);
-        ele->exec_count++;
+    if (status == RAFT_APPR_FULL) {
+        // the follower acks once it applied entries, it then gets the
+        // missing ones one at a time
+        replica.next_index[replica_id] = last_index+1;
+        replica.catching_up[replica_id] = true;
+    } else if (status) {
+        // acks are cumulative
+        if (last_index > replica.match_index[replica_id]) {
+	        replica.next_index[replica_id] = last_index+1;
+	        replica.match_index[replica_id] = last_index;
+        }
 
         update_commit_index_leader();
-	    // if there are some outstanding entries for this replica
-	    // send them
-        
-	    if (replica.last_log_index >= replica.next_index[replica_id]) {
-            printf("Resending to %d \n", replica_id);
-            printf("Log index %" PRIu64 " next_index %" PRIu64 "\n", 
-                    replica.last_log_index,
-                    replica.next_index[replica_id]);
-            set_tag(&msg->data[0], RAFT_APP);
-            set_request_id(&msg->data[1], replica.current_term);
-            set_tag(&msg->data[1], replica.id);
-
-            ele = ele->next;
-            assert(ele != NULL);
-            
-            msg->data[2] = last_index;
-            msg->data[3] = replica.commit_index;
-            msg->data[4] = ele->payload[0];
-            msg->data[5] = ele->payload[1];
-            msg->data[6] = ele->payload[2];
-          
-            err = smlt_send(replica.replicas[replica_id], msg);
-            if (smlt_err_is_fail(err)) {
-                // TODO
+
+	    // a replica that missed entries gets them one at a time
+	    // until it caught up with the pipeline
+        if (replica.catching_up[replica_id]) {
+            ele = log_get(&replica.log, replica.next_index[replica_id]);
+            if (ele != NULL) {
+                send_append(replica_id, ele, msg);
+            } else {
+                replica.catching_up[replica_id] = false;
             }
-	    }  
+        }
     } else { // send previous
-    //    printf("term %d last_index %" PRIu64 " replica_id %d success %d \n",
-    //          term, last_index, replica_id, success);
 	    // check if we already match the entry the replcia request 
-        if (last_index < (replica.match_index[replica_id])) {
+        if ((last_index <= replica.match_index[replica_id]) ||
+            (replica.catching_up[replica_id] &&
+             (last_index >= replica.next_index[replica_id]))) {
 	        return;
 	    }
 
-	    replica.next_index[replica_id] = last_index-1;
-
+	    replica.next_index[replica_id] = last_index;
+        ele = log_get(&replica.log, last_index);
         assert(ele != NULL);
-        ele = ele->prev;
-        msg->data[2] = last_index-1;
-        msg->data[3] = replica.commit_index;
-        msg->data[4] = ele->payload[0];
-        msg->data[5] = ele->payload[1];
-        msg->data[6] = ele->payload[2];
-      
-        err = smlt_send(replica.replicas[replica_id], msg);
-        if (smlt_err_is_fail(err)) {
-            // TODO
-        }
-
+        replica.catching_up[replica_id] = true;
+        send_append(replica_id, ele, msg);
     }
 
     update_applied_entries();
+    send_commit_notice();
 }
 
 
@@ -964,19 +1060,23 @@ void init_replica_raft(uint8_t id,
 	replica.voted_for = -1;
 	replica.backoff = (rdtsc() % BACKOFF_MAX);
 
-    buf = smlt_message_alloc(56);
+    buf = smlt_message_alloc(CONS_MSG_SIZE);
+    commit_msg = smlt_message_alloc(CONS_MSG_SIZE);
+    replica.commit_sent = 0;
+    replica.log_was_full = false;
 	for (int i = 0; i < num_replicas; i++) {
 	    replica.next_index[i] = 2;
 	    replica.match_index[i] = 0;
+	    replica.catching_up[i] = false;
 	}
+    replica.unacked = 0;
 
-    log_queue_init(&replica.queue);
-    struct log_entry* ele = (struct log_entry*)
-                            malloc(sizeof(struct log_entry));
+    log_init(&replica.log);
+    struct log_entry* ele = &replica.log.entries[0];
 
     ele->index = 0;
     ele->term = 1;
-    enqueue(&replica.queue, ele);
+    ele->header = 0;
 
     if (exec_fn == NULL) {
         replica.exec_fn = default_exec_fn;
@@ -987,6 +1087,12 @@ void init_replica_raft(uint8_t id,
     init_stats(&replica.avg);
     replica.runs = 0;
 
+    if (replica.alg_below != ALG_NONE) {
+        com_layer_core_init(replica.alg_below, replica.id, replica.current_core,
+                            cores, replica.node_size,
+                            consensus_get_cmd_size(), replica.exec_fn);
+    }
+
 	if (id == replica.current_leader) {
 	   replica.is_leader = true;
 	   replica.is_follower = false;
@@ -17,20 +17,29 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sched.h>
+#include <smlt.h>
+#include <smlt_message.h>
 
 #include "consensus.h"
+#include "command.h"
+#include "client.h"
+#include "doorbell.h"
 #include "tpc_replica.h"
 #include "one_replica.h"
 #include "broadcast_replica.h"
 #include "chain_replica.h"
 #include "raft_replica.h"
 #include "shm_queue.h"
+#include "internal_com_layer.h"
 
 static __thread void (*exec_func)(void *);
 static __thread uint8_t algorithm;
 static __thread uint8_t lvl;
 static __thread uint8_t id_d;
 static __thread void (*msg_handler_loop_func)(void);
+// SHM on the node level
+static __thread cons_args_t* shm_args;
+static __thread struct smlt_msg* shm_msg;
 
 void set_execution_fn(void (*exec_fn)(void *))
 {
@@ -61,14 +70,102 @@ void set_execution_fn(void (*exec_fn)(void *))
     }
 }
 
+/*
+ * SHM on the node level: the replica with id 0 takes the requests of the
+ * clients and writes them to the queue, the other replicas read them.
+ * Every replica executes the commands and forwards them to its node.
+ */
+static void forward_shm(void* cmd, uint16_t len)
+{
+    if (shm_args->alg_below == ALG_NONE) {
+        return;
+    }
+
+    shm_msg->data[0] = 0;
+    set_cmd_len(shm_msg->data, len);
+    memcpy(&shm_msg->data[CONS_HDR_WORDS], cmd,
+           CONS_CMD_WORDS(CONS_CMD_BYTES(len))*sizeof(uintptr_t));
+    com_layer_core_send_request(shm_msg);
+}
+
+static void message_handler_loop_shm(void)
+{
+    errval_t err;
+    struct smlt_msg* msg = smlt_message_alloc(CONS_MSG_SIZE);
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
+    doorbell_loop_t loop;
+    doorbell_loop_init(&loop, shm_args->current_core, NULL, 0,
+                       shm_args->clients, shm_args->num_clients);
+    while (true) {
+        int client = doorbell_next(&loop, true);
+        if (client >= 0) {
+            err = smlt_recv(client, msg);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+
+            if (get_tag(msg->data) == SETUP_TAG) {
+                for (int i = 0; i < shm_args->num_clients; i++) {
+                    if (shm_args->clients[i] == client) {
+                        msg->data[4] = i;
+                    }
+                }
+            } else {
+                uint16_t len = get_cmd_len(msg->data);
+                shm_write_len(&msg->data[CONS_HDR_WORDS], len);
+                consensus_exec_cmd(exec_func, &msg->data[CONS_HDR_WORDS], len);
+                forward_shm(&msg->data[CONS_HDR_WORDS], len);
+                set_tag(msg->data, RESP_TAG);
+            }
+
+            err = doorbell_send(client, msg);
+            if (smlt_err_is_fail(err)) {
+                // TODO
+            }
+            idle_reset(&idle);
+        } else {
+            com_layer_core_poll();
+            doorbell_idle(&loop, &idle);
+        }
+    }
+}
+
+static void poll_and_forward_shm(void)
+{
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
+    while (true) {
+        void* cmd = shm_read();
+        if (cmd == NULL) {
+            com_layer_core_poll();
+            shm_idle(&idle);
+            continue;
+        }
+        idle_reset(&idle);
+        consensus_exec_cmd(exec_func, cmd, shm_cmd_len(cmd));
+        forward_shm(cmd, shm_cmd_len(cmd));
+    }
+}
+
 void* init_replica(void* arg)
 {
     cons_args_t* rep_args = (cons_args_t*) arg;
+    com_layer_enter_group(rep_args->group);
     exec_func = rep_args->exec_func;
     algorithm = rep_args->algo;
     lvl = rep_args->level;
     id_d = rep_args->id;
 
+    if ((rep_args->cmd_size == 0) || (rep_args->cmd_size > CONS_MAX_CMD_SIZE)) {
+        printf("init_replica: invalid command size %d \n", rep_args->cmd_size);
+        com_layer_replica_failed();
+        return NULL;
+    }
+
+    // the counts of all replicas are printed at the end
+    consensus_exec_count(com_layer_exec_counter(rep_args->current_core, lvl));
+
     switch (algorithm) {
         case ALG_TPC:
             init_replica_tpc(rep_args->id, rep_args->current_core,
@@ -113,20 +210,31 @@ void* init_replica(void* arg)
             msg_handler_loop_func = &message_handler_loop_raft;	
             break;
         case ALG_SHM:
-            // TODO remove hardcoded cmd size
             if (lvl == NODE_LEVEL) {
+                // replica 0 writes, the others read and forward to their node
+                shm_args = rep_args;
+                shm_msg = smlt_message_alloc(CONS_MSG_SIZE);
+                if ((rep_args->alg_below != ALG_NONE) &&
+                    (com_layer_core_init(rep_args->alg_below, rep_args->id,
+                                         rep_args->current_core, rep_args->cores,
+                                         rep_args->node_size, rep_args->cmd_size,
+                                         rep_args->exec_func) < 0)) {
+                    return NULL;
+                }
+
                 if (rep_args->id == 0) {
                     init_shm_writer(0, rep_args->current_core, 
-                                    rep_args->num_clients, rep_args->num_replicas, 
-                                    24, true, rep_args->shared_mem, rep_args->exec_func);	
+                                    rep_args->num_clients, rep_args->num_replicas-1, 
+                                    rep_args->cmd_size, true, rep_args->shared_mem, rep_args->exec_func);	
+                    msg_handler_loop_func = &message_handler_loop_shm;
                 } else {
-                    init_shm_reader(id_d, rep_args->current_core, 
-                                    rep_args->num_replicas, 24, true, 
+                    init_shm_reader(id_d-1, rep_args->current_core, 
+                                    rep_args->num_replicas-1, rep_args->cmd_size, true, 
                                     0, rep_args->shared_mem, rep_args->exec_func);	
                 }
             } else {
                 init_shm_reader(id_d, rep_args->current_core,
-                                rep_args->num_replicas, 24, false, rep_args->started_from,
+                                rep_args->num_replicas, rep_args->cmd_size, false, rep_args->started_from,
                                 rep_args->shared_mem, rep_args->exec_func);	
             }
            
@@ -141,6 +249,7 @@ void* init_replica(void* arg)
 #else
     uint32_t core = sched_getcpu();
 #endif
+    com_layer_replica_ready();
     if (lvl == NODE_LEVEL) {
         printf("Node Replica on core %d: ready \n", core);
 	} else {
@@ -157,7 +266,7 @@ void start_handler_loop(void)
             if (id_d == 0) {	
                 msg_handler_loop_func();
             } else {
-                poll_and_execute();	
+                poll_and_forward_shm();
             }
         } else {
             poll_and_execute();	
@@ -20,12 +20,29 @@
 #include <unistd.h>
 #include <sched.h>
 #include <inttypes.h>
+#include <numa.h>
+#include <sys/mman.h>
 
 #include "shm_queue.h"
 #include "client.h"
+#include "command.h"
 #include "incremental_stats.h"
+#include "idle.h"
 
-#define SHM_SIZE 4096
+#define CACHE_LINE_SIZE 64
+// every record starts with the sequence number and the record header
+#define SLOT_HDR_SIZE (2*sizeof(uint64_t))
+// readers publish their position every SHM_SYNC_MASK+1 commands
+#define SHM_SYNC_MASK 0xF
+
+/*
+ * Record header: length field of the command in the lower 16 bits,
+ * number of cache lines of the record from bit 32. A pad record fills
+ * the end of the ring if the next record does not fit.
+ */
+#define REC_LINES_SHIFT 32
+#define REC_LINES_MASK 0x7FFFFFFFULL
+#define REC_PAD (1ULL << 63)
 
 struct pos_pointer{
     uint64_t pos;
@@ -33,44 +50,171 @@ struct pos_pointer{
     uint8_t padding[56];
 };
 
-typedef struct shm_queue_t{	
+/*
+ * The queue is a ring of cache lines holding records of variable length.
+ * A record takes as many cache lines as its command needs. The writer
+ * stamps the first line of a record with a sequence number after writing
+ * the command, a reader waits for the line to carry the sequence number
+ * it expects next. Before publishing a record the writer clears the first
+ * word of the line after it, so a reader never sees a stale stamp where
+ * the next record starts.
+ * The readers only publish the number of lines they executed lazily and
+ * the writer only looks at them when it reaches the sync point i.e. the
+ * last line it knows is free.
+ */
+struct shm_queue_t{	
     uint8_t* shm;
     uint64_t shm_size;
-    struct pos_pointer* write_pos;
     struct pos_pointer* readers_pos;
+    // the readers park here, on its own line after the reader positions
+    idle_word_t* wake;
 
     // for which replica is this shared memory
     uint8_t replica_id;
     uint8_t shm_id;
     uint8_t num_readers;
     uint8_t num_cores;
-    uint64_t slot_size;
-    uint16_t num_slots;
+    // maximum size of a command in a record
+    uint64_t cmd_size;
+    uint32_t num_lines;
     bool node_level;
     void (*execute) (void* addr);
-} shm_queue_t;
 
-/* shared mutex/ memory */
-static pthread_mutex_t mutex;
-static bool init_done;
-static void* shm_buffer;
+    // local line, lines written/read in total and sequence number of
+    // the next command
+    uint32_t l_pos;
+    uint64_t head;
+    uint64_t next_seq;
+    // writer: number of lines that can be written in total without
+    // overwriting a command that is not yet executed by all readers
+    uint64_t next_sync;
+    // reader: last published position
+    uint64_t published;
+    // writer: number of times the queue was full
+    uint64_t stalls;
+};
 
-static __thread shm_queue_t shm_queue;
+/*
+ * Registry of the shared memory of the groups that did not get
+ * memory passed in, one entry per replica id
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static void* shm_groups[SHM_MAX_GROUPS];
+static uint64_t shm_size = SHM_SIZE;
+
+// queues used by the functions without a handle
+static __thread shm_queue_t* shm_writer;
+static __thread shm_queue_t* shm_reader;
+
+// lines of the ring, the start of the memory might not be aligned
+static uint32_t get_num_lines(uint64_t size, uint8_t num_readers)
+{
+    return (size - (CACHE_LINE_SIZE-1) -
+            (num_readers*sizeof(struct pos_pointer)))/CACHE_LINE_SIZE - 1;
+}
+
+static inline uint32_t record_lines(uint16_t bytes)
+{
+    return (SLOT_HDR_SIZE + bytes + CACHE_LINE_SIZE-1)/CACHE_LINE_SIZE;
+}
 
 /*
- * Sets up the memory layout starting from buf
+ * Sets up the memory layout starting from buf, the memory has to be zeroed
  */
-static void setup_memory(void* buf)
+static void setup_memory(shm_queue_t* q, void* buf)
 {
-    shm_queue.num_slots = ((SHM_SIZE-((shm_queue.num_readers+1)*sizeof(struct pos_pointer)))
-                           /shm_queue.slot_size) -1;
+    uintptr_t start = ((uintptr_t) buf + CACHE_LINE_SIZE-1) &
+                      ~((uintptr_t) CACHE_LINE_SIZE-1);
 
+    q->num_lines = get_num_lines(q->shm_size, q->num_readers);
 #ifdef DEBUG_SHM
-    shm_queue.num_slots = 10;
+    q->num_lines = 2*record_lines(q->cmd_size);
+#endif
+    q->readers_pos = (struct pos_pointer*) start;
+    q->wake = (idle_word_t*) (start+(q->num_readers*sizeof(struct pos_pointer)));
+    q->shm = (uint8_t*) q->wake + CACHE_LINE_SIZE;
+    q->l_pos = 0;
+    q->head = 0;
+    q->next_seq = 1;
+    q->next_sync = q->num_lines;
+    q->published = 0;
+    q->stalls = 0;
+}
+
+uint16_t shm_max_cmd_size(uint8_t num_readers)
+{
+    // a record and the pad before it have to fit into the ring
+    uint64_t lines = get_num_lines(shm_size, num_readers)/2;
+    if (lines < 1) {
+        return 0;
+    }
+
+    uint64_t max = lines*CACHE_LINE_SIZE - SLOT_HDR_SIZE;
+    return max > CONS_MAX_CMD_SIZE ? CONS_MAX_CMD_SIZE : max;
+}
+
+void set_shm_size(uint64_t size)
+{
+    shm_size = size;
+}
+
+uint64_t get_shm_size(void)
+{
+    return shm_size;
+}
+
+void* shm_alloc(uint8_t core)
+{
+    void* mem;
+    int node = numa_available() < 0 ? -1 : numa_node_of_cpu(core);
+    // round up to hugepages
+    uint64_t size = (shm_size + SHM_HUGEPAGE_SIZE-1) & ~((uint64_t) SHM_HUGEPAGE_SIZE-1);
+
+#ifdef MAP_HUGETLB
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        // place before first touch
+        if (node >= 0) {
+            numa_tonode_memory(mem, size, node);
+        }
+        memset(mem, 0, shm_size);
+        return mem;
+    }
 #endif
-    shm_queue.shm = (uint8_t*) buf+((shm_queue.num_readers+1)*sizeof(struct pos_pointer));
-    shm_queue.write_pos = (struct pos_pointer*) buf;
-    shm_queue.readers_pos = (struct pos_pointer*) buf+1;
+    // no hugepages available
+    if (node >= 0) {
+        mem = numa_alloc_onnode(shm_size, node);
+    } else {
+        mem = NULL;
+    }
+
+    if (mem == NULL) {
+        return calloc(1, shm_size);
+    }
+    memset(mem, 0, shm_size);
+    return mem;
+}
+
+uint64_t shm_queue_stalls(shm_queue_t* q)
+{
+    return q->stalls;
+}
+
+uint64_t shm_get_stalls(void)
+{
+    return shm_writer == NULL ? 0 : shm_queue_stalls(shm_writer);
+}
+
+void* shm_group_mem(uint8_t group, uint8_t core)
+{
+    pthread_mutex_lock(&mutex);
+    if (shm_groups[group] == NULL) {
+        shm_groups[group] = shm_alloc(core);
+    }
+    void* mem = shm_groups[group];
+    pthread_mutex_unlock(&mutex);
+    return mem;
 }
 
 static void default_exec_fn(void* addr);
@@ -79,98 +223,112 @@ static void default_exec_fn(void* addr)
     return;
 }
 
-void set_execution_fn_shm(void (*execute)(void * addr))
+void shm_queue_set_execution_fn(shm_queue_t* q, void (*execute)(void * addr))
 {
-    shm_queue.execute = execute;
+    q->execute = execute == NULL ? &default_exec_fn : execute;
 }
 
-
-void init_shm_writer(uint8_t replica_id, 
-        uint8_t current_core,
-        uint8_t num_clients,
-        uint8_t num_readers,
-        uint64_t slot_size,
-        bool node_level,	
-        void* shared_mem, 
-        void (*exec_fn)(void *))
+void set_execution_fn_shm(void (*execute)(void * addr))
 {
+    if (shm_reader != NULL) {
+        shm_queue_set_execution_fn(shm_reader, execute);
+    }
+}
 
-    shm_queue.replica_id = replica_id;
-    shm_queue.slot_size = slot_size;
-    shm_queue.num_readers = num_readers;
-    if (exec_fn == NULL) {
-        shm_queue.execute = &default_exec_fn;
-    } else {
-        shm_queue.execute = exec_fn;
+// the queue state is only touched by its thread, keep it local
+static shm_queue_t* queue_alloc(void)
+{
+    shm_queue_t* q = numa_alloc_local(sizeof(shm_queue_t));
+    if (q == NULL) {
+        q = malloc(sizeof(shm_queue_t));
     }
-    // -1 just to be sure
-    shm_queue.num_slots = ((SHM_SIZE-((num_readers+2)*sizeof(struct pos_pointer)))/slot_size) -1;
-#ifdef DEBUG_SHM
-    shm_queue.num_slots = 10;
-#endif
-#ifdef MEASURE_TP
-    tsc_per_ms = 2400000;
-#endif
+    memset(q, 0, sizeof(shm_queue_t));
+    return q;
+}
 
-    void* buf;
-    if (shared_mem != NULL) {
-        buf = shared_mem;
-    } else {
 
-        pthread_mutex_lock(&mutex);
-        if (!init_done) {
-            shm_buffer = malloc(SHM_SIZE);
-            init_done = true;
-        }
-        pthread_mutex_unlock(&mutex);         
-        buf = shm_buffer;
+shm_queue_t* shm_writer_create(uint8_t replica_id,
+                               uint8_t current_core,
+                               uint8_t num_readers,
+                               uint64_t cmd_size,
+                               bool node_level,
+                               void* shared_mem,
+                               void (*exec_fn)(void *))
+{
+    shm_queue_t* q = queue_alloc();
+    q->replica_id = replica_id;
+    q->cmd_size = cmd_size;
+    q->shm_size = shm_size;
+    q->num_readers = num_readers;
+    q->node_level = node_level;
+    shm_queue_set_execution_fn(q, exec_fn);
+
+    void* buf = shared_mem;
+    if (buf == NULL) {
+        buf = shm_group_mem(replica_id, current_core);
     }
-
-    setup_memory(buf);
-    shm_queue.write_pos[0].pos = 0;
+    setup_memory(q, buf);
     if (node_level) {
         // TODO periodic event for measuring TP
     }
 
     printf("Writer on core %d: mapped at %p \n", current_core, buf);
     // TODO setup client stuff
+    return q;
+}
+
+shm_queue_t* shm_reader_create(uint8_t id,
+                               uint8_t current_core,
+                               uint8_t num_readers,
+                               uint64_t cmd_size,
+                               bool node_level,
+                               uint8_t replica_id,
+                               void* shared_mem,
+                               void (*exec_fn)(void* addr))
+{
+    shm_queue_t* q = queue_alloc();
+    q->replica_id = replica_id;
+    q->num_readers = num_readers;
+    q->cmd_size = cmd_size;
+    q->shm_size = shm_size;
+    q->node_level = node_level;
+    q->shm_id = id;
+    shm_queue_set_execution_fn(q, exec_fn);
+
+    void* buf = shared_mem;
+    if (buf == NULL) {
+        buf = shm_group_mem(replica_id, current_core);
+    }
+    setup_memory(q, buf);
+    printf("Reader on core %d: mapped at %p \n", current_core, buf);
+    return q;
+}
+
+void init_shm_writer(uint8_t replica_id, 
+        uint8_t current_core,
+        uint8_t num_clients,
+        uint8_t num_readers,
+        uint64_t cmd_size,
+        bool node_level,	
+        void* shared_mem, 
+        void (*exec_fn)(void *))
+{
+    shm_writer = shm_writer_create(replica_id, current_core, num_readers,
+                                   cmd_size, node_level, shared_mem, exec_fn);
 }
 
 void init_shm_reader(uint8_t id, 
                      uint8_t current_core,
                      uint8_t num_readers,
-                     uint64_t slot_size,
+                     uint64_t cmd_size,
                      bool node_level,
                      uint8_t started_from,
                      void* shared_mem, 
                      void (*exec_fn)(void* addr))
 {
-    shm_queue.replica_id = started_from;
-    shm_queue.num_readers = num_readers;
-    shm_queue.slot_size = slot_size;
-    shm_queue.node_level = node_level;
-    shm_queue.shm_id = id;
-    if (exec_fn != NULL) {
-        shm_queue.execute = exec_fn;
-    } else {
-        shm_queue.execute = &default_exec_fn;
-    }
-
-    void* buf;
-    if (shared_mem != NULL) {
-        buf = shared_mem;
-    } else {
-
-        pthread_mutex_lock(&mutex);
-        if (!init_done) {
-            shm_buffer = malloc(SHM_SIZE);
-            init_done = true;
-        }
-        pthread_mutex_unlock(&mutex);
-        buf = shm_buffer;
-    }
-    setup_memory(buf);
-    printf("Reader on core %d: mapped at %p \n", current_core, buf);
+    shm_reader = shm_reader_create(id, current_core, num_readers, cmd_size,
+                                   node_level, started_from, shared_mem,
+                                   exec_fn);
     // TODO SET AFFINITY
 #ifndef BARRELFISH
     cpu_set_t set;
@@ -180,16 +338,23 @@ void init_shm_reader(uint8_t id,
 #endif
 }
 
-static bool check_readers_end(void)
+static inline uint64_t* get_line(shm_queue_t* q, uint32_t pos)
 {
-    for (int i = 0; i < shm_queue.num_readers; i++) {
-        if (shm_queue.readers_pos[i].pos == 0) {
+    return (uint64_t*) (q->shm + (pos*CACHE_LINE_SIZE));
+}
 
-        } else {
-            return false;
+// the lines up to the slowest reader plus the size of the ring are free
+static uint64_t get_next_sync(shm_queue_t* q)
+{
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < q->num_readers; i++) {
+        uint64_t pos = __atomic_load_n(&q->readers_pos[i].pos,
+                                       __ATOMIC_ACQUIRE);
+        if (pos < min) {
+            min = pos;
         }
     }	
-    return true;    
+    return min + q->num_lines;
 }
 
 
@@ -203,64 +368,184 @@ struct command {
 // only single writer no need to lock
 void shm_write(void* addr)
 {
-    // if we reached the end sync with readers
-    if ((shm_queue.write_pos[0].pos) == 0) {
-        while(!check_readers_end()){};
+    shm_write_len(addr, shm_writer->cmd_size);
+}
+
+void shm_write_len(void* addr, uint16_t len)
+{
+    shm_queue_write(shm_writer, addr, len);
+}
+
+/*
+ * Publishes the record at the current line and moves on by lines
+ */
+static void publish_record(shm_queue_t* q, uint64_t hdr, uint32_t lines)
+{
+    uint64_t* line = get_line(q, q->l_pos);
+    line[1] = hdr;
+
+    q->l_pos += lines;
+    if (q->l_pos == q->num_lines) {
+        q->l_pos = 0;
+    }
+    q->head += lines;
+
+    // clear the stamp of the next record, then publish this one
+    get_line(q, q->l_pos)[0] = 0;
+    __atomic_store_n(&line[0], q->next_seq, __ATOMIC_RELEASE);
+    q->next_seq++;
+}
+
+int shm_queue_write(shm_queue_t* q, void* addr, uint16_t len)
+{
+    // the length field is stored as is, handles are copied like commands
+    uint16_t bytes = CONS_CMD_BYTES(len);
+    if (bytes > q->cmd_size) {
+        // the negotiated command size covers every command, readers
+        // would get less than the length says
+        printf("Shm queue: command of %d bytes larger than %"PRIu64" \n",
+               bytes, q->cmd_size);
+        return -1;
+    }
+
+    uint32_t lines = record_lines(bytes);
+    uint32_t pad = 0;
+    if ((q->l_pos + lines) > q->num_lines) {
+        pad = q->num_lines - q->l_pos;
+    }
+
+    // the record, the pad and the line that is cleared have to be free
+    uint64_t end = q->head + pad + lines + 1;
+    if (end > q->next_sync) {
+        q->next_sync = get_next_sync(q);
+        if (end > q->next_sync) {
+            q->stalls++;
+        }
+    }
+
+    while (end > q->next_sync) {
+        q->next_sync = get_next_sync(q);
 #ifdef DEBUG_SHM
         printf("#################################################### \n");
-        printf("Synced \n");
+        printf("Synced next sync %"PRIu64" \n", q->next_sync);
         printf("#################################################### \n");
 #endif
     }
 
-    memcpy((shm_queue.shm+ (shm_queue.write_pos[0].pos*shm_queue.slot_size)), 
-            addr, shm_queue.slot_size);
+    if (pad > 0) {
+        publish_record(q, REC_PAD | ((uint64_t) pad << REC_LINES_SHIFT), pad);
+    }
+
+    uint64_t* line = get_line(q, q->l_pos);
+    memcpy(&line[2], addr, bytes);
 #ifdef DEBUG_SHM
     uint64_t* val = addr;
-    printf("Shm writer %d: write pos %"PRIu64" val %"PRIu64" addr %p \n",
-            sched_getcpu(), shm_queue.write_pos[0].pos, *val,
-            shm_queue.shm +(shm_queue.write_pos[0].pos*shm_queue.slot_size));
+    printf("Shm writer %d: write pos %d seq %"PRIu64" val %"PRIu64" addr %p \n",
+            sched_getcpu(), q->l_pos, q->next_seq, *val, line);
 #endif
 
-    // avoid undefined behaviour warning ..
-    uint64_t pos = shm_queue.write_pos[0].pos+1;
-    pos = pos % shm_queue.num_slots;
-    shm_queue.write_pos[0].pos = pos;
+    publish_record(q, ((uint64_t) lines << REC_LINES_SHIFT) | len, lines);
+    idle_wake(q->wake);
+    return 0;
 }
 
+static inline void publish_pos(shm_queue_t* q, uint64_t pos)
+{
+    if (q->published != pos) {
+        __atomic_store_n(&q->readers_pos[q->shm_id].pos, pos,
+                         __ATOMIC_RELEASE);
+        q->published = pos;
+    }
+}
 
-// returns NULL if reader reached writers pos
-void* shm_read(void)
+/*
+ * returns NULL if reader reached writers pos. The command returned
+ * before is executed once shm_queue_read() is called again.
+ */
+void* shm_queue_read(shm_queue_t* q)
 {
-    void* ret_val = 0;
-    ret_val = shm_queue.shm + 
-        ((shm_queue.readers_pos[shm_queue.shm_id].pos)*shm_queue.slot_size);
-    if (shm_queue.readers_pos[shm_queue.shm_id].pos == shm_queue.write_pos[0].pos) {
-        return NULL;
-    } else {
+    uint64_t* line;
+    uint64_t seq;
+    uint64_t hdr;
+    while (true) {
+        line = get_line(q, q->l_pos);
+        seq = __atomic_load_n(&line[0], __ATOMIC_ACQUIRE);
+        if (seq != q->next_seq) {
+            // nothing to do, let the writer know how far we are
+            publish_pos(q, q->head);
+            return NULL;
+        }
+
+        hdr = line[1];
+        if (!(hdr & REC_PAD)) {
+            break;
+        }
+
+        // skip to the start of the ring
+        q->next_seq++;
+        q->head += q->num_lines - q->l_pos;
+        q->l_pos = 0;
+    }
+
 #ifdef DEBUG_SHM
-        printf("Shm %d: read pos %"PRIu64" val %"PRIu64" ret_val %p \n", sched_getcpu(),
-                shm_queue.readers_pos[shm_queue.shm_id].pos,
-                *((uint64_t *) ret_val) ,ret_val);
+    printf("Shm %d: read pos %d seq %"PRIu64" val %"PRIu64" \n", sched_getcpu(),
+            q->l_pos, seq, line[2]);
 #endif
-        uint64_t pos = shm_queue.readers_pos[shm_queue.shm_id].pos+1;
-        pos = pos % shm_queue.num_slots;
-        shm_queue.readers_pos[shm_queue.shm_id].pos = pos;
+    if ((seq & SHM_SYNC_MASK) == 0) {
+        publish_pos(q, q->head);
+    }
 
-        return ret_val;
+    uint32_t lines = (hdr >> REC_LINES_SHIFT) & REC_LINES_MASK;
+    q->next_seq++;
+    q->head += lines;
+    q->l_pos += lines;
+    if (q->l_pos == q->num_lines) {
+        q->l_pos = 0;
     }
+    return &line[2];
 }
 
-void poll_and_execute(void)
+void* shm_read(void)
+{
+    return shm_queue_read(shm_reader);
+}
+
+uint16_t shm_cmd_len(void* cmd)
+{
+    return (uint16_t) ((uint64_t*) cmd)[-1];
+}
+
+// a record or a pad is published at the line of the reader
+static bool can_read(void* arg)
+{
+    shm_queue_t* q = (shm_queue_t*) arg;
+    uint64_t* line = get_line(q, q->l_pos);
+    return __atomic_load_n(&line[0], __ATOMIC_ACQUIRE) == q->next_seq;
+}
+
+void shm_queue_idle(shm_queue_t* q, idle_state_t* idle)
+{
+    idle_backoff(idle, q->wake, can_read, q);
+}
+
+void shm_idle(idle_state_t* idle)
+{
+    shm_queue_idle(shm_reader, idle);
+}
+
+void shm_queue_poll_and_execute(shm_queue_t* q)
 {   
+    idle_state_t idle;
+    idle_init(&idle, NULL);
     while(true) {
         void* cmd = NULL;
         while (cmd == NULL) {
-            cmd = shm_read();
+            cmd = shm_queue_read(q);
             if (cmd == NULL) {
-                // thread_yield();
+                shm_queue_idle(q, &idle);
             } else {
-                shm_queue.execute(cmd);
+                idle_reset(&idle);
+                consensus_exec_cmd(q->execute, cmd, shm_cmd_len(cmd));
 #ifdef DEBUG_SHM
      //           printf("Shm %d: read %"PRIu64" \n", sched_getcpu(), ((struct command *) cmd)->arg1);
 #endif
@@ -269,4 +554,7 @@ void poll_and_execute(void)
     }
 }
 
-
+void poll_and_execute(void)
+{
+    shm_queue_poll_and_execute(shm_reader);
+}
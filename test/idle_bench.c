@@ -0,0 +1,182 @@
+/**
+ * \brief Wake-up latency and CPU use of the idle policies
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "consensus.h"
+#include "shm_queue.h"
+#include "command.h"
+#include "incremental_stats.h"
+
+/*
+ * A writer sends a timestamped command through the shared memory queue
+ * every gap us, a reader waits for it with the idle policy under test.
+ * For every policy the time from the write until the reader sees the
+ * command and the CPU time the reader used are printed.
+ *
+ * usage: ./idle_bench [num_writes] [gap_us] [spin] [pause]
+ */
+
+#define NUM_POLICIES 3
+
+static uint64_t num_writes = 2000;
+static long gap_us = 500;
+static uint32_t spin = CONS_IDLE_SPIN_ROUNDS;
+static uint32_t pause_rounds = CONS_IDLE_PAUSE_ROUNDS;
+static int num_cpus;
+
+static const char* policy_names[NUM_POLICIES] = {"spin", "pause", "park"};
+
+struct result {
+    incr_stats latency;
+    double cpu;
+    double wall;
+    uint64_t parks;
+};
+
+struct thr_arg {
+    uint8_t policy;
+    struct result res;
+};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void pin(int core)
+{
+    cpu_set_t cpu_mask;
+    CPU_ZERO(&cpu_mask);
+    CPU_SET(core % num_cpus, &cpu_mask);
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask);
+}
+
+static double thread_cpu_time(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+static void* thr_reader(void* arg)
+{
+    struct thr_arg* a = (struct thr_arg*) arg;
+    pin(1);
+
+    shm_queue_t* q = shm_reader_create(0, 1 % num_cpus, 1, sizeof(uint64_t)*2,
+                                       false, a->policy, NULL, NULL);
+    idle_state_t idle;
+    idle_init(&idle, NULL);
+    init_stats(&a->res.latency);
+
+    double start = get_time();
+    double cpu = thread_cpu_time();
+    uint64_t seq = 1;
+    while (seq <= num_writes) {
+        double* cmd = shm_queue_read(q);
+        if (cmd == NULL) {
+            shm_queue_idle(q, &idle);
+            continue;
+        }
+        add(&a->res.latency, (get_time() - cmd[0])*1e6);
+        idle_reset(&idle);
+        seq++;
+    }
+    a->res.cpu = thread_cpu_time() - cpu;
+    a->res.wall = get_time() - start;
+    a->res.parks = idle.parks;
+    return 0;
+}
+
+static void run(struct thr_arg* a)
+{
+    pthread_t tid;
+    consensus_set_idle_policy(a->policy, spin, pause_rounds);
+    pin(0);
+
+    // the reader maps the memory of the group from the registry
+    shm_queue_t* q = shm_writer_create(a->policy, 0, 1, sizeof(uint64_t)*2,
+                                       false, NULL, NULL);
+    pthread_create(&tid, NULL, thr_reader, a);
+
+    struct timespec gap;
+    gap.tv_sec = gap_us / 1000000;
+    gap.tv_nsec = (gap_us % 1000000) * 1000;
+    double cmd[2];
+    for (uint64_t seq = 1; seq <= num_writes; seq++) {
+        nanosleep(&gap, NULL);
+        cmd[0] = get_time();
+        cmd[1] = seq;
+        shm_queue_write(q, cmd, sizeof(cmd));
+    }
+    pthread_join(tid, NULL);
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1) {
+        num_writes = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        gap_us = atol(argv[2]);
+    }
+    if (argc > 3) {
+        spin = atol(argv[3]);
+    }
+    if (argc > 4) {
+        pause_rounds = atol(argv[4]);
+    }
+
+    if ((num_writes < 1) || (gap_us < 0)) {
+        printf("usage: %s [num_writes (>= 1)] [gap_us] [spin] [pause] \n",
+               argv[0]);
+        return 1;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Idle bench started: %"PRIu64" writes, %ld us apart, spin %u "
+           "pause %u, %d cpus \n", num_writes, gap_us, spin, pause_rounds,
+           num_cpus);
+
+    struct thr_arg args[NUM_POLICIES];
+    for (int i = 0; i < NUM_POLICIES; i++) {
+        memset(&args[i], 0, sizeof(struct thr_arg));
+        args[i].policy = i;
+        run(&args[i]);
+    }
+
+    printf("###################################################\n");
+    printf("%-6s %10s %10s %10s %10s %8s %10s \n", "policy", "avg_us",
+           "min_us", "max_us", "std_us", "cpu_%", "parks");
+    for (int i = 0; i < NUM_POLICIES; i++) {
+        struct result* r = &args[i].res;
+        printf("%-6s %10.3f %10.3f %10.3f %10.3f %8.2f %10"PRIu64" \n",
+               policy_names[i], get_avg(&r->latency), get_min(&r->latency),
+               get_max(&r->latency), get_std_dev(&r->latency),
+               100*r->cpu/r->wall, r->parks);
+    }
+    printf("###################################################\n");
+    return 0;
+}
@@ -0,0 +1,213 @@
+/**
+ * \brief Retries of the lock-free KVS reads under contention
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "kvs_table.h"
+#include "kvs_slab.h"
+
+/*
+ * Every thread runs the mix of the KVS benchmark clients on a few hot
+ * keys: 2 sets followed by 8 gets. The sets are applied one at a time
+ * like a replica applies the log, they copy the value to a slab chunk
+ * and free the chunk of the value they replace. The gets copy the values
+ * without a lock. Every word of a value is the same stamp, so a get that
+ * returns a torn value is detected. For every thread the gets, the copies
+ * that were retried and the torn values are printed.
+ *
+ * usage: ./kvs_seqlock_bench [num_threads] [seconds] [value_size] [num_keys]
+ */
+
+#define MAX_THREADS 64
+
+static int num_threads = 4;
+static int seconds = 2;
+static uint16_t value_size = 64;
+static uint64_t num_keys = 50;
+static int num_cpus;
+
+static kvs_table_t* table;
+static kvs_slab_t* slab;
+static pthread_spinlock_t apply_lock;
+static uint64_t log_index;
+static bool stop;
+
+struct thr_arg {
+    int id;
+    uint64_t sets;
+    uint64_t gets;
+    uint64_t retries;
+    uint64_t torn;
+};
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void pin(int core)
+{
+    cpu_set_t cpu_mask;
+    CPU_ZERO(&cpu_mask);
+    CPU_SET(core % num_cpus, &cpu_mask);
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask);
+}
+
+// same as the replicas apply a set
+static void apply_set(uint64_t key, void* val, uint16_t len)
+{
+    pthread_spin_lock(&apply_lock);
+    void* chunk = kvs_slab_alloc(slab, len);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(chunk, val, len);
+
+    // no snapshots are read, the replaced version is dropped
+    uint64_t freed[KVS_VERSIONS];
+    int num_freed;
+    log_index++;
+    kvs_table_set(table, key, KVS_REF(chunk, len), log_index, log_index, freed,
+                  &num_freed);
+    for (int i = 0; i < num_freed; i++) {
+        kvs_slab_free(slab, KVS_REF_PTR(freed[i]), KVS_REF_LEN(freed[i]));
+    }
+    pthread_spin_unlock(&apply_lock);
+}
+
+static bool value_torn(uint64_t* val, uint16_t len)
+{
+    for (int i = 1; i < len/sizeof(uint64_t); i++) {
+        if (val[i] != val[0]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* thr_client(void* arg)
+{
+    struct thr_arg* a = (struct thr_arg*) arg;
+    pin(a->id);
+
+    uint64_t val[value_size/sizeof(uint64_t)];
+    unsigned int seed = a->id;
+    uint64_t stamp = (uint64_t) a->id << 48;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        uint64_t key = rand_r(&seed) % num_keys;
+        for (int i = 0; i < 2; i++) {
+            stamp++;
+            for (int w = 0; w < value_size/sizeof(uint64_t); w++) {
+                val[w] = stamp;
+            }
+            apply_set(key, val, value_size);
+            a->sets++;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            uint16_t len = kvs_table_read(table, rand_r(&seed) % num_keys,
+                                          val, value_size, &a->retries);
+            if ((len != value_size) || value_torn(val, len)) {
+                a->torn++;
+            }
+            a->gets++;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1) {
+        num_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        value_size = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        num_keys = strtoull(argv[4], NULL, 10);
+    }
+
+    if ((num_threads < 1) || (num_threads > MAX_THREADS) || (seconds < 1) ||
+        (value_size < 16) || (value_size > 4096) || (value_size % 8) ||
+        (num_keys < 1)) {
+        printf("usage: %s [num_threads (1-%d)] [seconds] [value_size (16-4096, "
+               "multiple of 8)] [num_keys] \n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("KVS seqlock bench started: %d threads, %d s, %d byte values, "
+           "%"PRIu64" keys, %d cpus \n", num_threads, seconds, value_size,
+           num_keys, num_cpus);
+
+    table = kvs_table_create(KVS_TABLE_INIT_ENTRIES);
+    slab = kvs_slab_create();
+    pthread_spin_init(&apply_lock, PTHREAD_PROCESS_PRIVATE);
+    // every key is set before the gets start
+    uint64_t val[value_size/sizeof(uint64_t)];
+    memset(val, 0, sizeof(val));
+    for (uint64_t k = 0; k < num_keys; k++) {
+        apply_set(k, val, value_size);
+    }
+
+    pthread_t tids[MAX_THREADS];
+    struct thr_arg args[MAX_THREADS];
+    double start = get_time();
+    for (int i = 0; i < num_threads; i++) {
+        memset(&args[i], 0, sizeof(struct thr_arg));
+        args[i].id = i;
+        pthread_create(&tids[i], NULL, thr_client, &args[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double end = get_time();
+
+    uint64_t gets = 0;
+    uint64_t retries = 0;
+    uint64_t torn = 0;
+    printf("###################################################\n");
+    printf("%-6s %12s %12s %12s %10s %8s \n", "thread", "sets", "gets",
+           "retries", "retry_%", "torn");
+    for (int i = 0; i < num_threads; i++) {
+        struct thr_arg* a = &args[i];
+        printf("%-6d %12"PRIu64" %12"PRIu64" %12"PRIu64" %10.4f %8"PRIu64" \n",
+               a->id, a->sets, a->gets, a->retries,
+               100.0*a->retries/a->gets, a->torn);
+        gets += a->gets;
+        retries += a->retries;
+        torn += a->torn;
+    }
+    printf("Total: %10.3f Mgets/s, %10.4f %% retried, %"PRIu64" torn \n",
+           gets/((end - start)*1e6), 100.0*retries/gets, torn);
+    if (torn > 0) {
+        printf("KVS seqlock: Test Failed \n");
+    } else {
+        printf("KVS seqlock: Test Succeeded \n");
+    }
+    printf("###################################################\n");
+    return (torn > 0);
+}
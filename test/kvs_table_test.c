@@ -0,0 +1,242 @@
+/**
+ * \brief Testing the hash table of the KVS replicas
+ */
+
+/*
+ * Copyright (c) 2015, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, CAB F.78, Universitaetstr. 6, CH-8092 Zurich,
+ * Attn: Systems Group.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "kvs_table.h"
+#include "kvs_slab.h"
+
+/*
+ * A writer sets sparse 64-bit keys in two tables that start small, so
+ * they grow several times, and updates every key once more. A reader
+ * checks concurrently that every key the writer finished is found with
+ * one of its references. At the end both tables have to hold all keys with
+ * the last reference and the same layout, as the replicas would. The
+ * versions of a single key are checked at several log indices.
+ *
+ * usage: ./kvs_table_test [num_keys] [init_entries]
+ */
+
+static uint64_t num_keys = 1000000;
+static uint64_t init_entries = 64;
+static kvs_table_t* tables[2];
+// keys the writer finished in the first round
+static uint64_t num_done;
+static uint64_t num_wrong;
+
+// sparse keys, both extremes included
+static uint64_t test_key(uint64_t i)
+{
+    if (i == 0) {
+        return 0;
+    } else if (i == 1) {
+        return KVS_MAX_KEY;
+    }
+    return i * 0x9E3779B97F4A7C15ULL;
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// references are never 0
+static uint64_t test_ref(uint64_t i)
+{
+    return i + 1;
+}
+
+static void* thr_reader(void* arg)
+{
+    uint64_t i = 0;
+    while (i < num_keys) {
+        uint64_t done = __atomic_load_n(&num_done, __ATOMIC_ACQUIRE);
+        if (i >= done) {
+            continue;
+        }
+
+        // the first or the second round wrote it
+        uint64_t ref = kvs_table_get(tables[0], test_key(i));
+        if ((ref != test_ref(i)) && (ref != test_ref(i+num_keys))) {
+            num_wrong++;
+        }
+        i = (i + 7919) % done;
+        if (i == 0) {
+            i = done;
+        }
+    }
+    return 0;
+}
+
+// no snapshots are read, a set drops the version it replaces
+static bool set_newest(kvs_table_t* t, uint64_t key, uint64_t ref,
+                       uint64_t* old)
+{
+    uint64_t freed[KVS_VERSIONS];
+    int num_freed;
+    bool ret = kvs_table_set(t, key, ref, ref, ref, freed, &num_freed);
+    *old = (num_freed > 0) ? freed[0] : 0;
+    return ret && (num_freed <= 1);
+}
+
+static void set_all(uint64_t offset)
+{
+    uint64_t old;
+    for (uint64_t i = 0; i < num_keys; i++) {
+        for (int t = 0; t < 2; t++) {
+            // the second round replaces the reference of the first
+            if (!set_newest(tables[t], test_key(i), test_ref(i+offset), &old) ||
+                (old != (offset ? test_ref(i) : 0))) {
+                num_wrong++;
+            }
+        }
+        if (offset == 0) {
+            __atomic_store_n(&num_done, i+1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static bool same_layout(void)
+{
+    // let the migration of a growth finish on both
+    uint64_t old;
+    while ((tables[0]->old != NULL) || (tables[1]->old != NULL)) {
+        for (int t = 0; t < 2; t++) {
+            set_newest(tables[t], test_key(0), test_ref(num_keys), &old);
+        }
+    }
+
+    struct kvs_table_mem* m0 = tables[0]->tab;
+    struct kvs_table_mem* m1 = tables[1]->tab;
+    return (m0->num_buckets == m1->num_buckets) &&
+           (memcmp(m0->buckets, m1->buckets,
+                   m0->num_buckets*sizeof(kvs_bucket_t)) == 0);
+}
+
+// sets the key at index, the value is the index
+static int set_version(kvs_table_t* t, uint64_t* vals, uint64_t index,
+                       uint64_t bound)
+{
+    uint64_t freed[KVS_VERSIONS];
+    int num_freed;
+    vals[index] = index;
+    kvs_table_set(t, 1, KVS_REF(&vals[index], sizeof(uint64_t)), index, bound,
+                  freed, &num_freed);
+    return num_freed;
+}
+
+// returns the index of the version read at index, 0 or KVS_TOO_OLD
+static int64_t read_version(kvs_table_t* t, uint64_t index)
+{
+    uint64_t val;
+    uint64_t retries = 0;
+    int len = kvs_table_read_at(t, 1, index, &val, sizeof(val), &retries);
+    return (len == sizeof(val)) ? (int64_t) val : len;
+}
+
+static bool check_versions(void)
+{
+    static uint64_t vals[64];
+    kvs_table_t* t = kvs_table_create(init_entries);
+    bool ok = true;
+
+    // a snapshot at 0 keeps all versions up to KVS_VERSIONS
+    for (uint64_t i = 1; i <= KVS_VERSIONS; i++) {
+        ok &= (set_version(t, vals, 10*i, 0) == 0);
+    }
+    ok &= (read_version(t, 5) == 0);
+    ok &= (read_version(t, 10) == 10);
+    ok &= (read_version(t, 25) == 20);
+    ok &= (read_version(t, UINT64_MAX) == 10*KVS_VERSIONS);
+
+    // one more version drops the oldest one
+    ok &= (set_version(t, vals, 10*(KVS_VERSIONS+1), 0) == 1);
+    ok &= (read_version(t, 15) == KVS_TOO_OLD);
+    ok &= (read_version(t, 20) == 20);
+
+    // versions older than the newest one at the bound are dropped
+    ok &= (set_version(t, vals, 10*(KVS_VERSIONS+2), 10*KVS_VERSIONS + 5) ==
+           KVS_VERSIONS - 2);
+    ok &= (read_version(t, 10*KVS_VERSIONS + 5) == 10*KVS_VERSIONS);
+    ok &= (read_version(t, 10*KVS_VERSIONS - 5) == KVS_TOO_OLD);
+    ok &= (read_version(t, UINT64_MAX) == 10*(KVS_VERSIONS+2));
+    return ok;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1) {
+        num_keys = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        init_entries = strtoull(argv[2], NULL, 10);
+    }
+
+    if (num_keys < 2) {
+        printf("usage: %s [num_keys (>= 2)] [init_entries] \n", argv[0]);
+        return 1;
+    }
+
+    printf("KVS table test started: %"PRIu64" keys, %"PRIu64" initial "
+           "entries \n", num_keys, init_entries);
+    for (int t = 0; t < 2; t++) {
+        tables[t] = kvs_table_create(init_entries);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, thr_reader, NULL);
+    double start = get_time();
+    set_all(0);
+    pthread_join(tid, NULL);
+    set_all(num_keys);
+    double end = get_time();
+
+    uint64_t old;
+    for (uint64_t i = 0; i < num_keys; i++) {
+        if (kvs_table_get(tables[0], test_key(i)) != test_ref(i+num_keys)) {
+            num_wrong++;
+        }
+    }
+    if ((kvs_table_get(tables[0], UINT64_MAX) != 0) ||
+        set_newest(tables[0], UINT64_MAX, 1, &old)) {
+        num_wrong++;
+    }
+    if (kvs_table_count(tables[0]) != num_keys) {
+        num_wrong++;
+    }
+    bool layout = same_layout();
+    if (!check_versions()) {
+        num_wrong++;
+    }
+
+    printf("###################################################\n");
+    printf("Writer: %"PRIu64" sets in %10.3f s, %10.3f Msets/s, %"PRIu64" "
+           "buckets \n", 4*num_keys, end - start,
+           4*num_keys/((end - start)*1e6), tables[0]->tab->num_buckets);
+    if ((num_wrong > 0) || !layout) {
+        printf("KVS table: Test Failed (%"PRIu64" wrong, layout %s) \n",
+               num_wrong, layout ? "same" : "differs");
+    } else {
+        printf("KVS table: Test Succeeded \n");
+    }
+    printf("###################################################\n");
+    return ((num_wrong > 0) || !layout);
+}
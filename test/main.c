@@ -18,126 +18,124 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <sched.h>
-#include "shm/shm_queue.h"
-#include "common/incremental_stats.h"
+#include <time.h>
+#include "shm_queue.h"
+#include "command.h"
 
-#define SHM_SIZE 4096
-#define NUM_WRITES 1000000
+/*
+ * Stress and throughput test of the shared memory queue used for ALG_SHM.
+ * Every group has one writer and multiple readers, the commands have a
+ * varying length and every reader checks the order, the length and the
+ * content. The groups run at the same time, each on its own memory
+ * from the registry.
+ *
+ * usage: ./shm_test [num_readers] [num_writes] [cmd_size] [shm_size]
+ *                   [num_groups]
+ *
+ * run_shm_size_sweep.sh runs it with increasing sizes of the queue.
+ */
+
+#define MAX_READERS 32
+#define MAX_GROUPS 8
 
-int num_readers = 6;
-int sleep_time = 0;
-void* shared_mem;
+static int num_readers = 3;
+static int num_groups = 1;
+static uint64_t num_writes = 1000000;
+static uint16_t cmd_size = CONS_DEFAULT_CMD_SIZE;
+static int num_cpus;
+static uint64_t num_wrong[MAX_GROUPS][MAX_READERS];
 
-typedef struct cmd_t {
-    uint64_t val1;
-    uint64_t val2;
-    uint64_t val3; 
-}cmd_t;
+struct thr_arg {
+    uint8_t group;
+    uint8_t id;
+};
 
-void exec_fn(void* arg)
+// 8 to cmd_size bytes, depending on the sequence number
+static uint16_t cmd_len(uint64_t seq)
 {
-    return;   
+    uint16_t len = (1 + (seq % CONS_CMD_WORDS(cmd_size)))*sizeof(uint64_t);
+    return len > cmd_size ? cmd_size : len;
 }
 
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
 
-void* thr_writer(void* arg)
+static uint8_t thr_core(struct thr_arg* a)
 {
-    cpu_set_t cpu_mask;
+    return (a->group*(num_readers+1) + a->id) % num_cpus;
+}
 
+static void* thr_writer(void* arg)
+{
+    struct thr_arg* a = (struct thr_arg*) arg;
+    cpu_set_t cpu_mask;
     CPU_ZERO(&cpu_mask);
-    CPU_SET(0, &cpu_mask);
-
+    CPU_SET(thr_core(a), &cpu_mask);
     sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask);
 
-    init_shm_writer(0,
-                    (uint64_t) arg,
-                    0,
-                    num_readers,
-                    sizeof(cmd_t),
-                    false,
-                    //shared_mem,
-                    NULL,
-                    exec_fn);
-    
-    uint64_t rid = 1;
-    cmd_t* cmd = malloc(sizeof(cmd_t));
-    cmd->val1 = rid;
-    cmd->val2 = rid;
-    cmd->val3 = rid;
-
-    uint64_t start;
-    uint64_t end;
-    uint64_t total;
-    printf("###################################################\n");
-    printf("Testing %d writes/reads \n", NUM_WRITES);
-    printf("###################################################\n");
-    while (true) {
-         start = rdtsc();
-         shm_write(cmd);
-         end = rdtsc();
-         total += end-start;
-         rid++;
-         cmd->val1 = rid;
-         cmd->val2 = rid;
-         cmd->val3 = rid;
-         sleep(sleep_time);
-         if (rid == (NUM_WRITES+1)) {
-            break;
-         }
+    shm_queue_t* q = shm_writer_create(a->group, thr_core(a), num_readers,
+                                       cmd_size, false, NULL, NULL);
+
+    uint64_t cmd[CONS_CMD_WORDS(CONS_MAX_CMD_SIZE)];
+    double start = get_time();
+    for (uint64_t seq = 1; seq <= num_writes; seq++) {
+        uint16_t len = cmd_len(seq);
+        for (int i = 0; i < CONS_CMD_WORDS(len); i++) {
+            cmd[i] = seq+i;
+        }
+        shm_queue_write(q, cmd, len);
     }
+    double total = get_time() - start;
 
-    while(true){};
+    printf("###################################################\n");
+    printf("Writer: group %d %"PRIu64" writes in %10.3f s, %10.3f Mops/s \n",
+           a->group, num_writes, total, (num_writes/total)/1e6);
+    printf("Writer: group %d shm_size %"PRIu64" stalls %"PRIu64" "
+           "(%10.6f per write) \n", a->group, get_shm_size(),
+           shm_queue_stalls(q), (double) shm_queue_stalls(q)/num_writes);
+    printf("###################################################\n");
     return 0;
 }
 
-void* thr_reader(void* arg)
+static void* thr_reader(void* arg)
 {
-    cpu_set_t cpu_mask;
+    struct thr_arg* a = (struct thr_arg*) arg;
+    uint64_t* wrong = &num_wrong[a->group][a->id-1];
 
-    CPU_ZERO(&cpu_mask);
-    CPU_SET((uint64_t) arg, &cpu_mask);
+    shm_queue_t* q = shm_reader_create(a->id-1, thr_core(a), num_readers,
+                                       cmd_size, false, a->group, NULL, NULL);
 
-    sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask);
-  
-    init_shm_reader((((uint64_t) arg)-1),
-                    (uint64_t) arg,
-                    num_readers,
-                    sizeof(cmd_t),
-                    false,
-                    0,
-                    //shared_mem,
-                    NULL,
-                    exec_fn);
-
-    uint64_t previous = 0;
-    uint64_t result;
-    uint64_t num_wrong = 0;
-    while(true) {
-        void* cmd = NULL;
-        while (cmd == NULL) {
-            cmd = shm_read();
-            if (cmd == NULL) {
-                // thread_yield();
-            } else {
-                result = ((cmd_t*) cmd)->val3;
-                if (result == (previous+1)) {
-                    previous++;
-                    if (result == NUM_WRITES) {
-                        goto exit;
-                    }
-                } else {
-                    num_wrong++;
-                }
+    uint64_t seq = 1;
+    while (seq <= num_writes) {
+        uint64_t* cmd = shm_queue_read(q);
+        if (cmd == NULL) {
+            continue;
+        }
+
+        uint16_t len = cmd_len(seq);
+        if (shm_cmd_len(cmd) != len) {
+            (*wrong)++;
+        }
+
+        for (int i = 0; i < CONS_CMD_WORDS(len); i++) {
+            if (cmd[i] != seq+i) {
+                (*wrong)++;
+                break;
             }
         }
+        seq++;
     }
-    
-exit:
+
     printf("###################################################\n");
-    if (num_wrong) {
-        printf("Reader %"PRIu64": Test Failed \n", ((uint64_t)arg)-1);
+    if (*wrong) {
+        printf("Reader %d.%d: Test Failed (%"PRIu64" wrong) \n", a->group,
+               a->id-1, *wrong);
     } else {
-        printf("Reader %"PRIu64": Test Succeeded \n", ((uint64_t)arg)-1);
+        printf("Reader %d.%d: Test Succeeded \n", a->group, a->id-1);
     }
     printf("###################################################\n");
     return 0;
@@ -145,18 +143,57 @@ exit:
 
 int main(int argc, char ** argv)
 {
-    shared_mem = malloc(SHM_SIZE);
-    pthread_t *tids = malloc((num_readers+1)*sizeof(pthread_t));
-    printf("SHM test started \n");
-    for (uint64_t i = 0; i < num_readers; i++) {
-        pthread_create(&tids[i], NULL, thr_reader, (void*) i+1);
+    if (argc > 1) {
+        num_readers = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        num_writes = strtoull(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        cmd_size = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        set_shm_size(strtoull(argv[4], NULL, 10));
+    }
+    if (argc > 5) {
+        num_groups = atoi(argv[5]);
+    }
+
+    if ((num_readers < 1) || (num_readers > MAX_READERS) ||
+        (num_groups < 1) || (num_groups > MAX_GROUPS) ||
+        (get_shm_size() < 4096) || (cmd_size < sizeof(uint64_t)) ||
+        (cmd_size > shm_max_cmd_size(num_readers))) {
+        printf("usage: %s [num_readers (1-%d)] [num_writes] [cmd_size (8-%d)] "
+               "[shm_size (>= 4096)] [num_groups (1-%d)] \n",
+               argv[0], MAX_READERS, CONS_MAX_CMD_SIZE, MAX_GROUPS);
+        return 1;
+    }
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_thr = num_groups*(num_readers+1);
+    pthread_t *tids = malloc(num_thr*sizeof(pthread_t));
+    struct thr_arg *args = malloc(num_thr*sizeof(struct thr_arg));
+
+    printf("SHM test started: %d groups, %d readers, %"PRIu64" writes, "
+           "%d bytes \n", num_groups, num_readers, num_writes, cmd_size);
+    // id 0 of a group is the writer, the readers have id 1 to num_readers
+    for (int i = 0; i < num_thr; i++) {
+        args[i].group = i / (num_readers+1);
+        args[i].id = i % (num_readers+1);
+        pthread_create(&tids[i], NULL, args[i].id ? thr_reader : thr_writer,
+                       &args[i]);
     }
-    printf("SHM readers started \n");
-    sleep(3);
-    pthread_create(&tids[num_readers], NULL, thr_writer, (void*) 0); 
-    printf("SHM writer started \n");
-    for (int i = 0; i < num_readers; i++) {
+
+    for (int i = 0; i < num_thr; i++) {
         pthread_join(tids[i], NULL);
     }
-}
 
+    for (int g = 0; g < num_groups; g++) {
+        for (int i = 0; i < num_readers; i++) {
+            if (num_wrong[g][i]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# Runs the shared memory queue test with increasing queue sizes to see
+# how often the writer stalls waiting for the readers
+# usage: ./run_shm_size_sweep.sh [num_readers] [num_writes] [cmd_size]
+
+READERS=${1:-3}
+WRITES=${2:-1000000}
+CMD_SIZE=${3:-24}
+
+declare -a sizes=(4096 8192 16384 65536 262144 2097152)
+
+for s in "${sizes[@]}"
+do
+    ./shm_test $READERS $WRITES $CMD_SIZE $s | grep "Writer:\|Failed" \
+        || exit 1
+done
+
+exit 0
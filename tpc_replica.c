@@ -29,6 +29,7 @@
 #include "internal_com_layer.h"
 #include "tpc_replica.h"
 #include "client.h"
+#include "doorbell.h"
 
 
 #define TPC_PREP 3
@@ -51,8 +52,8 @@ typedef struct tpc_replica_t{
     uint8_t* clients;
     uint8_t* replicas;
 
-    // for each client there can be only
-    // one request around
+    // for each client there can be up to
+    // MAX_WINDOW requests around
     uint8_t *ready_counter;
     uint8_t *ack_counter;
 
@@ -87,7 +88,13 @@ static void handle_verify(uintptr_t* msg);
 static crc_t verify(void);
 #endif
 
-static void update_value(uint64_t* cmd);
+static void update_value(uintptr_t* msg);
+
+// counter slot of a request, clients pipeline up to MAX_WINDOW requests
+static inline uint16_t request_slot(uintptr_t* msg)
+{
+    return (get_client_id(msg)*MAX_WINDOW) + (get_request_id(msg) % MAX_WINDOW);
+}
 
 // Throughput mesaurement
 #ifdef MEASURE_TP
@@ -102,8 +109,8 @@ static incr_stats avg;
 
 
 // smlt related
-extern struct smlt_context* ctx;
-extern struct smlt_topology* topo;
+extern __thread struct smlt_context* ctx;
+extern __thread struct smlt_topology* topo;
 
 static void print_results_tpc(tpc_replica_t* rep) {
 
@@ -217,7 +224,7 @@ errval_t operation(struct smlt_msg* m1, struct smlt_msg* m2)
 void message_handler_loop_tpc(void)
 {
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(CONS_MSG_SIZE);
     if (tpc_replica.id == 0) {
         int j = 0;
         
@@ -258,6 +265,8 @@ void message_handler_loop_tpc(void)
                     message_handler_tpc(message);
 
                 }
+            } else {
+                com_layer_core_poll();
             }
             j++;
 
@@ -266,6 +275,11 @@ void message_handler_loop_tpc(void)
     
     } else {
         while (true) {
+            // a partial batch for the core level is sent after its delay
+            if (!smlt_broadcast_can_recv(ctx)) {
+                com_layer_core_poll();
+                continue;
+            }
             // TODO context
             smlt_broadcast(ctx, message);
             if (get_tag(message->data) == TPC_PREP) {
@@ -283,37 +297,28 @@ void message_handler_loop_tpc(void)
 {
 
     errval_t err;
-    struct smlt_msg* message = smlt_message_alloc(56);
+    struct smlt_msg* message = smlt_message_alloc(CONS_MSG_SIZE);
+    idle_state_t idle;
+    idle_init(&idle, com_layer_core_busy);
     if (tpc_replica.id == 0) {
-        int j = 0;
-        uint8_t* all_cores = (uint8_t*) malloc(sizeof(uint8_t)* (tpc_replica.num_replicas +
-                                tpc_replica.num_clients));
-        for (int i = 0; i < tpc_replica.num_replicas; i++) {
-            all_cores[i] = tpc_replica.replicas[i];
-        }
-
-        for (int i = tpc_replica.num_replicas; i < (tpc_replica.num_replicas+ 
-            tpc_replica.num_clients); i++) {
-            all_cores[i] = tpc_replica.clients[(i-tpc_replica.num_replicas)];
-        }
+        doorbell_loop_t loop;
+        doorbell_loop_init(&loop, tpc_replica.current_core,
+                           tpc_replica.replicas, tpc_replica.num_replicas,
+                           tpc_replica.clients, tpc_replica.num_clients);
 
         while (true) {
-            if (smlt_can_recv(all_cores[j])) {
-                if (all_cores[j] == tpc_replica.current_core) {
-                    j++;
-                    j = j % (tpc_replica.num_clients+ tpc_replica.num_clients);
-                    continue;
-                }
-
-                err = smlt_recv(all_cores[j], message);
+            int core = doorbell_next(&loop, true);
+            if (core >= 0) {
+                err = smlt_recv(core, message);
                 if (smlt_err_is_fail(err)) {
                     // TODO;
                 }
                 message_handler_tpc(message);
-            }    
-            j++;
-
-            j = j % (tpc_replica.num_replicas + tpc_replica.num_clients);
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle(&loop, &idle);
+            }
         }
 
     } else {
@@ -324,7 +329,11 @@ void message_handler_loop_tpc(void)
                     // TODO;
                 }
                 message_handler_tpc(message);
-            }    
+                idle_reset(&idle);
+            } else {
+                com_layer_core_poll();
+                doorbell_idle_core(tpc_replica.replicas[0], &idle);
+            }
         }
     }
 }
@@ -371,7 +380,7 @@ static void handle_setup(struct smlt_msg* msg)
         }
     }
 
-    err = smlt_send(core, msg);
+    err = doorbell_send(core, msg);
     if (smlt_err_is_fail(err)) {
        // TODO   
     }
@@ -392,8 +401,8 @@ static void handle_request(struct smlt_msg* msg)
 #endif
     if (tpc_replica.id == 0) {
         // reset counters for acks/ready messages
-        tpc_replica.ready_counter[get_client_id(msg->data)] = 0;
-        tpc_replica.ack_counter[get_client_id(msg->data)] = 0;
+        tpc_replica.ready_counter[request_slot(msg->data)] = 0;
+        tpc_replica.ack_counter[request_slot(msg->data)] = 0;
 
         // send to all replicas
         set_tag(msg->data, TPC_PREP);
@@ -401,14 +410,14 @@ static void handle_request(struct smlt_msg* msg)
         smlt_broadcast(ctx, msg);
 #else
         for (int i = 1; i < tpc_replica.num_replicas; i++) {
-            err = smlt_send(tpc_replica.replicas[i], msg);
+            err = doorbell_send(tpc_replica.replicas[i], msg);
             if (smlt_err_is_fail(err)) {
                 // TODO
             }
         }   
 #endif
     } else {
-        err = smlt_send(tpc_replica.replicas[0], msg);
+        err = doorbell_send(tpc_replica.replicas[0], msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }
@@ -424,7 +433,7 @@ static void handle_prepare(struct smlt_msg* msg)
     errval_t err;
     if (tpc_replica.id != 0) {
         set_tag(msg->data, TPC_RDY);
-        err = smlt_send(tpc_replica.replicas[0], msg);
+        err = doorbell_send(tpc_replica.replicas[0], msg);
         if (smlt_err_is_fail(err)) {
             // TODO
         }   
@@ -447,11 +456,11 @@ static void handle_ready(struct smlt_msg* msg)
  
         smlt_broadcast(ctx, msg);
   
-        update_value(&msg->data[4]);
+        update_value(msg->data);
 
         set_tag(msg->data, RESP_TAG);
  
-        err = smlt_send(tpc_replica.clients[get_client_id(msg->data)], msg);       
+        err = doorbell_send(tpc_replica.clients[get_client_id(msg->data)], msg);       
         if (smlt_err_is_fail(err)) {
             // TODO
         }   
@@ -473,9 +482,9 @@ static void handle_ready(struct smlt_msg* msg)
                                tpc_replica.id, msg[1], msg[2]);
 #endif
     if (tpc_replica.id == 0) {
-        tpc_replica.ready_counter[get_client_id(msg->data)]++;   
+        tpc_replica.ready_counter[request_slot(msg->data)]++;   
 
-        if (tpc_replica.ready_counter[get_client_id(msg->data)] >= 
+        if (tpc_replica.ready_counter[request_slot(msg->data)] >= 
              (tpc_replica.num_replicas-1)) {
 
             // TODO Broadcast COMMIT
@@ -484,7 +493,7 @@ static void handle_ready(struct smlt_msg* msg)
             msg->data[3] = tpc_replica.index;
 
             for (int i = 1; i < tpc_replica.num_replicas; i++) {
-                err = smlt_send(tpc_replica.replicas[i], msg);
+                err = doorbell_send(tpc_replica.replicas[i], msg);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
@@ -493,7 +502,7 @@ static void handle_ready(struct smlt_msg* msg)
             rid_history[replica.index] = msg[2];
             cid_history[replica.index] = msg[1];
 #endif	
-            update_value(&msg->data[4]);
+            update_value(msg->data);
             
             // send to CORE level            
             if ((tpc_replica.alg_below != ALG_NONE)) {
@@ -503,13 +512,13 @@ static void handle_ready(struct smlt_msg* msg)
             if (tpc_replica.level == NODE_LEVEL) {
                 set_tag(msg->data, RESP_TAG);
 
-                err = smlt_send(tpc_replica.clients[get_client_id(msg->data)], msg);
+                err = doorbell_send(tpc_replica.clients[get_client_id(msg->data)], msg);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
             } else {
                 set_tag(msg->data, RESP_TAG);
-                err = smlt_send(tpc_replica.started_from_id, msg);
+                err = doorbell_send(tpc_replica.started_from_id, msg);
                 if (smlt_err_is_fail(err)) {
                     // TODO
                 }
@@ -530,7 +539,7 @@ static void handle_commit(struct smlt_msg* msg)
 {
     if (tpc_replica.id != 0) {
         // execute request
-        update_value(&msg->data[4]);   
+        update_value(msg->data);   
         if (tpc_replica.alg_below != ALG_NONE) {
             com_layer_core_send_request(msg);
         }
@@ -618,15 +627,17 @@ void init_replica_tpc(uint8_t id,
 #endif
 
     if (id == 0) {
-        tpc_replica.ready_counter = (uint8_t*) malloc(sizeof(uint8_t)*MAX_NUM_CLIENTS);
-        tpc_replica.ack_counter = (uint8_t*) malloc(sizeof(uint8_t)*MAX_NUM_CLIENTS);	
+        tpc_replica.ready_counter = (uint8_t*) calloc(MAX_NUM_CLIENTS*MAX_WINDOW,
+                                                      sizeof(uint8_t));
+        tpc_replica.ack_counter = (uint8_t*) calloc(MAX_NUM_CLIENTS*MAX_WINDOW,
+                                                    sizeof(uint8_t));
     }
 
     // start algo below
     if (tpc_replica.alg_below != ALG_NONE) {
         com_layer_core_init(tpc_replica.alg_below, tpc_replica.id, 
                       tpc_replica.current_core, 
-                      tpc_replica.cores, tpc_replica.node_size, 3*sizeof(uint64_t), 
+                      tpc_replica.cores, tpc_replica.node_size, consensus_get_cmd_size(), 
                       tpc_replica.exec_fn);
     }
 
@@ -638,9 +649,9 @@ void init_replica_tpc(uint8_t id,
 #endif
 }
 
-static void update_value(uint64_t* cmd)
+static void update_value(uintptr_t* msg)
 {
-    tpc_replica.exec_fn((void *) cmd);
+    consensus_exec_cmd(tpc_replica.exec_fn, &msg[CONS_HDR_WORDS], get_cmd_len(msg));
     return;
 }
 